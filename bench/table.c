@@ -0,0 +1,93 @@
+// Hash table microbenchmarks.
+//
+// Build and run with 'make bench && ./bin/table_bench'.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "mem.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+#define KEYS_COUNT 200000
+#define ROUNDS 20
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double start, long operations) {
+    double elapsed = now() - start;
+    printf("%-24s %8.2f ns/op\n", name, elapsed * 1e9 / operations);
+}
+
+int main(void) {
+    static RavString *keys[KEYS_COUNT];
+    static char names[KEYS_COUNT][16];
+    static int lengths[KEYS_COUNT];
+
+    Allocator allocator;
+    init_allocator(&allocator);
+    allocator.gc_off = true;
+
+    for (int i = 0; i < KEYS_COUNT; i++) {
+        lengths[i] = snprintf(names[i], sizeof names[i], "key_%d", i);
+    }
+
+    // Interning (table_interned miss + table_set on the strings table).
+    double start = now();
+    for (int i = 0; i < KEYS_COUNT; i++) {
+        keys[i] = new_string(&allocator, names[i], lengths[i]);
+    }
+    report("intern (new)", start, KEYS_COUNT);
+
+    // Interning already interned strings (table_interned hit).
+    start = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < KEYS_COUNT; i++) {
+            keys[i] = new_string(&allocator, names[i], lengths[i]);
+        }
+    }
+    report("intern (existing)", start, (long)ROUNDS * KEYS_COUNT);
+
+    Table table;
+    init_table(&table);
+
+    start = now();
+    for (int i = 0; i < KEYS_COUNT; i++) {
+        table_set(&table, keys[i], Num_Value(i));
+    }
+    report("set (insert)", start, KEYS_COUNT);
+
+    double sum = 0;
+    start = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < KEYS_COUNT; i++) {
+            Value value;
+            if (table_get(&table, keys[i], &value)) sum += As_Num(value);
+        }
+    }
+    report("get (hit)", start, (long)ROUNDS * KEYS_COUNT);
+
+    // Half of the keys are removed, the lookups of the other half
+    // probe through the tombstones left behind.
+    for (int i = 0; i < KEYS_COUNT; i += 2) table_remove(&table, keys[i]);
+
+    start = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < KEYS_COUNT; i++) {
+            Value value;
+            if (table_get(&table, keys[i], &value)) sum += As_Num(value);
+        }
+    }
+    report("get (50% tombstones)", start, (long)ROUNDS * KEYS_COUNT);
+
+    printf("(checksum %g)\n", sum);
+
+    free_table(&table);
+    free_allocator(&allocator);
+    return 0;
+}
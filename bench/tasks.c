@@ -0,0 +1,90 @@
+// Task scheduler benchmark, embarrassingly parallel work (independent
+// calls of a recursive fib) run by one worker, then one worker per core.
+//
+// Build and run with 'make bench && ./bin/tasks_bench'.
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "raven.h"
+#include "value.h"
+#include "vm.h"
+
+#define TASKS_COUNT 64
+#define FIB_N 24
+
+static const char *source =
+    "fn fib(n) if n < 2 do n else fib(n - 1) + fib(n - 2) end end\n"
+    "fn run(n)\n"
+    "  let i = 0;\n"
+    "  let sum = 0;\n"
+    "  while i < 4 do\n"
+    "    sum = sum + fib(n)\n"
+    "    i = i + 1\n"
+    "  end\n"
+    "  sum\n"
+    "end\n";
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Run the tasks on a given number of workers, and return the elapsed
+// time, or -1 on error.
+static double run_tasks(int workers, double *checksum) {
+    static RavTask *tasks[TASKS_COUNT];
+    VM vm;
+    init_vm(&vm);
+
+    double elapsed = -1;
+    RavScript *script = prepare_script(&vm, source, "tasks");
+    Value run;
+
+    if (script == NULL || run_script(&vm, script) != INTERPRET_OK ||
+        !get_global(&vm, "run", &run) || !start_scheduler(&vm, workers)) {
+        goto done;
+    }
+
+    double start = now();
+    Value n = Num_Value(FIB_N);
+
+    for (int i = 0; i < TASKS_COUNT; i++) {
+        tasks[i] = spawn_task(&vm, run, 1, &n);
+    }
+
+    *checksum = 0;
+    for (int i = 0; i < TASKS_COUNT; i++) {
+        Value result;
+        if (await_task(&vm, tasks[i], &result) != INTERPRET_OK) goto done;
+        *checksum += As_Num(result);
+    }
+
+    elapsed = now() - start;
+
+done:
+    if (script != NULL) release_script(&vm, script);
+    free_vm(&vm);
+    return elapsed;
+}
+
+int main(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int)cores : 1;
+    double checksum;
+
+    double serial = run_tasks(1, &checksum);
+    if (serial < 0) return 1;
+    printf("%-24s %8.3f s\n", "tasks (1 worker)", serial);
+
+    double parallel = run_tasks(workers, &checksum);
+    if (parallel < 0) return 1;
+    char name[32];
+    snprintf(name, sizeof name, "tasks (%d workers)", workers);
+    printf("%-24s %8.3f s (%.2fx)\n", name, parallel, serial / parallel);
+
+    printf("(checksum %g)\n", checksum);
+    return 0;
+}
@@ -0,0 +1,944 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtin.h"
+#include "common.h"
+#include "isolate.h"
+#include "mem.h"
+#include "object.h"
+#include "raven.h"
+#include "scheduler.h"
+#include "simd.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// Builtin Native Functions
+
+// Convert a value to a valid array index in the range [0, limit],
+// report a runtime error and return -1 otherwise.
+static long array_index(VM *vm, const char *name, Value value,
+                        size_t limit) {
+    if (!Is_Num(value)) {
+        runtime_error(vm, "'%s': index must be numeric", name);
+        return -1;
+    }
+
+    // The cast of a NaN is undefined, the infinities are out of bound.
+    double index = As_Num(value);
+    if (isnan(index)) {
+        runtime_error(vm, "'%s': index must be a number, not NaN", name);
+        return -1;
+    }
+
+    if (index < 0 || index > (double)limit) {
+        runtime_error(vm, "'%s': index out of bound %g > %ld", name,
+                      index, (long)limit);
+        return -1;
+    }
+
+    return (long)index;
+}
+
+// Report a runtime error and return false if a collection to modify
+// is frozen.
+static bool check_mutable(VM *vm, const char *name, Value value) {
+    if (Is_Frozen(value)) {
+        runtime_error(vm, "'%s': cannot modify a frozen value", name);
+        return false;
+    }
+
+    return true;
+}
+
+static Value len_native(VM *vm, int count, Value *args) {
+    (void)count;
+    Value value = args[0];
+
+    if (Is_Array(value)) return Num_Value((double)As_Array(value)->count);
+    if (Is_Typed_Array(value)) {
+        return Num_Value((double)As_Typed_Array(value)->count);
+    }
+    if (Is_String(value)) return Num_Value(As_String(value)->length);
+    if (Is_Map(value)) return Num_Value(As_Map(value)->dict.count);
+
+    if (Is_Nil(value) || Is_Pair(value)) {
+        double length = 0;
+
+        for (; Is_Pair(value); value = As_Pair(value)->tail) length++;
+        return Num_Value(length);
+    }
+
+    runtime_error(vm, "'len': applied to a non-collection");
+    return Void_Value;
+}
+
+// Print the arguments separated by spaces, the strings without quotes.
+static Value print_native(VM *vm, int count, Value *args) {
+    (void)vm;
+
+    for (int i = 0; i < count; i++) {
+        if (i > 0) putchar(' ');
+
+        if (Is_String(args[i])) {
+            fputs(As_CString(args[i]), stdout);
+        } else {
+            print_value(args[i]);
+        }
+    }
+
+    putchar('\n');
+    return Nil_Value;
+}
+
+static Value typ_native(VM *vm, int count, Value *args) {
+    (void)count;
+    Value value = args[0];
+    const char *name = "nil";
+
+    if (Is_Bool(value)) {
+        name = "boolean";
+    } else if (Is_Num(value)) {
+        name = "number";
+    } else if (Is_Obj(value)) {
+        switch (Obj_Type(value)) {
+        case OBJ_STRING:      name = "string"; break;
+        case OBJ_PAIR:        name = "list"; break;
+        case OBJ_ARRAY:       name = "array"; break;
+        case OBJ_TYPED_ARRAY: name = "typed array"; break;
+        case OBJ_MAP:         name = "map"; break;
+        case OBJ_COROUTINE:   name = "coroutine"; break;
+        case OBJ_FUTURE:      name = "future"; break;
+        default:              name = "function"; break;
+        }
+    }
+
+    return Obj_Value(new_string(&vm->allocator, name, (int)strlen(name)));
+}
+
+static Value hd_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Pair(args[0])) {
+        runtime_error(vm, "'hd': bad argument type, non-empty list is "
+                          "expected");
+        return Void_Value;
+    }
+
+    return As_Pair(args[0])->head;
+}
+
+static Value tl_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Pair(args[0])) {
+        runtime_error(vm, "'tl': bad argument type, non-empty list is "
+                          "expected");
+        return Void_Value;
+    }
+
+    return As_Pair(args[0])->tail;
+}
+
+static Value array_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Num(args[0]) || !isfinite(As_Num(args[0])) ||
+        As_Num(args[0]) < 0) {
+        runtime_error(vm, "'array': capacity must be a non-negative "
+                          "number");
+        return Void_Value;
+    }
+
+    if (As_Num(args[0]) > CAPACITY_LIMIT) {
+        runtime_error(vm, "'array': capacity exceeds the limit %lu",
+                      CAPACITY_LIMIT);
+        return Void_Value;
+    }
+
+    size_t capacity = (size_t)As_Num(args[0]);
+    RavArray *array = new_array_capacity(&vm->allocator, capacity);
+    if (array == NULL) {
+        runtime_error(vm, "'array': cannot allocate the capacity");
+        return Void_Value;
+    }
+
+    return Obj_Value(array);
+}
+
+static Value push_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Array(args[0])) {
+        runtime_error(vm, "'push': bad argument type, array is expected");
+        return Void_Value;
+    }
+    if (!check_mutable(vm, "push", args[0])) return Void_Value;
+
+    array_push(&vm->allocator, As_Array(args[0]), args[1]);
+    return Nil_Value;
+}
+
+static Value pop_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Array(args[0])) {
+        runtime_error(vm, "'pop': bad argument type, array is expected");
+        return Void_Value;
+    }
+    if (!check_mutable(vm, "pop", args[0])) return Void_Value;
+
+    RavArray *array = As_Array(args[0]);
+    if (array->count == 0) {
+        runtime_error(vm, "passed empty array to 'pop'");
+        return Void_Value;
+    }
+
+    return array_pop(&vm->allocator, array);
+}
+
+static Value insert_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Array(args[0])) {
+        runtime_error(vm, "'insert': bad argument type, array is expected");
+        return Void_Value;
+    }
+    if (!check_mutable(vm, "insert", args[0])) return Void_Value;
+
+    RavArray *array = As_Array(args[0]);
+    long index = array_index(vm, "insert", args[1], array->count);
+    if (index == -1) return Void_Value;
+
+    array_insert(&vm->allocator, array, (size_t)index, args[2]);
+    return Nil_Value;
+}
+
+static Value slice_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Array(args[0])) {
+        runtime_error(vm, "'slice': bad argument type, array is expected");
+        return Void_Value;
+    }
+
+    RavArray *array = As_Array(args[0]);
+
+    long start = array_index(vm, "slice", args[1], array->count);
+    if (start == -1) return Void_Value;
+
+    long end = array_index(vm, "slice", args[2], array->count);
+    if (end == -1) return Void_Value;
+
+    if (end < start) end = start;
+
+    // The source array is still on the vm stack (args), so it's
+    // safe if the allocation of the new array triggers the GC.
+    RavArray *slice = new_array(&vm->allocator, array->values + start,
+                                (size_t)(end - start));
+    return Obj_Value(slice);
+}
+
+/** Higher-Order Functions **/
+
+// These natives call back Raven functions, through 'call_function'. The
+// callbacks may trigger the GC, so every object the native holds
+// outside of its arguments is pinned, and the callbacks may mutate the
+// collections, so their count is read again at each step.
+
+// Merge the sorted runs src[low, middle) and src[middle, high) into dst,
+// the left element goes first unless 'less(right, left)'. Return false
+// if a call of the predicate failed.
+static bool merge_runs(VM *vm, Value less, Value *src, Value *dst,
+                       size_t low, size_t middle, size_t high) {
+    size_t i = low, j = middle, k = low;
+
+    // Already in order, as when the input is sorted.
+    if (i < middle && j < high) {
+        Value pair[2] = {src[middle], src[middle - 1]};
+        Value result;
+
+        if (call_function(vm, less, 2, pair, &result) != INTERPRET_OK) {
+            return false;
+        }
+        if (is_falsy(result)) {
+            while (k < high) dst[k++] = src[i++];
+            return true;
+        }
+    }
+
+    while (i < middle && j < high) {
+        Value pair[2] = {src[j], src[i]};
+        Value result;
+
+        if (call_function(vm, less, 2, pair, &result) != INTERPRET_OK) {
+            return false;
+        }
+        dst[k++] = is_falsy(result) ? src[i++] : src[j++];
+    }
+
+    while (i < middle) dst[k++] = src[i++];
+    while (j < high) dst[k++] = src[j++];
+    return true;
+}
+
+// Return a sorted copy of an array, by a predicate telling if its first
+// argument goes before its second one. The sort is stable, it's a
+// bottom-up merge sort.
+static Value sort_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Array(args[0])) {
+        runtime_error(vm, "'sort': bad argument type, array is expected");
+        return Void_Value;
+    }
+
+    RavArray *array = As_Array(args[0]);
+    size_t length = array->count;
+
+    RavArray *sorted = new_array_capacity(&vm->allocator, length);
+    for (size_t i = 0; i < length; i++) {
+        sorted->values[i] = array->values[i];
+    }
+    sorted->count = length;
+    pin_value(vm, Obj_Value(sorted));
+
+    // The merge buffer is a copy too, so it's always safe for the GC to
+    // mark, whichever of the two holds the last merged runs.
+    RavArray *buffer = new_array_capacity(&vm->allocator, length);
+    for (size_t i = 0; i < length; i++) {
+        buffer->values[i] = sorted->values[i];
+    }
+    buffer->count = length;
+    pin_value(vm, Obj_Value(buffer));
+
+    Value *src = sorted->values, *dst = buffer->values;
+    bool done = true;
+
+    for (size_t width = 1; done && width < length; width *= 2) {
+        for (size_t low = 0; low < length; low += 2 * width) {
+            size_t middle = low + width < length ? low + width : length;
+            size_t high = middle + width < length ? middle + width : length;
+
+            if (!merge_runs(vm, args[1], src, dst, low, middle, high)) {
+                done = false;
+                break;
+            }
+        }
+
+        Value *swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    unpin_value(vm, Obj_Value(buffer));
+    unpin_value(vm, Obj_Value(sorted));
+    if (!done) return Void_Value;
+
+    // The last merge went into the buffer.
+    if (src != sorted->values) {
+        buffer->values = sorted->values;
+        sorted->values = src;
+    }
+
+    return Obj_Value(sorted);
+}
+
+// Apply a function to each element of an array or a list, and return
+// the results in a collection of the same kind.
+static Value map_native(VM *vm, int count, Value *args) {
+    (void)count;
+    Value value = args[1];
+
+    if (!Is_Array(value) && !Is_Pair(value) && !Is_Nil(value)) {
+        runtime_error(vm, "'map': bad argument type, array or list is "
+                          "expected");
+        return Void_Value;
+    }
+
+    size_t length = 0;
+    if (Is_Array(value)) {
+        length = As_Array(value)->count;
+    } else {
+        for (; Is_Pair(value); value = As_Pair(value)->tail) length++;
+    }
+
+    // The results are stored without growing the array, so there is no
+    // allocation between a call and the storage of its result.
+    RavArray *results = new_array_capacity(&vm->allocator, length);
+    pin_value(vm, Obj_Value(results));
+
+    value = args[1];
+    for (size_t i = 0; i < length; i++) {
+        Value element;
+
+        if (Is_Array(value)) {
+            RavArray *array = As_Array(value);
+            if (i >= array->count) break;
+            element = array->values[i];
+        } else {
+            element = As_Pair(value)->head;
+            value = As_Pair(value)->tail;
+        }
+
+        Value result;
+        if (call_function(vm, args[0], 1, &element, &result) !=
+            INTERPRET_OK) {
+            unpin_value(vm, Obj_Value(results));
+            return Void_Value;
+        }
+
+        results->values[results->count++] = result;
+    }
+
+    unpin_value(vm, Obj_Value(results));
+    if (Is_Array(args[1])) return Obj_Value(results);
+
+    // The list is built from its end, the pairs aren't reachable until
+    // it's returned.
+    bool gc_off = vm->allocator.gc_off;
+    vm->allocator.gc_off = true;
+
+    Value list = Nil_Value;
+    for (size_t i = results->count; i > 0; i--) {
+        list = Obj_Value(new_pair(&vm->allocator, results->values[i - 1],
+                                  list));
+    }
+
+    vm->allocator.gc_off = gc_off;
+    return list;
+}
+
+// Combine the elements of an array or a list from the left, as
+// 'f(... f(f(acc, x0), x1) ..., xn)'.
+static Value fold_native(VM *vm, int count, Value *args) {
+    (void)count;
+    Value value = args[2];
+
+    if (!Is_Array(value) && !Is_Pair(value) && !Is_Nil(value)) {
+        runtime_error(vm, "'fold': bad argument type, array or list is "
+                          "expected");
+        return Void_Value;
+    }
+
+    // The accumulator is kept in its argument slot, on the vm stack.
+    for (size_t i = 0;; i++) {
+        Value pair[2] = {args[1], Nil_Value};
+
+        if (Is_Array(value)) {
+            RavArray *array = As_Array(value);
+            if (i >= array->count) break;
+            pair[1] = array->values[i];
+        } else if (Is_Pair(value)) {
+            pair[1] = As_Pair(value)->head;
+            value = As_Pair(value)->tail;
+        } else {
+            break;
+        }
+
+        if (call_function(vm, args[0], 2, pair, &args[1]) !=
+            INTERPRET_OK) {
+            return Void_Value;
+        }
+    }
+
+    return args[1];
+}
+
+/** Isolates **/
+
+// Start an isolate calling a function with the given arguments, in a
+// new thread, and return its handle for 'join'.
+static Value spawn_native(VM *vm, int count, Value *args) {
+    if (count == 0 || (!Is_Closure(args[0]) && !Is_Native(args[0]))) {
+        runtime_error(vm, "'spawn': bad argument type, function is "
+                          "expected");
+        return Void_Value;
+    }
+
+    RavIsolate *isolate = spawn_isolate(vm, args[0], count - 1, args + 1);
+    if (isolate == NULL) {
+        runtime_error(vm, "'spawn': cannot start a thread");
+        return Void_Value;
+    }
+
+    if (vm->isolates_count == vm->isolates_capacity) {
+        vm->isolates_capacity = Grow_Capacity(vm->isolates_capacity);
+        vm->isolates = realloc(vm->isolates, vm->isolates_capacity *
+                                             sizeof (RavIsolate *));
+    }
+
+    vm->isolates[vm->isolates_count] = isolate;
+    return Num_Value((double)vm->isolates_count++);
+}
+
+// Wait for an isolate to finish, and return the result of its function.
+static Value join_native(VM *vm, int count, Value *args) {
+    (void)count;
+    long handle = array_index(vm, "join", args[0], vm->isolates_count);
+    if (handle == -1) return Void_Value;
+
+    if (handle == vm->isolates_count || vm->isolates[handle] == NULL) {
+        runtime_error(vm, "'join': not a running isolate");
+        return Void_Value;
+    }
+
+    RavIsolate *isolate = vm->isolates[handle];
+    vm->isolates[handle] = NULL;
+
+    Value result;
+    if (join_isolate(vm, isolate, &result) != INTERPRET_OK) {
+        runtime_error(vm, "'join': the isolate failed");
+        return Void_Value;
+    }
+
+    return result;
+}
+
+static Value freeze_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    Value frozen = freeze_value(vm, args[0]);
+    if (Is_Void(frozen)) {
+        runtime_error(vm, "'freeze': a function, a coroutine or a future "
+                          "can't be frozen");
+    }
+
+    return frozen;
+}
+
+static Value frozen_native(VM *vm, int count, Value *args) {
+    (void)vm;
+    (void)count;
+
+    return Bool_Value(Is_Frozen(args[0]));
+}
+
+/** Coroutines **/
+
+// Return a suspended coroutine, running a function of at most one
+// parameter once resumed.
+static Value coroutine_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Closure(args[0]) || As_Closure(args[0])->function->arity > 1) {
+        runtime_error(vm, "'coroutine': bad argument type, function of at "
+                          "most one parameter is expected");
+        return Void_Value;
+    }
+
+    return Obj_Value(new_coroutine(&vm->allocator, As_Closure(args[0])));
+}
+
+// Switch to a suspended coroutine, passing it a value (nil by default),
+// the call returns the next value it yields, or its function result.
+static Value resume_native(VM *vm, int count, Value *args) {
+    if (count == 0 || count > 2 || !Is_Coroutine(args[0])) {
+        runtime_error(vm, "'resume': expect a coroutine and an optional "
+                          "value");
+        return Void_Value;
+    }
+
+    RavCoroutine *coroutine = As_Coroutine(args[0]);
+    if (coroutine->state != COROUTINE_SUSPENDED) {
+        runtime_error(vm, "'resume': the coroutine is %s",
+                      coroutine->state == COROUTINE_DEAD ? "dead"
+                                                         : "running");
+        return Void_Value;
+    }
+
+    // The switch is performed by the vm once the call fails.
+    vm->switching = true;
+    vm->switch_to = coroutine;
+    vm->switch_value = count == 2 ? args[1] : Nil_Value;
+    return Void_Value;
+}
+
+// Suspend the running coroutine, passing a value (nil by default) to its
+// resumer, the call returns the value of the next resume.
+static Value yield_native(VM *vm, int count, Value *args) {
+    if (count > 1) {
+        runtime_error(vm, "'yield': expect an optional value");
+        return Void_Value;
+    }
+
+    if (vm->coroutine == NULL) {
+        runtime_error(vm, "'yield': outside of a coroutine");
+        return Void_Value;
+    }
+
+    if (vm->coroutine->depth != vm->callback_depth) {
+        runtime_error(vm, "'yield': cannot yield across a native call");
+        return Void_Value;
+    }
+
+    vm->switching = true;
+    vm->switch_to = NULL;
+    vm->switch_value = count == 1 ? args[0] : Nil_Value;
+    return Void_Value;
+}
+
+static Value done_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    if (!Is_Coroutine(args[0])) {
+        runtime_error(vm, "'done': bad argument type, coroutine is "
+                          "expected");
+        return Void_Value;
+    }
+
+    return Bool_Value(As_Coroutine(args[0])->state == COROUTINE_DEAD);
+}
+
+/** Tasks **/
+
+// Spawn a task calling a function with the given arguments, on a worker
+// of the scheduler, and return its future for 'await'.
+static Value task_native(VM *vm, int count, Value *args) {
+    if (count == 0 || !Is_Closure(args[0])) {
+        runtime_error(vm, "'task': bad argument type, function is expected");
+        return Void_Value;
+    }
+
+    RavTask *task = spawn_task(vm, args[0], count - 1, args + 1);
+    if (task == NULL) {
+        runtime_error(vm, "'task': cannot start the scheduler");
+        return Void_Value;
+    }
+
+    RavFuture *future = new_future(&vm->allocator, task);
+    if (vm->futures_count == vm->futures_capacity) {
+        vm->futures_capacity = Grow_Capacity(vm->futures_capacity);
+        vm->futures = realloc(vm->futures, vm->futures_capacity *
+                                           sizeof (RavFuture *));
+    }
+
+    future->index = vm->futures_count;
+    vm->futures[vm->futures_count++] = future;
+    return Obj_Value(future);
+}
+
+// Wait for a task to be done, and return the result of its function. A
+// task awaiting is suspended meanwhile, if it can be.
+static Value await_native(VM *vm, int count, Value *args) {
+    (void)count;
+    if (!Is_Future(args[0])) {
+        runtime_error(vm, "'await': bad argument type, future is expected");
+        return Void_Value;
+    }
+
+    RavFuture *future = As_Future(args[0]);
+    if (future->task == NULL) {
+        runtime_error(vm, "'await': not a pending task");
+        return Void_Value;
+    }
+
+    // It's no longer pending, the last pending future takes its place.
+    RavTask *task = future->task;
+    RavFuture *last = vm->futures[--vm->futures_count];
+    last->index = future->index;
+    vm->futures[future->index] = last;
+    future->task = NULL;
+    future->index = -1;
+
+    // The worker resumes it with the result.
+    if (!task_done(task) && suspend_task(vm, task)) return Void_Value;
+
+    Value result;
+    if (await_task(vm, task, &result) != INTERPRET_OK) {
+        runtime_error(vm, "'await': the task failed");
+        return Void_Value;
+    }
+
+    return result;
+}
+
+/** Typed Arrays **/
+
+// Construct a typed array, either zero filled with a given length,
+// or converted from an array of numbers.
+static Value typed_array(VM *vm, const char *name, TypedType type,
+                         Value value) {
+    if (Is_Num(value) && isfinite(As_Num(value)) && As_Num(value) >= 0) {
+        if (As_Num(value) > CAPACITY_LIMIT) {
+            runtime_error(vm, "'%s': length exceeds the limit %lu", name,
+                          CAPACITY_LIMIT);
+            return Void_Value;
+        }
+
+        size_t count = (size_t)As_Num(value);
+        RavTypedArray *array = new_typed_array(&vm->allocator, type, count);
+        if (array == NULL) {
+            runtime_error(vm, "'%s': cannot allocate the elements", name);
+            return Void_Value;
+        }
+
+        return Obj_Value(array);
+    }
+
+    if (!Is_Array(value)) {
+        runtime_error(vm, "'%s': expect a length or an array", name);
+        return Void_Value;
+    }
+
+    RavArray *source = As_Array(value);
+    for (size_t i = 0; i < source->count; i++) {
+        if (!Is_Num(source->values[i])) {
+            runtime_error(vm, "'%s': array elements must be numeric",
+                          name);
+            return Void_Value;
+        }
+    }
+
+    RavTypedArray *array = new_typed_array(&vm->allocator, type,
+                                           source->count);
+    for (size_t i = 0; i < source->count; i++) {
+        typed_array_set(array, i, As_Num(source->values[i]));
+    }
+
+    return Obj_Value(array);
+}
+
+static Value f64_array_native(VM *vm, int count, Value *args) {
+    (void)count;
+    return typed_array(vm, "f64_array", TYPED_F64, args[0]);
+}
+
+static Value i32_array_native(VM *vm, int count, Value *args) {
+    (void)count;
+    return typed_array(vm, "i32_array", TYPED_I32, args[0]);
+}
+
+static Value u8_array_native(VM *vm, int count, Value *args) {
+    (void)count;
+    return typed_array(vm, "u8_array", TYPED_U8, args[0]);
+}
+
+static RavTypedArray *typed_argument(VM *vm, const char *name,
+                                     Value value) {
+    if (!Is_Typed_Array(value)) {
+        runtime_error(vm, "'%s': bad argument type, typed array is expected",
+                      name);
+        return NULL;
+    }
+
+    return As_Typed_Array(value);
+}
+
+// Check that the two typed arrays arguments have the same type and
+// length, the two arrays are returned through x and y.
+static bool typed_arguments(VM *vm, const char *name, Value *args,
+                            RavTypedArray **x, RavTypedArray **y) {
+    *x = typed_argument(vm, name, args[0]);
+    if (*x == NULL) return false;
+
+    *y = typed_argument(vm, name, args[1]);
+    if (*y == NULL) return false;
+
+    if ((*x)->type != (*y)->type || (*x)->count != (*y)->count) {
+        runtime_error(vm, "'%s': arrays must have the same type and length",
+                      name);
+        return false;
+    }
+
+    return true;
+}
+
+// Dispatch a kernel on the element type of a typed array.
+#define Typed_Kernel(array, kernel, ...)                            \
+    ((array)->type == TYPED_F64 ?                                   \
+        f64_##kernel((array)->as.f64, ##__VA_ARGS__) :              \
+     (array)->type == TYPED_I32 ?                                   \
+        i32_##kernel((array)->as.i32, ##__VA_ARGS__) :              \
+        u8_##kernel((array)->as.u8, ##__VA_ARGS__))
+
+static Value sum_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    RavTypedArray *array = typed_argument(vm, "sum", args[0]);
+    if (array == NULL) return Void_Value;
+
+    return Num_Value(Typed_Kernel(array, sum, array->count));
+}
+
+static Value dot_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    RavTypedArray *x, *y;
+    if (!typed_arguments(vm, "dot", args, &x, &y)) return Void_Value;
+
+    switch (x->type) {
+    case TYPED_F64:
+        return Num_Value(f64_dot(x->as.f64, y->as.f64, x->count));
+    case TYPED_I32:
+        return Num_Value(i32_dot(x->as.i32, y->as.i32, x->count));
+    case TYPED_U8:
+        return Num_Value(u8_dot(x->as.u8, y->as.u8, x->count));
+    }
+
+    assert(!"invalid typed array type");
+    return Void_Value; // For warnings
+}
+
+static Value extremum(VM *vm, const char *name, Value value, bool min) {
+    RavTypedArray *array = typed_argument(vm, name, value);
+    if (array == NULL) return Void_Value;
+
+    if (array->count == 0) {
+        runtime_error(vm, "passed empty array to '%s'", name);
+        return Void_Value;
+    }
+
+    if (min) return Num_Value(Typed_Kernel(array, min, array->count));
+    return Num_Value(Typed_Kernel(array, max, array->count));
+}
+
+static Value min_native(VM *vm, int count, Value *args) {
+    (void)count;
+    return extremum(vm, "min", args[0], true);
+}
+
+static Value max_native(VM *vm, int count, Value *args) {
+    (void)count;
+    return extremum(vm, "max", args[0], false);
+}
+
+// Elementwise binary operation, returning a new typed array.
+static Value elementwise(VM *vm, const char *name, Value *args,
+                         bool add) {
+    RavTypedArray *x, *y;
+    if (!typed_arguments(vm, name, args, &x, &y)) return Void_Value;
+
+    // The operands are on the vm stack, safe to trigger the GC.
+    RavTypedArray *out = new_typed_array(&vm->allocator, x->type,
+                                         x->count);
+
+    switch (x->type) {
+    case TYPED_F64:
+        (add ? f64_add : f64_mul)(out->as.f64, x->as.f64, y->as.f64,
+                                  x->count);
+        break;
+
+    case TYPED_I32:
+        (add ? i32_add : i32_mul)(out->as.i32, x->as.i32, y->as.i32,
+                                  x->count);
+        break;
+
+    case TYPED_U8:
+        (add ? u8_add : u8_mul)(out->as.u8, x->as.u8, y->as.u8, x->count);
+        break;
+    }
+
+    return Obj_Value(out);
+}
+
+static Value add_native(VM *vm, int count, Value *args) {
+    (void)count;
+    return elementwise(vm, "add", args, true);
+}
+
+static Value mul_native(VM *vm, int count, Value *args) {
+    (void)count;
+    return elementwise(vm, "mul", args, false);
+}
+
+static Value scale_native(VM *vm, int count, Value *args) {
+    (void)count;
+
+    RavTypedArray *x = typed_argument(vm, "scale", args[0]);
+    if (x == NULL) return Void_Value;
+
+    if (!Is_Num(args[1])) {
+        runtime_error(vm, "'scale': factor must be numeric");
+        return Void_Value;
+    }
+
+    double k = As_Num(args[1]);
+    RavTypedArray *out = new_typed_array(&vm->allocator, x->type,
+                                         x->count);
+
+    switch (x->type) {
+    case TYPED_F64: f64_scale(out->as.f64, x->as.f64, k, x->count); break;
+    case TYPED_I32: i32_scale(out->as.i32, x->as.i32, k, x->count); break;
+    case TYPED_U8:  u8_scale(out->as.u8, x->as.u8, k, x->count); break;
+    }
+
+    return Obj_Value(out);
+}
+
+#undef Typed_Kernel
+
+bool define_native(VM *vm, const char *name, int arity,
+                   NativeFn function) {
+    if (arity < -1 || arity > UINT8_MAX) return false;
+
+    // The name string and the native object aren't reachable until
+    // they get registered as a global.
+    Allocator *allocator = &vm->allocator;
+    bool gc_off = allocator->gc_off;
+    allocator->gc_off = true;
+
+    RavString *string = new_string(allocator, name, (int)strlen(name));
+    Value index_value;
+
+    int index = -1;
+    if (table_get(&vm->globals, string, &index_value)) {
+        index = (int)As_Num(index_value);
+    } else if (vm->globals.count < GLOBALS_LIMIT) {
+        index = add_global(vm, string);
+    }
+
+    bool done = index != -1;
+    if (done) {
+        RavNative *native = new_native(allocator, string, arity, function);
+        dict_remove(&vm->inlined_globals, Num_Value((double)index));
+        vm->global_buffer[index] = Obj_Value(native);
+    }
+
+    allocator->gc_off = gc_off;
+    return done;
+}
+
+void define_builtins(VM *vm) {
+    define_native(vm, "print", -1, print_native);
+    define_native(vm, "typ", 1, typ_native);
+    define_native(vm, "hd", 1, hd_native);
+    define_native(vm, "tl", 1, tl_native);
+
+    define_native(vm, "len", 1, len_native);
+    define_native(vm, "array", 1, array_native);
+    define_native(vm, "push", 2, push_native);
+    define_native(vm, "pop", 1, pop_native);
+    define_native(vm, "insert", 3, insert_native);
+    define_native(vm, "slice", 3, slice_native);
+
+    define_native(vm, "sort", 2, sort_native);
+    define_native(vm, "map", 2, map_native);
+    define_native(vm, "fold", 3, fold_native);
+
+    define_native(vm, "spawn", -1, spawn_native);
+    define_native(vm, "join", 1, join_native);
+    define_native(vm, "freeze", 1, freeze_native);
+    define_native(vm, "frozen", 1, frozen_native);
+
+    define_native(vm, "coroutine", 1, coroutine_native);
+    define_native(vm, "resume", -1, resume_native);
+    define_native(vm, "yield", -1, yield_native);
+    define_native(vm, "done", 1, done_native);
+
+    define_native(vm, "task", -1, task_native);
+    define_native(vm, "await", 1, await_native);
+
+    define_native(vm, "f64_array", 1, f64_array_native);
+    define_native(vm, "i32_array", 1, i32_array_native);
+    define_native(vm, "u8_array", 1, u8_array_native);
+    define_native(vm, "sum", 1, sum_native);
+    define_native(vm, "dot", 2, dot_native);
+    define_native(vm, "min", 1, min_native);
+    define_native(vm, "max", 1, max_native);
+    define_native(vm, "add", 2, add_native);
+    define_native(vm, "mul", 2, mul_native);
+    define_native(vm, "scale", 2, scale_native);
+}
@@ -0,0 +1,9 @@
+#ifndef raven_builtin_h
+#define raven_builtin_h
+
+#include "vm.h"
+
+// Register the builtin native functions as globals of the vm.
+void define_builtins(VM *vm);
+
+#endif
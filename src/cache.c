@@ -0,0 +1,1564 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "common.h"
+#include "dict.h"
+#include "isolate.h"
+#include "mem.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// Kinds of the serialized constants, each is written as a byte
+// followed by its content.
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_TRUE,
+    CONSTANT_FALSE,
+    CONSTANT_NUMBER,    // double
+    CONSTANT_STRING,    // length, then the characters
+    CONSTANT_FUNCTION,  // function record
+    CONSTANT_CLOSURE,   // function record, of a function capturing nothing
+    CONSTANT_MAP,       // count, then the key and value of each entry
+} ConstantKind;
+
+// The file starts with the header, followed by the globals names in
+// the order of their indexes (length then characters), then the record
+// of the top-level function, and the global index and the record of
+// each inlinable function.
+//
+// A function record is its name (UINT32_MAX length for no name), its
+// arity, upvalues, captures and slots counts, then its opcodes, its
+// lines and its constants, each array prefixed by its count, and its
+// lazily compiled source (UINT32_MAX length for none) and line.
+//
+// The functions are numbered in the order of their records, a function
+// met again is written as its number instead, so the guards of the
+// inlined calls still find the functions of their globals. A record is
+// prefixed by UINT32_MAX.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t opcodes_count;
+    uint32_t value_size;
+    uint64_t source_hash;
+    uint64_t source_length;
+    uint32_t globals_count;
+    uint32_t inlined_count;
+} Header;
+
+static const char magic[4] = { 'R', 'A', 'V', 'C' };
+
+// FNV-1a hash of the source code.
+static uint64_t hash_source(const char *source, size_t length) {
+    uint64_t hash = 14695981039346656037u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+static void init_header(Header *header, const char *source) {
+    // Zeroed first, so the padding bytes are written deterministically.
+    memset(header, 0, sizeof (Header));
+    memcpy(header->magic, magic, sizeof magic);
+
+    header->version = CACHE_VERSION;
+    header->opcodes_count = OPCODES_COUNT;
+    header->value_size = sizeof (Value);
+    header->source_length = strlen(source);
+    header->source_hash = hash_source(source, header->source_length);
+}
+
+/** Writing **/
+
+typedef struct {
+    FILE *file;
+    Dict functions;  // Number of each written function
+} Writer;
+
+static inline void write_u8(FILE *file, uint8_t x) {
+    fwrite(&x, sizeof x, 1, file);
+}
+
+static inline void write_u32(FILE *file, uint32_t x) {
+    fwrite(&x, sizeof x, 1, file);
+}
+
+static void write_string(FILE *file, RavString *string) {
+    write_u32(file, (uint32_t)string->length);
+    fwrite(string->chars, sizeof (char), string->length, file);
+}
+
+static bool write_function(Writer *writer, RavFunction *function);
+
+static bool write_value(Writer *writer, Value value) {
+    FILE *file = writer->file;
+
+    if (Is_Nil(value)) {
+        write_u8(file, CONSTANT_NIL);
+        return true;
+    }
+
+    if (Is_Bool(value)) {
+        write_u8(file, As_Bool(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+        return true;
+    }
+
+    if (Is_Num(value)) {
+        double number = As_Num(value);
+        write_u8(file, CONSTANT_NUMBER);
+        fwrite(&number, sizeof number, 1, file);
+        return true;
+    }
+
+    if (!Is_Obj(value)) return false;
+
+    switch (Obj_Type(value)) {
+    case OBJ_STRING:
+        write_u8(file, CONSTANT_STRING);
+        write_string(file, As_String(value));
+        return true;
+
+    case OBJ_FUNCTION:
+        write_u8(file, CONSTANT_FUNCTION);
+        return write_function(writer, As_Function(value));
+
+    case OBJ_CLOSURE: {
+        // Only the closures created at compile time, which capture
+        // nothing, are found in the constants.
+        RavClosure *closure = As_Closure(value);
+        if (closure->upvalue_count != 0 || closure->capture_count != 0) {
+            return false;
+        }
+
+        write_u8(file, CONSTANT_CLOSURE);
+        return write_function(writer, closure->function);
+    }
+
+    case OBJ_MAP: {
+        Dict *dict = &As_Map(value)->dict;
+        write_u8(file, CONSTANT_MAP);
+        write_u32(file, (uint32_t)dict->count);
+
+        for (int i = 0; i < dict->entries_count; i++) {
+            DictEntry *entry = &dict->entries[i];
+            if (Is_Void(entry->key)) continue;
+
+            if (!write_value(writer, entry->key) ||
+                !write_value(writer, entry->value)) return false;
+        }
+
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+static bool write_function(Writer *writer, RavFunction *function) {
+    FILE *file = writer->file;
+    Chunk *chunk = &function->chunk;
+    Value number;
+
+    if (dict_get(&writer->functions, Obj_Value(function), &number)) {
+        write_u32(file, (uint32_t)As_Num(number));
+        return true;
+    }
+
+    number = Num_Value((double)writer->functions.count);
+    dict_set(&writer->functions, Obj_Value(function), number);
+    write_u32(file, UINT32_MAX);
+
+    if (function->name == NULL) {
+        write_u32(file, UINT32_MAX);
+    } else {
+        write_string(file, function->name);
+    }
+
+    write_u32(file, (uint32_t)function->arity);
+    write_u32(file, (uint32_t)function->upvalue_count);
+    write_u32(file, (uint32_t)function->capture_count);
+    write_u32(file, (uint32_t)function->slots_count);
+
+    write_u32(file, (uint32_t)chunk->count);
+    fwrite(chunk->opcodes, sizeof (uint8_t), chunk->count, file);
+
+    write_u32(file, (uint32_t)chunk->lines_count);
+    fwrite(chunk->lines, sizeof (Line), chunk->lines_count, file);
+
+    write_u32(file, (uint32_t)chunk->constants_count);
+    for (int i = 0; i < chunk->constants_count; i++) {
+        if (!write_value(writer, chunk->constants[i])) return false;
+    }
+
+    if (function->source == NULL) {
+        write_u32(file, UINT32_MAX);
+    } else {
+        write_string(file, function->source);
+    }
+    write_u32(file, (uint32_t)function->line);
+
+    return true;
+}
+
+// Write the names of the globals in the order of their indexes.
+static bool write_globals(FILE *file, Table *globals) {
+    RavString **names = calloc(globals->count, sizeof (RavString *));
+
+    for (int i = 0; i <= globals->hash_mask; i++) {
+        Entry *entry = &globals->entries[i];
+        if (entry->key == NULL) continue;
+
+        names[(int)As_Num(entry->value)] = entry->key;
+    }
+
+    bool done = true;
+    for (int i = 0; i < globals->count && done; i++) {
+        if (names[i] == NULL) {
+            done = false;
+        } else {
+            write_string(file, names[i]);
+        }
+    }
+
+    free(names);
+    return done;
+}
+
+bool write_cache(VM *vm, RavFunction *function, const char *path,
+                 const char *source) {
+    // Written to a temporary file then renamed, so a concurrent run
+    // never reads a partially written cache file.
+    size_t size = strlen(path) + 32;
+    char *temporary = malloc(size);
+    snprintf(temporary, size, "%s.%ld", path, (long)getpid());
+
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) {
+        free(temporary);
+        return false;
+    }
+
+    Header header;
+    init_header(&header, source);
+    header.globals_count = (uint32_t)vm->globals.count;
+    header.inlined_count = (uint32_t)vm->inlined_globals.count;
+    fwrite(&header, sizeof header, 1, file);
+
+    Writer writer = { .file = file };
+    init_dict(&writer.functions);
+
+    bool done = write_globals(file, &vm->globals) &&
+                write_function(&writer, function);
+
+    Dict *inlined = &vm->inlined_globals;
+    for (int i = 0; i < inlined->entries_count && done; i++) {
+        DictEntry *entry = &inlined->entries[i];
+        if (Is_Void(entry->key)) continue;
+
+        write_u32(file, (uint32_t)As_Num(entry->key));
+        done = write_function(&writer, As_Function(entry->value));
+    }
+
+    free_dict(&writer.functions);
+
+    if (ferror(file)) done = false;
+    if (fclose(file) != 0) done = false;
+    if (done && rename(temporary, path) != 0) done = false;
+    if (!done) remove(temporary);
+
+    free(temporary);
+    return done;
+}
+
+/** Verification **/
+
+// The loaded code is checked before it's run, so a corrupted file can't
+// make the vm index out of its arrays or jump into an operand. The
+// depth of the stack the code uses isn't checked.
+
+static inline bool is_terminator(uint8_t opcode) {
+    switch (narrow_opcode(opcode)) {
+    case OP_JMP:
+    case OP_JMP_BACK:
+    case OP_RETURN:
+    case OP_EXIT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool verify_counts(RavFunction *function) {
+    return function->arity >= 0 && function->arity < PARAMS_LIMIT &&
+           function->slots_count > 0 &&
+           function->slots_count <= LOCALS_LIMIT &&
+           function->upvalue_count >= 0 &&
+           function->upvalue_count <= UPVALUES_LIMIT &&
+           function->capture_count >= 0 &&
+           function->capture_count <= UPVALUES_LIMIT;
+}
+
+// Return the size of the instruction at a given offset, or 0 if it's
+// not a known opcode or its operands don't fit in the chunk.
+static int checked_size(Chunk *chunk, int offset) {
+    uint8_t opcode = chunk->opcodes[offset];
+    if (opcode >= OPCODES_COUNT ||
+        offset + 1 + operand_size(opcode) > chunk->count) return 0;
+
+    // The size of a closure depends on its function.
+    if (narrow_opcode(opcode) == OP_CLOSURE) {
+        int index = read_operand(chunk, offset);
+        if (index >= chunk->constants_count ||
+            !Is_Function(chunk->constants[index]) ||
+            !verify_counts(As_Function(chunk->constants[index]))) return 0;
+    }
+
+    int size = instruction_size(chunk, offset);
+    return offset + size > chunk->count ? 0 : size;
+}
+
+static inline bool is_target(Chunk *chunk, const bool *starts,
+                             int target) {
+    return target >= 0 && target < chunk->count && starts[target];
+}
+
+static bool verify_switch(Chunk *chunk, const bool *starts, int index,
+                          int end) {
+    if (index >= chunk->constants_count ||
+        !Is_Map(chunk->constants[index])) return false;
+
+    Dict *table = &As_Map(chunk->constants[index])->dict;
+    for (int i = 0; i < table->entries_count; i++) {
+        DictEntry *entry = &table->entries[i];
+        if (Is_Void(entry->key)) continue;
+        if (!Is_Num(entry->value)) return false;
+
+        double offset = As_Num(entry->value);
+        if (!(offset >= 0 && offset < chunk->count) ||
+            offset != (int)offset ||
+            !is_target(chunk, starts, end + (int)offset)) return false;
+    }
+
+    return true;
+}
+
+// Check the captured variables list of a closure instruction, the local
+// slots and the variables of the enclosing function must exist.
+static bool verify_closure(RavFunction *function, int offset) {
+    Chunk *chunk = &function->chunk;
+    bool wide = chunk->opcodes[offset] == OP_CLOSURE_16;
+    RavFunction *closed =
+        As_Function(chunk->constants[read_operand(chunk, offset)]);
+
+    const uint8_t *entry = &chunk->opcodes[offset + (wide ? 3 : 2)];
+    int count = closed->upvalue_count + closed->capture_count;
+
+    for (int i = 0; i < count; i++) {
+        bool is_local = entry[0] != 0;
+        int index = wide ? entry[1] << 8 | entry[2] : entry[1];
+        entry += wide ? 3 : 2;
+
+        int limit = is_local ? function->slots_count :
+                    i < closed->upvalue_count ? function->upvalue_count :
+                    function->capture_count;
+        if (index >= limit) return false;
+    }
+
+    return true;
+}
+
+// Return true if the operands of the instruction at a given offset refer
+// to existing constants and variables, and its jumps land on an
+// instruction.
+static bool verify_instruction(RavFunction *function, int offset,
+                               const bool *starts, int globals_count) {
+    Chunk *chunk = &function->chunk;
+    uint8_t opcode = chunk->opcodes[offset];
+    int operand = read_operand(chunk, offset);
+    int end = offset + instruction_size(chunk, offset);
+
+    switch (narrow_opcode(opcode)) {
+    case OP_PUSH_CONST:
+        return operand < chunk->constants_count;
+
+    case OP_DEF_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL:
+        return operand < globals_count;
+
+    case OP_SET_LOCAL:
+    case OP_GET_LOCAL:
+        return operand < function->slots_count;
+
+    case OP_SET_UPVALUE:
+    case OP_GET_UPVALUE:
+        return operand < function->upvalue_count;
+
+    case OP_GET_CAPTURE:
+        return operand < function->capture_count;
+
+    case OP_JMP:
+    case OP_JMP_FALSE:
+    case OP_JMP_POP_FALSE:
+        return is_target(chunk, starts, end + operand);
+
+    case OP_JMP_BACK:
+        return is_target(chunk, starts, end - operand);
+
+    case OP_JMP_INLINED: {
+        const uint8_t *bytes = &chunk->opcodes[offset + 3];
+        int global = bytes[0] << 8 | bytes[1];
+        int index = bytes[2] << 8 | bytes[3];
+
+        return is_target(chunk, starts, end + operand) &&
+               global < globals_count &&
+               index < chunk->constants_count &&
+               Is_Function(chunk->constants[index]);
+    }
+
+    case OP_SWITCH:
+        return verify_switch(chunk, starts, operand, end);
+
+    case OP_CLOSURE:
+        return verify_closure(function, offset);
+
+    default:
+        return true;
+    }
+}
+
+// Return true if the code of a loaded function is safe to run, with the
+// given number of globals.
+static bool verify_function(RavFunction *function, int globals_count) {
+    Chunk *chunk = &function->chunk;
+    if (!verify_counts(function)) return false;
+
+    // A lazily compiled function gets its code and its slots on its
+    // first call.
+    if (function->source != NULL) return chunk->count == 0;
+
+    if (function->slots_count <= function->arity ||
+        chunk->count == 0 || chunk->lines_count == 0) return false;
+
+    // The offsets where an instruction starts.
+    bool *starts = calloc(chunk->count, sizeof (bool));
+    bool valid = true;
+    int last = 0;
+
+    for (int offset = 0; offset < chunk->count && valid; ) {
+        int size = checked_size(chunk, offset);
+
+        starts[offset] = true;
+        last = offset;
+        valid = size != 0;
+        offset += size;
+    }
+
+    // The execution must not run past the end of the chunk.
+    valid = valid && is_terminator(chunk->opcodes[last]);
+
+    for (int offset = 0; offset < chunk->count && valid;
+         offset += instruction_size(chunk, offset)) {
+        valid = verify_instruction(function, offset, starts, globals_count);
+    }
+
+    free(starts);
+    return valid;
+}
+
+/** Reading **/
+
+typedef struct {
+    VM *vm;
+    const uint8_t *current;
+    const uint8_t *end;
+    bool failed;  // Set on a truncated or malformed file
+
+    RavFunction **functions;  // By their number
+    int functions_count;
+    int functions_capacity;
+} Reader;
+
+// Return the next bytes of the file, or NULL if it's too short.
+static const void *read_bytes(Reader *reader, size_t size) {
+    if (reader->failed || (size_t)(reader->end - reader->current) < size) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const void *bytes = reader->current;
+    reader->current += size;
+    return bytes;
+}
+
+static uint32_t read_u32(Reader *reader) {
+    uint32_t x = 0;
+    const void *bytes = read_bytes(reader, sizeof x);
+    if (bytes != NULL) memcpy(&x, bytes, sizeof x);
+    return x;
+}
+
+static RavString *read_string(Reader *reader, uint32_t length) {
+    const char *chars = read_bytes(reader, length);
+    if (chars == NULL) return NULL;
+
+    return new_string(&reader->vm->allocator, chars, (int)length);
+}
+
+// Copy a raw array as is from the file into a new allocated memory.
+static void *read_array(Reader *reader, uint32_t count, size_t size) {
+    const void *bytes = read_bytes(reader, count * size);
+    if (bytes == NULL || count == 0) return NULL;
+
+    void *array = malloc(count * size);
+    memcpy(array, bytes, count * size);
+    return array;
+}
+
+static RavFunction *read_function(Reader *reader);
+
+static Value read_value(Reader *reader) {
+    Allocator *allocator = &reader->vm->allocator;
+    const uint8_t *kind = read_bytes(reader, 1);
+    if (kind == NULL) return Nil_Value;
+
+    switch (*kind) {
+    case CONSTANT_NIL:   return Nil_Value;
+    case CONSTANT_TRUE:  return Bool_Value(true);
+    case CONSTANT_FALSE: return Bool_Value(false);
+
+    case CONSTANT_NUMBER: {
+        double number = 0;
+        const void *bytes = read_bytes(reader, sizeof number);
+        if (bytes != NULL) memcpy(&number, bytes, sizeof number);
+        return Num_Value(number);
+    }
+
+    case CONSTANT_STRING: {
+        RavString *string = read_string(reader, read_u32(reader));
+        return string == NULL ? Nil_Value : Obj_Value(string);
+    }
+
+    case CONSTANT_FUNCTION: {
+        RavFunction *function = read_function(reader);
+        return function == NULL ? Nil_Value : Obj_Value(function);
+    }
+
+    case CONSTANT_CLOSURE: {
+        RavFunction *function = read_function(reader);
+        if (function == NULL) return Nil_Value;
+        return Obj_Value(new_closure(allocator, function));
+    }
+
+    case CONSTANT_MAP: {
+        RavMap *map = new_map(allocator);
+        uint32_t count = read_u32(reader);
+
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            Value key = read_value(reader);
+            Value value = read_value(reader);
+            dict_set(&map->dict, key, value);
+        }
+
+        return Obj_Value(map);
+    }
+
+    default:
+        reader->failed = true;
+        return Nil_Value;
+    }
+}
+
+static RavFunction *read_function(Reader *reader) {
+    uint32_t number = read_u32(reader);
+    if (number != UINT32_MAX) {
+        if (number >= (uint32_t)reader->functions_count) {
+            reader->failed = true;
+        }
+        return reader->failed ? NULL : reader->functions[number];
+    }
+
+    RavFunction *function = new_function(&reader->vm->allocator);
+    Chunk *chunk = &function->chunk;
+
+    if (reader->functions_count == reader->functions_capacity) {
+        reader->functions_capacity =
+            Grow_Capacity(reader->functions_capacity);
+        reader->functions =
+            realloc(reader->functions,
+                    reader->functions_capacity * sizeof (RavFunction *));
+    }
+    reader->functions[reader->functions_count++] = function;
+
+    uint32_t name_length = read_u32(reader);
+    if (name_length != UINT32_MAX) {
+        function->name = read_string(reader, name_length);
+    }
+
+    function->arity = (int)read_u32(reader);
+    function->upvalue_count = (int)read_u32(reader);
+    function->capture_count = (int)read_u32(reader);
+    function->slots_count = (int)read_u32(reader);
+
+    uint32_t count = read_u32(reader);
+    chunk->opcodes = read_array(reader, count, sizeof (uint8_t));
+    chunk->count = chunk->capacity = (int)count;
+
+    count = read_u32(reader);
+    chunk->lines = read_array(reader, count, sizeof (Line));
+    chunk->lines_count = chunk->lines_capacity = (int)count;
+
+    count = read_u32(reader);
+    if (count > (size_t)(reader->end - reader->current)) {
+        reader->failed = true;
+    }
+
+    if (!reader->failed && count != 0) {
+        chunk->constants = malloc(count * sizeof (Value));
+        chunk->constants_capacity = (int)count;
+
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            chunk->constants[chunk->constants_count++] = read_value(reader);
+        }
+    }
+
+    uint32_t source_length = read_u32(reader);
+    if (source_length != UINT32_MAX) {
+        function->source = read_string(reader, source_length);
+    }
+    function->line = (int)read_u32(reader);
+
+    if (!reader->failed &&
+        !verify_function(function, reader->vm->globals.count)) {
+        reader->failed = true;
+    }
+
+    return reader->failed ? NULL : function;
+}
+
+// Register the globals of the cached code, they must get the same
+// indexes as they had when the code was compiled.
+static bool read_globals(Reader *reader, uint32_t count) {
+    VM *vm = reader->vm;
+
+    for (uint32_t i = 0; i < count; i++) {
+        RavString *name = read_string(reader, read_u32(reader));
+        if (name == NULL) return false;
+
+        Value index;
+        if (table_get(&vm->globals, name, &index)) {
+            if (As_Num(index) != (double)i) return false;
+        } else if (add_global(vm, name) != (int)i) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool read_header(Reader *reader, const char *source,
+                        Header *header) {
+    Header expected;
+    init_header(&expected, source);
+
+    const void *bytes = read_bytes(reader, sizeof (Header));
+    if (bytes == NULL) return false;
+    memcpy(header, bytes, sizeof (Header));
+
+    return memcmp(header->magic, magic, sizeof magic) == 0 &&
+           header->version == expected.version &&
+           header->opcodes_count == expected.opcodes_count &&
+           header->value_size == expected.value_size &&
+           header->source_length == expected.source_length &&
+           header->source_hash == expected.source_hash &&
+           read_globals(reader, header->globals_count);
+}
+
+// Read the inlinable functions, they're registered only once the whole
+// file is read, so a malformed file doesn't leave any of them.
+static bool read_inlined(Reader *reader, uint32_t count) {
+    if (count > (size_t)(reader->end - reader->current)) return false;
+
+    Value *inlined = malloc(2 * count * sizeof (Value));
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+        uint32_t index = read_u32(reader);
+        RavFunction *function = read_function(reader);
+
+        if (index >= (uint32_t)reader->vm->globals.count) {
+            reader->failed = true;
+        }
+
+        inlined[2 * i] = Num_Value((double)index);
+        inlined[2 * i + 1] = Obj_Value(function);
+    }
+
+    bool done = !reader->failed && reader->current == reader->end;
+    for (uint32_t i = 0; i < count && done; i++) {
+        dict_set(&reader->vm->inlined_globals, inlined[2 * i],
+                 inlined[2 * i + 1]);
+    }
+
+    free(inlined);
+    return done;
+}
+
+RavFunction *read_cache(VM *vm, const char *path, const char *source) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (image == MAP_FAILED) return NULL;
+
+    Reader reader = {
+        .vm = vm,
+        .current = image,
+        .end = (const uint8_t *)image + size,
+        .failed = false,
+        .functions = NULL,
+        .functions_count = 0,
+        .functions_capacity = 0,
+    };
+
+    Header header;
+    RavFunction *function = NULL;
+
+    if (read_header(&reader, source, &header)) {
+        function = read_function(&reader);
+
+        // The whole file must be consumed.
+        if (function != NULL &&
+            !read_inlined(&reader, header.inlined_count)) {
+            function = NULL;
+        }
+    }
+
+    free(reader.functions);
+    munmap(image, size);
+    return function;
+}
+
+/** Heap Images **/
+
+// Kinds of the values in an image, the objects are referenced by their
+// index in the image objects.
+typedef enum {
+    IMAGE_NIL,
+    IMAGE_TRUE,
+    IMAGE_FALSE,
+    IMAGE_VOID,
+    IMAGE_NUMBER,  // double
+    IMAGE_OBJECT,  // object index
+} ImageValue;
+
+// The image starts with the header, followed by the objects records in
+// the order of their indexes, then the globals (the index of the name
+// string, then the value) and the inlinable functions (the index of the
+// global, then the index of the function).
+//
+// Each object record is its type and its frozen flag, a byte each,
+// followed by its fields. The objects are sorted by type, so the
+// strings come first, and the functions come before the closures.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t opcodes_count;
+    uint32_t value_size;
+    uint32_t objects_count;
+    uint32_t globals_count;
+    uint32_t inlined_count;
+} ImageHeader;
+
+static const char image_magic[4] = { 'R', 'A', 'V', 'I' };
+
+static void init_image_header(ImageHeader *header) {
+    memset(header, 0, sizeof (ImageHeader));
+    memcpy(header->magic, image_magic, sizeof image_magic);
+
+    header->version = IMAGE_VERSION;
+    header->opcodes_count = OPCODES_COUNT;
+    header->value_size = sizeof (Value);
+}
+
+typedef struct {
+    FILE *file;
+    Dict indexes;      // Index of each object in the image, by its value
+    Object **objects;  // The objects in the order of their indexes
+    int count;
+    int capacity;
+} ImageWriter;
+
+static void collect_value(ImageWriter *writer, Value value) {
+    Value index;
+    if (!Is_Obj(value) || dict_get(&writer->indexes, value, &index)) {
+        return;
+    }
+
+    // The stacks of a coroutine, and the task of a future, aren't saved,
+    // they're written as nil.
+    if (Is_Coroutine(value) || Is_Future(value)) return;
+
+    if (writer->count == writer->capacity) {
+        writer->capacity = Grow_Capacity(writer->capacity);
+        writer->objects = realloc(writer->objects,
+                                  writer->capacity * sizeof (Object *));
+    }
+
+    dict_set(&writer->indexes, value, Num_Value((double)writer->count));
+    writer->objects[writer->count++] = As_Obj(value);
+}
+
+static inline void collect_object(ImageWriter *writer, Object *object) {
+    if (object != NULL) collect_value(writer, Obj_Value(object));
+}
+
+// Collect the objects referenced by a collected object.
+static void collect_references(ImageWriter *writer, Object *object) {
+    switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_TYPED_ARRAY:
+    case OBJ_NATIVE:
+    case OBJ_COROUTINE:
+    case OBJ_FUTURE:
+    case OBJ_TYPES_COUNT:
+        break;
+
+    case OBJ_PAIR:
+        collect_value(writer, ((RavPair *)object)->head);
+        collect_value(writer, ((RavPair *)object)->tail);
+        break;
+
+    case OBJ_ARRAY: {
+        RavArray *array = (RavArray *)object;
+        for (size_t i = 0; i < array->count; i++) {
+            collect_value(writer, array->values[i]);
+        }
+        break;
+    }
+
+    case OBJ_MAP: {
+        Dict *dict = &((RavMap *)object)->dict;
+        for (int i = 0; i < dict->entries_count; i++) {
+            if (Is_Void(dict->entries[i].key)) continue;
+
+            collect_value(writer, dict->entries[i].key);
+            collect_value(writer, dict->entries[i].value);
+        }
+        break;
+    }
+
+    case OBJ_FUNCTION: {
+        RavFunction *function = (RavFunction *)object;
+        collect_object(writer, (Object *)function->name);
+        collect_object(writer, (Object *)function->source);
+
+        for (int i = 0; i < function->chunk.constants_count; i++) {
+            collect_value(writer, function->chunk.constants[i]);
+        }
+        break;
+    }
+
+    case OBJ_UPVALUE:
+        collect_value(writer, *((RavUpvalue *)object)->location);
+        break;
+
+    case OBJ_CLOSURE: {
+        RavClosure *closure = (RavClosure *)object;
+        collect_object(writer, (Object *)closure->function);
+
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            collect_object(writer, (Object *)closure->upvalues[i]);
+        }
+        for (int i = 0; i < closure->capture_count; i++) {
+            collect_value(writer, closure->captures[i]);
+        }
+        break;
+    }
+    }
+}
+
+// Reorder the collected objects by type (a stable counting sort), and
+// update their indexes accordingly.
+static void sort_objects(ImageWriter *writer) {
+    int starts[OBJ_TYPES_COUNT + 1] = { 0 };
+
+    for (int i = 0; i < writer->count; i++) {
+        starts[writer->objects[i]->type + 1]++;
+    }
+    for (int type = 1; type <= OBJ_TYPES_COUNT; type++) {
+        starts[type] += starts[type - 1];
+    }
+
+    Object **sorted = malloc(writer->count * sizeof (Object *));
+    for (int i = 0; i < writer->count; i++) {
+        Object *object = writer->objects[i];
+        int index = starts[object->type]++;
+
+        sorted[index] = object;
+        dict_set(&writer->indexes, Obj_Value(object),
+                 Num_Value((double)index));
+    }
+
+    free(writer->objects);
+    writer->objects = sorted;
+}
+
+static uint32_t object_index(ImageWriter *writer, Object *object) {
+    Value index;
+    dict_get(&writer->indexes, Obj_Value(object), &index);
+    return (uint32_t)As_Num(index);
+}
+
+static void write_image_value(ImageWriter *writer, Value value) {
+    FILE *file = writer->file;
+
+    if (Is_Nil(value) || Is_Coroutine(value) || Is_Future(value)) {
+        write_u8(file, IMAGE_NIL);
+    } else if (Is_Bool(value)) {
+        write_u8(file, As_Bool(value) ? IMAGE_TRUE : IMAGE_FALSE);
+    } else if (Is_Void(value)) {
+        write_u8(file, IMAGE_VOID);
+    } else if (Is_Num(value)) {
+        double number = As_Num(value);
+        write_u8(file, IMAGE_NUMBER);
+        fwrite(&number, sizeof number, 1, file);
+    } else {
+        write_u8(file, IMAGE_OBJECT);
+        write_u32(file, object_index(writer, As_Obj(value)));
+    }
+}
+
+static void write_object(ImageWriter *writer, Object *object) {
+    FILE *file = writer->file;
+    write_u8(file, (uint8_t)object->type);
+    write_u8(file, (uint8_t)object->frozen);
+
+    switch (object->type) {
+    case OBJ_STRING:
+        write_string(file, (RavString *)object);
+        break;
+
+    case OBJ_PAIR:
+        write_image_value(writer, ((RavPair *)object)->head);
+        write_image_value(writer, ((RavPair *)object)->tail);
+        break;
+
+    case OBJ_ARRAY: {
+        RavArray *array = (RavArray *)object;
+        write_u32(file, (uint32_t)array->count);
+
+        for (size_t i = 0; i < array->count; i++) {
+            write_image_value(writer, array->values[i]);
+        }
+        break;
+    }
+
+    case OBJ_TYPED_ARRAY: {
+        RavTypedArray *array = (RavTypedArray *)object;
+        write_u8(file, (uint8_t)array->type);
+        write_u32(file, (uint32_t)array->count);
+        fwrite(array->as.bytes, typed_element_size(array->type),
+               array->count, file);
+        break;
+    }
+
+    case OBJ_MAP: {
+        Dict *dict = &((RavMap *)object)->dict;
+        write_u32(file, (uint32_t)dict->count);
+
+        for (int i = 0; i < dict->entries_count; i++) {
+            if (Is_Void(dict->entries[i].key)) continue;
+
+            write_image_value(writer, dict->entries[i].key);
+            write_image_value(writer, dict->entries[i].value);
+        }
+        break;
+    }
+
+    case OBJ_FUNCTION: {
+        RavFunction *function = (RavFunction *)object;
+        Chunk *chunk = &function->chunk;
+
+        write_image_value(writer, function->name == NULL ? Nil_Value :
+                                  Obj_Value(function->name));
+        write_u32(file, (uint32_t)function->arity);
+        write_u32(file, (uint32_t)function->upvalue_count);
+        write_u32(file, (uint32_t)function->capture_count);
+        write_u32(file, (uint32_t)function->slots_count);
+
+        write_u32(file, (uint32_t)chunk->count);
+        fwrite(chunk->opcodes, sizeof (uint8_t), chunk->count, file);
+
+        write_u32(file, (uint32_t)chunk->lines_count);
+        fwrite(chunk->lines, sizeof (Line), chunk->lines_count, file);
+
+        write_u32(file, (uint32_t)chunk->constants_count);
+        for (int i = 0; i < chunk->constants_count; i++) {
+            write_image_value(writer, chunk->constants[i]);
+        }
+
+        write_image_value(writer, function->source == NULL ? Nil_Value :
+                                  Obj_Value(function->source));
+        write_u32(file, (uint32_t)function->line);
+        break;
+    }
+
+    case OBJ_UPVALUE:
+        // An upvalue still open is saved closed, with its current value.
+        write_image_value(writer, *((RavUpvalue *)object)->location);
+        break;
+
+    case OBJ_CLOSURE: {
+        RavClosure *closure = (RavClosure *)object;
+        write_u32(file, object_index(writer, (Object *)closure->function));
+
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            write_u32(file,
+                      object_index(writer, (Object *)closure->upvalues[i]));
+        }
+        for (int i = 0; i < closure->capture_count; i++) {
+            write_image_value(writer, closure->captures[i]);
+        }
+        break;
+    }
+
+    case OBJ_NATIVE:
+        // Bound again by name to the natives of the loading vm.
+        write_string(file, ((RavNative *)object)->name);
+        break;
+
+    case OBJ_COROUTINE:
+    case OBJ_FUTURE:
+    case OBJ_TYPES_COUNT:
+        assert(!"coroutines and futures aren't collected");
+        break;
+    }
+}
+
+bool write_image(VM *vm, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    ImageWriter writer = { .file = file, .objects = NULL };
+    init_dict(&writer.indexes);
+
+    // The roots are the globals, with their names.
+    int globals_count = vm->globals.count;
+    RavString **names = calloc(globals_count, sizeof (RavString *));
+
+    for (int i = 0; i <= vm->globals.hash_mask; i++) {
+        Entry *entry = &vm->globals.entries[i];
+        if (entry->key == NULL) continue;
+
+        names[(int)As_Num(entry->value)] = entry->key;
+    }
+
+    for (int i = 0; i < globals_count; i++) {
+        collect_object(&writer, (Object *)names[i]);
+        collect_value(&writer, vm->global_buffer[i]);
+    }
+
+    Dict *inlined = &vm->inlined_globals;
+    for (int i = 0; i < inlined->entries_count; i++) {
+        collect_value(&writer, inlined->entries[i].value);
+    }
+
+    for (int i = 0; i < writer.count; i++) {
+        collect_references(&writer, writer.objects[i]);
+    }
+
+    sort_objects(&writer);
+
+    ImageHeader header;
+    init_image_header(&header);
+    header.objects_count = (uint32_t)writer.count;
+    header.globals_count = (uint32_t)globals_count;
+    header.inlined_count = (uint32_t)vm->inlined_globals.count;
+    fwrite(&header, sizeof header, 1, file);
+
+    for (int i = 0; i < writer.count; i++) {
+        write_object(&writer, writer.objects[i]);
+    }
+
+    for (int i = 0; i < globals_count; i++) {
+        write_u32(file, object_index(&writer, (Object *)names[i]));
+        write_image_value(&writer, vm->global_buffer[i]);
+    }
+
+    for (int i = 0; i < inlined->entries_count; i++) {
+        DictEntry *entry = &inlined->entries[i];
+        if (Is_Void(entry->key)) continue;
+
+        write_u32(file, (uint32_t)As_Num(entry->key));
+        write_u32(file, object_index(&writer, As_Obj(entry->value)));
+    }
+
+    free(names);
+    free(writer.objects);
+    free_dict(&writer.indexes);
+
+    bool done = !ferror(file);
+    if (fclose(file) != 0) done = false;
+    if (!done) remove(path);
+
+    return done;
+}
+
+typedef struct {
+    Reader reader;
+    Object **objects;         // The image objects, by their index
+    const uint8_t **records;  // The start of their records
+    uint32_t count;           // Number of the objects created so far
+} ImageReader;
+
+// Read a value of the image, the objects are resolved by the second
+// pass (relocation), the first pass gets nil in place of them.
+static Value read_image_value(ImageReader *image, bool relocate) {
+    Reader *reader = &image->reader;
+    const uint8_t *kind = read_bytes(reader, 1);
+    if (kind == NULL) return Nil_Value;
+
+    switch (*kind) {
+    case IMAGE_NIL:   return Nil_Value;
+    case IMAGE_TRUE:  return Bool_Value(true);
+    case IMAGE_FALSE: return Bool_Value(false);
+    case IMAGE_VOID:  return Void_Value;
+
+    case IMAGE_NUMBER: {
+        double number = 0;
+        const void *bytes = read_bytes(reader, sizeof number);
+        if (bytes != NULL) memcpy(&number, bytes, sizeof number);
+        return Num_Value(number);
+    }
+
+    case IMAGE_OBJECT: {
+        uint32_t index = read_u32(reader);
+        if (!relocate) return Nil_Value;
+
+        if (index >= image->count) {
+            reader->failed = true;
+            return Nil_Value;
+        }
+
+        return Obj_Value(image->objects[index]);
+    }
+
+    default:
+        reader->failed = true;
+        return Nil_Value;
+    }
+}
+
+// Return the already created object at a given index, if it has the
+// expected type.
+static Object *image_object(ImageReader *image, uint32_t index,
+                            ObjectType type) {
+    if (index >= image->count || image->objects[index]->type != type) {
+        image->reader.failed = true;
+        return NULL;
+    }
+
+    return image->objects[index];
+}
+
+// Decode the object record at the reader position, the first pass
+// creates the object, and the second one fills its references.
+static void read_object(ImageReader *image, uint32_t index,
+                        bool relocate) {
+    Reader *reader = &image->reader;
+    Allocator *allocator = &reader->vm->allocator;
+
+    const uint8_t *record = read_bytes(reader, 2);
+    if (record == NULL) return;
+
+    uint8_t type = record[0];
+    Object *object = relocate ? image->objects[index] : NULL;
+    if (record[1] > 1 || (relocate && object->type != type)) {
+        reader->failed = true;
+        return;
+    }
+
+    switch (type) {
+    case OBJ_STRING: {
+        RavString *string = read_string(reader, read_u32(reader));
+        if (!relocate) object = (Object *)string;
+        break;
+    }
+
+    case OBJ_PAIR: {
+        Value head = read_image_value(image, relocate);
+        Value tail = read_image_value(image, relocate);
+
+        if (!relocate) {
+            object = (Object *)new_pair(allocator, head, tail);
+        } else {
+            ((RavPair *)object)->head = head;
+            ((RavPair *)object)->tail = tail;
+        }
+        break;
+    }
+
+    case OBJ_ARRAY: {
+        uint32_t count = read_u32(reader);
+        if (count > (size_t)(reader->end - reader->current)) {
+            reader->failed = true;
+            return;
+        }
+
+        if (!relocate) {
+            object = (Object *)new_array_capacity(allocator, count);
+        }
+
+        RavArray *array = (RavArray *)object;
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            Value value = read_image_value(image, relocate);
+            if (relocate) array->values[array->count++] = value;
+        }
+        break;
+    }
+
+    case OBJ_TYPED_ARRAY: {
+        const uint8_t *element = read_bytes(reader, 1);
+        uint32_t count = read_u32(reader);
+        if (element == NULL || *element > TYPED_U8) {
+            reader->failed = true;
+            return;
+        }
+
+        size_t size = count * typed_element_size((TypedType)*element);
+        const void *bytes = read_bytes(reader, size);
+
+        if (!relocate && bytes != NULL) {
+            RavTypedArray *array =
+                new_typed_array(allocator, (TypedType)*element, count);
+            memcpy(array->as.bytes, bytes, size);
+            object = (Object *)array;
+        }
+        break;
+    }
+
+    case OBJ_MAP: {
+        uint32_t count = read_u32(reader);
+        if (!relocate) object = (Object *)new_map(allocator);
+
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            Value key = read_image_value(image, relocate);
+            Value value = read_image_value(image, relocate);
+
+            if (relocate) dict_set(&((RavMap *)object)->dict, key, value);
+        }
+        break;
+    }
+
+    case OBJ_FUNCTION: {
+        Value name = read_image_value(image, relocate);
+        RavFunction *function = relocate ? (RavFunction *)object :
+                                           new_function(allocator);
+
+        if (relocate && Is_String(name)) {
+            function->name = As_String(name);
+        } else if (relocate && !Is_Nil(name)) {
+            reader->failed = true;
+        }
+
+        uint32_t counts[4];
+        for (int i = 0; i < 4; i++) counts[i] = read_u32(reader);
+
+        // The raw arrays are only copied by the first pass.
+        Chunk *chunk = &function->chunk;
+        uint32_t count = read_u32(reader);
+
+        if (relocate) {
+            read_bytes(reader, count);
+            read_bytes(reader, read_u32(reader) * sizeof (Line));
+        } else {
+            function->arity = (int)counts[0];
+            function->upvalue_count = (int)counts[1];
+            function->capture_count = (int)counts[2];
+            function->slots_count = (int)counts[3];
+
+            chunk->opcodes = read_array(reader, count, sizeof (uint8_t));
+            chunk->count = chunk->capacity = (int)count;
+
+            count = read_u32(reader);
+            chunk->lines = read_array(reader, count, sizeof (Line));
+            chunk->lines_count = chunk->lines_capacity = (int)count;
+            object = (Object *)function;
+        }
+
+        count = read_u32(reader);
+        if (count > (size_t)(reader->end - reader->current) ||
+            (relocate && count != (uint32_t)chunk->constants_count)) {
+            reader->failed = true;
+        }
+
+        if (!relocate && !reader->failed && count != 0) {
+            chunk->constants = malloc(count * sizeof (Value));
+            chunk->constants_capacity = (int)count;
+        }
+
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            Value value = read_image_value(image, relocate);
+
+            if (relocate) {
+                chunk->constants[i] = value;
+            } else {
+                chunk->constants[chunk->constants_count++] = value;
+            }
+        }
+
+        Value source = read_image_value(image, relocate);
+        function->line = (int)read_u32(reader);
+
+        if (relocate && Is_String(source)) {
+            function->source = As_String(source);
+        } else if (relocate && !Is_Nil(source)) {
+            reader->failed = true;
+        }
+        break;
+    }
+
+    case OBJ_UPVALUE: {
+        Value captured = read_image_value(image, relocate);
+
+        if (!relocate) {
+            RavUpvalue *upvalue = new_upvalue(allocator, NULL);
+            upvalue->location = &upvalue->captured;
+            object = (Object *)upvalue;
+        }
+
+        ((RavUpvalue *)object)->captured = captured;
+        break;
+    }
+
+    case OBJ_CLOSURE: {
+        RavFunction *function = (RavFunction *)
+            image_object(image, read_u32(reader), OBJ_FUNCTION);
+        if (function == NULL) return;
+
+        RavClosure *closure = relocate ? (RavClosure *)object :
+                                         new_closure(allocator, function);
+
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            uint32_t upvalue = read_u32(reader);
+            if (!relocate) continue;
+
+            closure->upvalues[i] = (RavUpvalue *)
+                image_object(image, upvalue, OBJ_UPVALUE);
+        }
+
+        for (int i = 0; i < closure->capture_count; i++) {
+            closure->captures[i] = read_image_value(image, relocate);
+        }
+
+        object = (Object *)closure;
+        break;
+    }
+
+    case OBJ_NATIVE: {
+        RavString *name = read_string(reader, read_u32(reader));
+        if (relocate || name == NULL) break;
+
+        // Bind the native of the same name, defined by the vm builtins.
+        Value global;
+        if (!table_get(&reader->vm->globals, name, &global)) {
+            reader->failed = true;
+            return;
+        }
+
+        Value native = reader->vm->global_buffer[(int)As_Num(global)];
+        if (!Is_Native(native) || As_Native(native)->name != name) {
+            reader->failed = true;
+            return;
+        }
+
+        object = As_Obj(native);
+        break;
+    }
+
+    default:
+        reader->failed = true;
+        return;
+    }
+
+    if (!relocate && !reader->failed) image->objects[image->count++] = object;
+}
+
+// Relocate the frozen objects, or the other ones, from their records.
+static void relocate_objects(ImageReader *image, bool frozen) {
+    Reader *reader = &image->reader;
+
+    for (uint32_t i = 0; !reader->failed && i < image->count; i++) {
+        if ((image->records[i][1] != 0) != frozen) continue;
+
+        reader->current = image->records[i];
+        read_object(image, i, true);
+    }
+}
+
+// Replace the objects saved frozen with frozen copies, in a region of
+// their own.
+static void freeze_objects(ImageReader *image) {
+    Value *values = malloc(image->count * sizeof (Value));
+    int count = 0;
+
+    for (uint32_t i = 0; i < image->count; i++) {
+        if (image->records[i][1]) {
+            values[count++] = Obj_Value(image->objects[i]);
+        }
+    }
+
+    if (!freeze_values(image->reader.vm, values, count)) {
+        image->reader.failed = true;
+    }
+
+    count = 0;
+    for (uint32_t i = 0; i < image->count && !image->reader.failed; i++) {
+        if (image->records[i][1]) {
+            image->objects[i] = As_Obj(values[count++]);
+        }
+    }
+
+    free(values);
+}
+
+bool read_image(VM *vm, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) return false;
+
+    ImageReader image = {
+        .reader = {
+            .vm = vm,
+            .current = mapping,
+            .end = (const uint8_t *)mapping + size,
+            .failed = false,
+        },
+        .objects = NULL,
+        .records = NULL,
+        .count = 0,
+    };
+    Reader *reader = &image.reader;
+
+    // The objects aren't reachable until the globals are restored.
+    bool gc_off = vm->allocator.gc_off;
+    vm->allocator.gc_off = true;
+
+    ImageHeader expected, header;
+    init_image_header(&expected);
+
+    const void *bytes = read_bytes(reader, sizeof header);
+    if (bytes != NULL) memcpy(&header, bytes, sizeof header);
+
+    if (bytes == NULL ||
+        memcmp(header.magic, expected.magic, sizeof image_magic) != 0 ||
+        header.version != expected.version ||
+        header.opcodes_count != expected.opcodes_count ||
+        header.value_size != expected.value_size ||
+        header.objects_count > size) {
+        reader->failed = true;
+    }
+
+    // First pass, create the objects.
+    if (!reader->failed) {
+        image.objects = malloc(header.objects_count * sizeof (Object *));
+        image.records = malloc(header.objects_count * sizeof (uint8_t *));
+    }
+
+    for (uint32_t i = 0; !reader->failed && i < header.objects_count; i++) {
+        image.records[i] = reader->current;
+        read_object(&image, i, false);
+    }
+
+    // Second pass, relocate the references between the objects. The
+    // frozen objects only reference frozen objects, they're relocated and
+    // frozen again first, so the other objects reference the copies.
+    const uint8_t *objects_end = reader->current;
+    if (!reader->failed) {
+        relocate_objects(&image, true);
+        freeze_objects(&image);
+        relocate_objects(&image, false);
+        reader->current = objects_end;
+    }
+
+    for (uint32_t i = 0; !reader->failed && i < header.objects_count; i++) {
+        Object *object = image.objects[i];
+
+        if (object->type == OBJ_FUNCTION &&
+            !verify_function((RavFunction *)object, header.globals_count)) {
+            reader->failed = true;
+        }
+    }
+
+    // The globals get the same indexes they had in the saved vm, the
+    // builtins are already defined at the same indexes.
+    for (uint32_t i = 0; !reader->failed && i < header.globals_count; i++) {
+        RavString *name = (RavString *)
+            image_object(&image, read_u32(reader), OBJ_STRING);
+        Value value = read_image_value(&image, true);
+        if (name == NULL) break;
+
+        Value index;
+        if (table_get(&vm->globals, name, &index)) {
+            if (As_Num(index) != (double)i) reader->failed = true;
+        } else if (add_global(vm, name) != (int)i) {
+            reader->failed = true;
+        }
+
+        if (!reader->failed) vm->global_buffer[i] = value;
+    }
+
+    for (uint32_t i = 0; !reader->failed && i < header.inlined_count; i++) {
+        uint32_t index = read_u32(reader);
+        Object *function = image_object(&image, read_u32(reader),
+                                        OBJ_FUNCTION);
+
+        if (index >= header.globals_count) reader->failed = true;
+        if (reader->failed) break;
+
+        dict_set(&vm->inlined_globals, Num_Value((double)index),
+                 Obj_Value(function));
+    }
+
+    bool done = !reader->failed && reader->current == reader->end;
+
+    free(image.objects);
+    free(image.records);
+    munmap(mapping, size);
+
+    vm->allocator.gc_off = gc_off;
+    return done;
+}
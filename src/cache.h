@@ -0,0 +1,55 @@
+#ifndef raven_cache_h
+#define raven_cache_h
+
+// Bytecode cache files (.ravc).
+//
+// A cache file holds the compiled top-level function of a script, with
+// its nested functions, the names of the globals in the order of their
+// indexes, and the inlinable global functions. It's keyed by a hash of
+// the script source and by the format version, along with the number of
+// opcodes and the size of the values, so a stale or foreign cache file
+// is ignored.
+//
+// The file is mapped in memory and decoded in a single pass, the raw
+// arrays of the chunks (opcodes and lines) are copied as is, and only
+// the constants are rebuilt into heap objects.
+//
+// Heap image files (.ravi).
+//
+// An image holds the state of a vm after running some code, that's the
+// globals with every heap object reachable from them, so a new vm can
+// start from it instead of running the same initialization code again.
+// The objects reference each other by their index in the image, the
+// loader maps the file, creates every object, then relocates the
+// indexes into the pointers to the created objects.
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Bump on any change of the file layout or of the opcodes semantics.
+#define CACHE_VERSION 7
+#define IMAGE_VERSION 8
+
+// Return the top-level function loaded from the cache file at a given
+// path, or NULL if there is no cache file up to date with the source.
+// The globals of the cached code are registered in the vm, it must have
+// its GC disabled, like when compiling.
+RavFunction *read_cache(VM *vm, const char *path, const char *source);
+
+// Write the compiled top-level function of the source into the cache
+// file at a given path. Return false if the file can't be written, or
+// the code has a constant with no serialized form.
+bool write_cache(VM *vm, RavFunction *function, const char *path,
+                 const char *source);
+
+// Write the globals of the vm, and the objects reachable from them, into
+// the image file at a given path. Return false if it can't be written.
+bool write_image(VM *vm, const char *path);
+
+// Restore the globals and the objects of the image file at a given path
+// into a newly initialized vm. Return false if the file isn't a valid
+// image, or was written by a different build of the vm.
+bool read_image(VM *vm, const char *path);
+
+#endif
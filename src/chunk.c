@@ -3,6 +3,7 @@
 #include "chunk.h"
 #include "common.h"
 #include "mem.h"
+#include "object.h"
 #include "value.h"
 
 void init_chunk(Chunk *chunk) {
@@ -15,11 +16,14 @@ void init_chunk(Chunk *chunk) {
     chunk->lines = NULL;
 
     chunk->constants_count = 0;
+    chunk->constants_capacity = 0;
+    chunk->constants = NULL;
 }
 
 void free_chunk(Chunk *chunk) {
     free(chunk->opcodes);
     free(chunk->lines);
+    free(chunk->constants);
 
     init_chunk(chunk);
 }
@@ -50,10 +54,177 @@ void write_byte(Chunk *chunk, uint8_t byte, int line) {
 }
 
 int write_constant(Chunk *chunk, Value value) {
+    if (chunk->constants_count == chunk->constants_capacity) {
+        chunk->constants_capacity = Grow_Capacity(chunk->constants_capacity);
+        chunk->constants = realloc(chunk->constants,
+                                   chunk->constants_capacity * sizeof (Value));
+    }
+
     chunk->constants[chunk->constants_count++] = value;
     return chunk->constants_count - 1;
 }
 
+void shrink_chunk(Chunk *chunk) {
+    if (chunk->count < chunk->capacity) {
+        chunk->capacity = chunk->count;
+        chunk->opcodes = realloc(chunk->opcodes, chunk->capacity);
+    }
+
+    if (chunk->lines_count < chunk->lines_capacity) {
+        chunk->lines_capacity = chunk->lines_count;
+        chunk->lines = realloc(chunk->lines,
+                               chunk->lines_capacity * sizeof (Line));
+    }
+
+    if (chunk->constants_count < chunk->constants_capacity) {
+        chunk->constants_capacity = chunk->constants_count;
+        chunk->constants = realloc(chunk->constants,
+                                   chunk->constants_capacity * sizeof (Value));
+    }
+}
+
+void rewind_chunk(Chunk *chunk, int offset) {
+    assert(offset <= chunk->count);
+    chunk->count = offset;
+
+    // Drop the lines of the discarded opcodes, so the lines stay
+    // sorted by offset for the later written opcodes.
+    while (chunk->lines_count > 0 &&
+           chunk->lines[chunk->lines_count - 1].offset >= offset) {
+        chunk->lines_count--;
+    }
+}
+
+int operand_size(uint8_t opcode) {
+    switch (opcode) {
+    case OP_PUSH_CONST:
+    case OP_POPN:
+    case OP_PEEK:
+    case OP_SLIDE:
+    case OP_ARRAY_8:
+    case OP_MAP_8:
+    case OP_DEF_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_GET_LOCAL:
+    case OP_SET_UPVALUE:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURE:
+    case OP_CALL:
+    case OP_CALL_CONS:
+    case OP_SWITCH:
+    case OP_CLOSURE:
+        return 1;
+
+    case OP_PUSH_CONST_16:
+    case OP_ARRAY_16:
+    case OP_MAP_16:
+    case OP_DEF_GLOBAL_16:
+    case OP_SET_GLOBAL_16:
+    case OP_GET_GLOBAL_16:
+    case OP_SET_LOCAL_16:
+    case OP_GET_LOCAL_16:
+    case OP_SET_UPVALUE_16:
+    case OP_GET_UPVALUE_16:
+    case OP_GET_CAPTURE_16:
+    case OP_JMP:
+    case OP_JMP_BACK:
+    case OP_JMP_FALSE:
+    case OP_JMP_POP_FALSE:
+    case OP_JMP_INLINED:
+    case OP_SWITCH_16:
+    case OP_CLOSURE_16:
+        return 2;
+
+    case OP_JMP_24:
+    case OP_JMP_BACK_24:
+    case OP_JMP_FALSE_24:
+    case OP_JMP_POP_FALSE_24:
+        return 3;
+
+    default:
+        return 0;
+    }
+}
+
+uint8_t wide_opcode(uint8_t opcode) {
+    switch (opcode) {
+    case OP_PUSH_CONST:     return OP_PUSH_CONST_16;
+    case OP_ARRAY_8:        return OP_ARRAY_16;
+    case OP_MAP_8:          return OP_MAP_16;
+    case OP_DEF_GLOBAL:     return OP_DEF_GLOBAL_16;
+    case OP_SET_GLOBAL:     return OP_SET_GLOBAL_16;
+    case OP_GET_GLOBAL:     return OP_GET_GLOBAL_16;
+    case OP_SET_LOCAL:      return OP_SET_LOCAL_16;
+    case OP_GET_LOCAL:      return OP_GET_LOCAL_16;
+    case OP_SET_UPVALUE:    return OP_SET_UPVALUE_16;
+    case OP_GET_UPVALUE:    return OP_GET_UPVALUE_16;
+    case OP_GET_CAPTURE:    return OP_GET_CAPTURE_16;
+    case OP_JMP:            return OP_JMP_24;
+    case OP_JMP_BACK:       return OP_JMP_BACK_24;
+    case OP_JMP_FALSE:      return OP_JMP_FALSE_24;
+    case OP_JMP_POP_FALSE:  return OP_JMP_POP_FALSE_24;
+    case OP_SWITCH:         return OP_SWITCH_16;
+    case OP_CLOSURE:        return OP_CLOSURE_16;
+    default:                return opcode;
+    }
+}
+
+uint8_t narrow_opcode(uint8_t opcode) {
+    switch (opcode) {
+    case OP_PUSH_CONST_16:    return OP_PUSH_CONST;
+    case OP_ARRAY_16:         return OP_ARRAY_8;
+    case OP_MAP_16:           return OP_MAP_8;
+    case OP_DEF_GLOBAL_16:    return OP_DEF_GLOBAL;
+    case OP_SET_GLOBAL_16:    return OP_SET_GLOBAL;
+    case OP_GET_GLOBAL_16:    return OP_GET_GLOBAL;
+    case OP_SET_LOCAL_16:     return OP_SET_LOCAL;
+    case OP_GET_LOCAL_16:     return OP_GET_LOCAL;
+    case OP_SET_UPVALUE_16:   return OP_SET_UPVALUE;
+    case OP_GET_UPVALUE_16:   return OP_GET_UPVALUE;
+    case OP_GET_CAPTURE_16:   return OP_GET_CAPTURE;
+    case OP_JMP_24:           return OP_JMP;
+    case OP_JMP_BACK_24:      return OP_JMP_BACK;
+    case OP_JMP_FALSE_24:     return OP_JMP_FALSE;
+    case OP_JMP_POP_FALSE_24: return OP_JMP_POP_FALSE;
+    case OP_SWITCH_16:        return OP_SWITCH;
+    case OP_CLOSURE_16:       return OP_CLOSURE;
+    default:                  return opcode;
+    }
+}
+
+int read_operand(Chunk *chunk, int offset) {
+    uint8_t *bytes = &chunk->opcodes[offset + 1];
+
+    switch (operand_size(chunk->opcodes[offset])) {
+    case 1:  return bytes[0];
+    case 2:  return bytes[0] << 8 | bytes[1];
+    case 3:  return bytes[0] << 16 | bytes[1] << 8 | bytes[2];
+    default: return -1;
+    }
+}
+
+int instruction_size(Chunk *chunk, int offset) {
+    uint8_t opcode = chunk->opcodes[offset];
+    int size = 1 + operand_size(opcode);
+
+    // The closure function index is followed by an entry for each
+    // captured variable, 2 bytes wide, or 3 bytes for OP_CLOSURE_16.
+    if (opcode == OP_CLOSURE || opcode == OP_CLOSURE_16) {
+        RavFunction *function =
+            As_Function(chunk->constants[read_operand(chunk, offset)]);
+        int entry_size = opcode == OP_CLOSURE ? 2 : 3;
+        size += entry_size *
+                (function->upvalue_count + function->capture_count);
+    }
+
+    // The jump offset is followed by the guarded global and function.
+    if (opcode == OP_JMP_INLINED) size += 4;
+
+    return size;
+}
+
 int decode_line(Chunk *chunk, int offset) {
     int start = 0;
     int end = chunk->lines_count - 1;
@@ -8,6 +8,7 @@ enum {
 #define Opcode(opcode) opcode,
 # include "opcode.h"
 #undef Opcode
+    OPCODES_COUNT
 };
 
 // Line encoding
@@ -29,9 +30,10 @@ typedef struct {
     int lines_capacity;
     Line *lines;
 
-    // +1 to not cause an overflow, for the overwritten value.
-    Value constants[CONST_LIMIT + 1];
+    // Dynamic array of the constants, deduplicated by the compiler.
     int constants_count;
+    int constants_capacity;
+    Value *constants;
 } Chunk;
 
 // Initialize the chunk state.
@@ -46,6 +48,32 @@ void write_byte(Chunk *chunk, uint8_t byte, int line);
 // Add a constant to the constants table, and return its index.
 int write_constant(Chunk *chunk, Value value);
 
+// Shrink the chunk arrays to fit their content, once it's finished.
+void shrink_chunk(Chunk *chunk);
+
+// Discard the opcodes from a given offset to the end of the chunk.
+void rewind_chunk(Chunk *chunk, int offset);
+
+// Return the size in bytes of the fixed immediate operands of an
+// opcode, not counting the captured variables list of OP_CLOSURE, nor
+// the guarded global and function of OP_JMP_INLINED.
+int operand_size(uint8_t opcode);
+
+// Return the variant of an opcode with a wider immediate operand, or
+// the opcode itself if it has no such variant.
+uint8_t wide_opcode(uint8_t opcode);
+
+// Return the compact variant of an opcode, the inverse of wide_opcode.
+uint8_t narrow_opcode(uint8_t opcode);
+
+// Return the fixed immediate operand of the instruction at a given
+// offset, or -1 if it has no operand.
+int read_operand(Chunk *chunk, int offset);
+
+// Return the size in bytes of the instruction at a given offset,
+// including its operands.
+int instruction_size(Chunk *chunk, int offset);
+
 // Decode a line corresponing to a given instruction offset
 int decode_line(Chunk *chunk, int offset);
 
@@ -28,6 +28,31 @@
 # define NAN_TAGGING
 #endif
 
+// If SSE2 is available (always the case on x86_64), use it for the
+// bulk numeric kernels of the typed arrays.
+#if defined(__SSE2__)
+# define SIMD_SSE2
+#endif
+
+// Run the peephole optimizer over the compiled functions, build with
+// -DNO_PEEPHOLE to get the compiler output as is.
+#ifndef NO_PEEPHOLE
+# define PEEPHOLE
+#endif
+
+// Substitute the body of the small global functions at their call
+// sites, build with -DNO_INLINE to always emit the calls. The inlined
+// calls don't show in the stack traces.
+#ifndef NO_INLINE
+# define INLINE_CALLS
+#endif
+
+// Compile the bodies of the large global functions on their first call,
+// build with -DNO_LAZY to compile every function upfront.
+#ifndef NO_LAZY
+# define LAZY_COMPILE
+#endif
+
 // System Configuration
 // TODO: move this to a separate header.
 
@@ -37,27 +62,43 @@
 // Maximum number of values on the stack.
 #define STACK_SIZE (256 * FRAMES_LIMIT)
 
+// The number of stacks of freed coroutines kept for the next ones.
+#define SPARE_STACKS 16
+
 // The limit of number of locals per function.
-#define LOCALS_LIMIT UINT8_MAX + 1
+#define LOCALS_LIMIT UINT16_MAX + 1
 
 // The limit of number of variables a closure can capture.
-#define UPVALUES_LIMIT UINT8_MAX + 1
+#define UPVALUES_LIMIT UINT16_MAX + 1
 
 // The limit of number of globals per script.
-#define GLOBALS_LIMIT UINT8_MAX + 1
+#define GLOBALS_LIMIT UINT16_MAX + 1
 
 // The limit of number of constants per function.
-#define CONST_LIMIT UINT8_MAX + 1
+#define CONST_LIMIT UINT16_MAX + 1
+
+// The limit of a jump offset in bytes.
+#define JUMP_LIMIT (1 << 24)
 
 // The limie of number of parameters a function can have.
 #define PARAMS_LIMIT UINT8_MAX + 1
 
+// The limit of number of elements an array, or a typed array, is
+// allocated for at once.
+#define CAPACITY_LIMIT (1UL << 32)
+
 // The limit of number of elements in an array literal.
 #define ARRAY_LIMIT UINT16_MAX + 1
 
 // The limit of number of elements in a map literal.
 #define MAP_LIMIT UINT16_MAX + 1
 
+// The limit of bytes of a function body to get inlined.
+#define INLINE_LIMIT 24
+
+// The number of tokens from which a function body is compiled lazily.
+#define LAZY_LIMIT 64
+
 // The limit of cond cases.
 #define COND_LIMIT 256
 
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,8 +6,10 @@
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "dict.h"
 #include "lexer.h"
 #include "object.h"
+#include "peephole.h"
 #include "value.h"
 #include "vm.h"
 
@@ -25,7 +28,8 @@
 typedef struct {
     Token name;
     int depth;         // -1 indicates uninitialized state
-    bool is_captured;  // captured by a closure?
+    bool is_captured;  // captured by a closure through an upvalue?
+    bool is_mutable;   // may change after its initialization?
 } Local;
 
 typedef struct {
@@ -37,7 +41,7 @@ typedef struct {
     // captured variable in the surround function frame, otherwise
     // it stores the index of the captured variable in the surrounding
     // function upvalues list.
-    uint8_t index;
+    uint16_t index;
 } Upvalue;
 
 // Function Lexical Block State
@@ -47,12 +51,32 @@ typedef struct Context {
     RavFunction *function; // Current output chunk, bytecode stream
     bool toplevel;
 
-    Local locals[LOCALS_LIMIT];
+    Local *locals;
     int local_count;       // Number of locals in the current scope
+    int locals_capacity;
 
-    Upvalue upvalues[UPVALUES_LIMIT];
+    Upvalue *upvalues;     // Counted by the function upvalue_count
+    int upvalues_capacity;
+
+    Upvalue *captures;     // Counted by the function capture_count
+    int captures_capacity;
 
     int scope_depth;       // Number of the surrounding blocks
+
+    // Offset of the last OP_SAVE_X of an expression statement, or -1.
+    int last_save_x;
+
+    // End offset of the last inlined call, or -1.
+    int inlined_end;
+
+    // Index of the numbers, strings and inlined functions in the chunk
+    // constants, to reuse the slot of an already added constant.
+    Dict constants;
+
+    // Number of instructions using each constant slot, a slot no longer
+    // used by the code is reclaimed if it's the last one.
+    int *constant_uses;
+    int constant_uses_capacity;
 } Context;
 
 // Parser State
@@ -67,10 +91,20 @@ typedef struct {
     bool had_error;   // Error flag to stop bytecode execution later
     bool panic_mode;  // If set, any parsing error will be ignored
 
+    // Offset of the left operand code of the infix expression being
+    // parsed, used by the infix parsing functions.
+    int operand_start;
+
     // Used in continue statement
     int inner_loop_start;
     int inner_loop_depth;
 
+    // Number of bindings of each name in the source, and the assigned
+    // names (see scan_bindings).
+    Dict bindings;
+    Dict assigned;
+    bool assigns_any;  // Assigns a target that isn't a plain name
+
 #ifdef DEBUG_TRACE_PARSING
     int level;        // Parser nesting level, for debugging
 #endif
@@ -108,6 +142,7 @@ typedef enum {
     FunctionDeclaration,
     FunctionLambda,
     FunctionLambdaHeadless,
+    FunctionBody,       // The body of a lazily compiled declaration
 } FunctionType;
 
 /** Parser Tracing **/
@@ -116,7 +151,7 @@ typedef enum {
 
 #ifdef DEBUG_TRACE_PARSING
 
-static const char *precedence_string[] = {
+static const char *const precedence_string[] = {
     "None",
     "Assignment",
     "Or",
@@ -213,57 +248,151 @@ static inline void emit_bytes(Parser *parser, uint8_t x, uint8_t y) {
     emit_byte(parser, y);
 }
 
+static inline void emit_short(Parser *parser, int operand) {
+    emit_bytes(parser, (operand >> 8) & 0xff, operand & 0xff);
+}
+
+// Emit an instruction with an index operand, using the wide variant of
+// the opcode if the index doesn't fit in a byte.
+static void emit_indexed(Parser *parser, uint8_t opcode, int index) {
+    if (index <= UINT8_MAX) {
+        emit_bytes(parser, opcode, (uint8_t)index);
+    } else {
+        emit_byte(parser, wide_opcode(opcode));
+        emit_short(parser, index);
+    }
+}
+
+// The forward jumps are emitted with a 3-bytes offset, since it's not
+// known yet, the finished chunk gets the compact forms where they fit
+// (see optimize_chunk).
 static inline int emit_jump(Parser *parser, uint8_t instruction) {
-    emit_byte(parser, instruction);
+    emit_byte(parser, wide_opcode(instruction));
+    emit_byte(parser, 0xff);
     emit_bytes(parser, 0xff, 0xff);
-    return parser_chunk(parser)->count - 2;
+    return parser_chunk(parser)->count - 3;
 }
 
 static inline void emit_loop(Parser *parser, int start) {
-    emit_byte(parser, OP_JMP_BACK);
+    // +3 for the OP_JMP_BACK instruction itself.
+    int offset = parser_chunk(parser)->count - start + 3;
 
-    // +2 for the OP_JMP_BACK 2-bytes operand.
-    int offset = parser_chunk(parser)->count - start + 2;
-    if (offset > UINT16_MAX) {
+    if (offset <= UINT16_MAX) {
+        emit_byte(parser, OP_JMP_BACK);
+        emit_short(parser, offset);
+        return;
+    }
+
+    // +1 for the extra offset byte.
+    offset++;
+    if (offset >= JUMP_LIMIT) {
         error_current(parser, "loop body exceeds the allowed limit");
     }
 
-    emit_bytes(parser, (offset >> 8) & 0xff, offset & 0xff);
+    emit_bytes(parser, OP_JMP_BACK_24, (offset >> 16) & 0xff);
+    emit_short(parser, offset);
 }
 
-static inline void patch_jump(Parser *parser, int from) {
+static inline void patch_jump_to(Parser *parser, int from, int target) {
     Chunk *chunk = parser_chunk(parser);
 
-    // -2 because of the jmp instruction 2-bytes immediate argument
-    int offset = chunk->count - from - 2;
+    // -3 because of the jmp instruction 3-bytes immediate argument
+    int offset = target - from - 3;
 
-    if (offset > UINT16_MAX) {
+    if (offset >= JUMP_LIMIT) {
         error_current(parser, "jump offset exceeds the allowed limit");
     }
 
-    chunk->opcodes[from] = (offset >> 8) & 0xff;
-    chunk->opcodes[from + 1] = offset & 0xff;
+    chunk->opcodes[from] = (offset >> 16) & 0xff;
+    chunk->opcodes[from + 1] = (offset >> 8) & 0xff;
+    chunk->opcodes[from + 2] = offset & 0xff;
+}
+
+static inline void patch_jump(Parser *parser, int from) {
+    patch_jump_to(parser, from, parser_chunk(parser)->count);
+}
+
+// Discard the code emitted from a given offset.
+static void rewind_code(Parser *parser, int offset) {
+    Context *context = parser->context;
+
+    rewind_chunk(parser_chunk(parser), offset);
+    if (context->last_save_x >= offset) context->last_save_x = -1;
+    if (context->inlined_end > offset) context->inlined_end = -1;
 }
 
-static inline uint8_t make_constant(Parser *parser, Value value) {
-    int constant_index = write_constant(parser_chunk(parser), value);
+// Return true if two constants are the same value, unlike 'equal_values'
+// +0 and -0 are different constants.
+static inline bool same_constant(Value x, Value y) {
+    if (Is_Num(x) && Is_Num(y)) {
+        double a = As_Num(x), b = As_Num(y);
+        return memcmp(&a, &b, sizeof (double)) == 0;
+    }
 
-    if (constant_index >= CONST_LIMIT) {
+    return equal_values(x, y);
+}
+
+// Count a new use of a constant slot by the code.
+static void use_constant(Context *context, int index) {
+    if (index >= context->constant_uses_capacity) {
+        int capacity = context->constant_uses_capacity;
+        while (index >= capacity) capacity = Grow_Capacity(capacity);
+
+        context->constant_uses = realloc(context->constant_uses,
+                                         capacity * sizeof (int));
+        memset(context->constant_uses + context->constant_uses_capacity, 0,
+               (capacity - context->constant_uses_capacity) * sizeof (int));
+        context->constant_uses_capacity = capacity;
+    }
+
+    context->constant_uses[index]++;
+}
+
+static int make_constant(Parser *parser, Value value) {
+    Context *context = parser->context;
+    Chunk *chunk = parser_chunk(parser);
+    bool indexed = Is_Num(value) || Is_String(value) || Is_Function(value);
+
+    Value index;
+    if (indexed && dict_get(&context->constants, value, &index) &&
+        same_constant(chunk->constants[(int)As_Num(index)], value)) {
+        use_constant(context, (int)As_Num(index));
+        return (int)As_Num(index);
+    }
+
+    if (chunk->constants_count == CONST_LIMIT) {
         error_limit(parser, "constants", CONST_LIMIT);
-        parser_chunk(parser)->constants_count = 0;
         return 0;
     }
 
-    return (uint8_t)constant_index;
+    int constant_index = write_constant(chunk, value);
+    if (indexed) {
+        dict_set(&context->constants, value,
+                 Num_Value((double)constant_index));
+    }
+
+    use_constant(context, constant_index);
+    return constant_index;
 }
 
 static inline void emit_constant(Parser *parser, Value value) {
-    emit_bytes(parser, OP_PUSH_CONST, make_constant(parser, value));
+    emit_indexed(parser, OP_PUSH_CONST, make_constant(parser, value));
+}
+
+// Emit the push instruction of a compile time evaluated value.
+static void emit_value(Parser *parser, Value value) {
+    if (Is_Bool(value)) {
+        emit_byte(parser, As_Bool(value) ? OP_PUSH_TRUE : OP_PUSH_FALSE);
+    } else if (Is_Nil(value)) {
+        emit_byte(parser, OP_PUSH_NIL);
+    } else {
+        emit_constant(parser, value);
+    }
 }
 
 // Register a global variable name, and returns its index at the globals
 // buffer (vm->global_buffer[]).
-static uint8_t register_identifier(Parser *parser, Token *name) {
+static int register_identifier(Parser *parser, Token *name) {
     const char *start = name->lexeme;
     int length = name->length;
     VM *vm = parser->vm;
@@ -273,7 +402,7 @@ static uint8_t register_identifier(Parser *parser, Token *name) {
 
     // Already registered?
     if (table_get(&vm->globals, ident, &index_value)) {
-        return (uint8_t)As_Num(index_value);
+        return (int)As_Num(index_value);
     }
 
     // Exceeds the global limit?
@@ -282,12 +411,235 @@ static uint8_t register_identifier(Parser *parser, Token *name) {
         return 0;
     }
 
-    uint8_t index = vm->globals.count;
+    return add_global(vm, ident);
+}
 
-    vm->global_buffer[index] = Void_Value;
-    table_set(&vm->globals, ident, Num_Value((double)index));
+/** Constant Folding **/
 
-    return index;
+// Return the constant index of a constant push instruction at a given
+// offset, or -1 if it's not a constant push.
+static int constant_index(Chunk *chunk, int offset) {
+    if (narrow_opcode(chunk->opcodes[offset]) != OP_PUSH_CONST) return -1;
+    return read_operand(chunk, offset);
+}
+
+// If the code between start and end is a single constant push
+// instruction, set value to the pushed constant and return true.
+static bool constant_code(Chunk *chunk, int start, int end, Value *value) {
+    if (end <= start) return false;
+
+    int index = constant_index(chunk, start);
+    if (index != -1 && end - start == instruction_size(chunk, start)) {
+        *value = chunk->constants[index];
+        return true;
+    }
+
+    if (end - start != 1) return false;
+
+    switch (chunk->opcodes[start]) {
+    case OP_PUSH_TRUE:  *value = Bool_Value(true);  return true;
+    case OP_PUSH_FALSE: *value = Bool_Value(false); return true;
+    case OP_PUSH_NIL:   *value = Nil_Value;         return true;
+    default:            return false;
+    }
+}
+
+// Return true if the code between start and end always evaluates
+// to a number (or fails at runtime), that is a straight-line code
+// ending with an arithmetic instruction.
+static bool numeric_code(Chunk *chunk, int start, int end) {
+    int last = -1;
+
+    for (int offset = start; offset < end; ) {
+        switch (narrow_opcode(chunk->opcodes[offset])) {
+        case OP_JMP:
+        case OP_JMP_BACK:
+        case OP_JMP_FALSE:
+        case OP_JMP_POP_FALSE:
+        case OP_JMP_INLINED:
+        case OP_SWITCH:
+            return false;
+        }
+
+        last = offset;
+        offset += instruction_size(chunk, offset);
+    }
+
+    if (last == -1) return false;
+
+    uint8_t opcode = chunk->opcodes[last];
+    return opcode >= OP_ADD && opcode <= OP_NEG;
+}
+
+// Release the constant slot of a constant push instruction which is
+// about to be discarded, if it's the last added constant and it's not
+// used by the other instructions.
+static void release_constant(Parser *parser, int offset) {
+    Context *context = parser->context;
+    Chunk *chunk = parser_chunk(parser);
+    int index = constant_index(chunk, offset);
+
+    if (index == -1 || --context->constant_uses[index] > 0 ||
+        index != chunk->constants_count - 1) {
+        return;
+    }
+
+    dict_remove(&context->constants, chunk->constants[index]);
+    chunk->constants_count--;
+}
+
+// Evaluate a binary operator on constant operands at compile time.
+// Return false if it can't be folded, the numeric operators with
+// non-numeric operands are left to fail at runtime.
+static bool evaluate_binary(TokenType operator, Value x, Value y,
+                            Value *result) {
+    if (operator == TOKEN_EQUAL_EQUAL) {
+        *result = Bool_Value(equal_values(x, y));
+        return true;
+    }
+
+    if (operator == TOKEN_BANG_EQUAL) {
+        *result = Bool_Value(!equal_values(x, y));
+        return true;
+    }
+
+    if (!Is_Num(x) || !Is_Num(y)) return false;
+
+    double a = As_Num(x);
+    double b = As_Num(y);
+
+    switch (operator) {
+    case TOKEN_PLUS:          *result = Num_Value(a + b);      break;
+    case TOKEN_MINUS:         *result = Num_Value(a - b);      break;
+    case TOKEN_STAR:          *result = Num_Value(a * b);      break;
+    case TOKEN_SLASH:         *result = Num_Value(a / b);      break;
+    case TOKEN_PERCENT:       *result = Num_Value(fmod(a, b)); break;
+    case TOKEN_LESS:          *result = Bool_Value(a < b);     break;
+    case TOKEN_LESS_EQUAL:    *result = Bool_Value(a <= b);    break;
+    case TOKEN_GREATER:       *result = Bool_Value(a > b);     break;
+    case TOKEN_GREATER_EQUAL: *result = Bool_Value(a >= b);    break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+// Return true if 'x operator k' is always x for a numeric x.
+static bool is_identity(TokenType operator, double k) {
+    switch (operator) {
+    case TOKEN_PLUS:  return k == 0 && signbit(k);   // x + -0
+    case TOKEN_MINUS: return k == 0 && !signbit(k);  // x - 0
+    case TOKEN_STAR:
+    case TOKEN_SLASH: return k == 1;                 // x * 1, x / 1
+    default:          return false;
+    }
+}
+
+/** Source Scanning **/
+
+// Count the bindings of each name in the source, that's the let, fn and
+// for declarations and the assignments, in any scope, and collect the
+// assigned names. A global function is inlined only if its declaration
+// is the single binding of its name, and a captured local is copied if
+// it's never assigned.
+static void scan_bindings(Parser *parser, const char *source,
+                          const char *file) {
+    Lexer lexer;
+    init_lexer(&lexer, source, file);
+    lexer.silent = true;  // Reported later by the parsing lexer
+
+    Token previous = next_token(&lexer);
+    while (previous.type != TOKEN_EOF) {
+        Token token = next_token(&lexer);
+        Token *name = NULL;
+
+        if (token.type == TOKEN_IDENTIFIER &&
+            (previous.type == TOKEN_LET || previous.type == TOKEN_FN ||
+             previous.type == TOKEN_FOR)) {
+            name = &token;
+        } else if (token.type == TOKEN_EQUAL &&
+                   previous.type == TOKEN_IDENTIFIER) {
+            name = &previous;
+        } else if (token.type == TOKEN_EQUAL &&
+                   previous.type == TOKEN_RIGHT_PAREN) {
+            parser->assigns_any = true;  // (x) = ...
+        }
+
+        if (name != NULL) {
+            Value key = Obj_Value(new_string(&parser->vm->allocator,
+                                             name->lexeme, name->length));
+            Value count = Num_Value(0);
+            dict_get(&parser->bindings, key, &count);
+            dict_set(&parser->bindings, key, Num_Value(As_Num(count) + 1));
+
+            if (name == &previous) {
+                dict_set(&parser->assigned, key, Bool_Value(true));
+            }
+        }
+
+        previous = token;
+    }
+}
+
+// Return true if a variable name may be assigned in the source.
+static bool is_assigned(Parser *parser, Token *name) {
+    if (parser->assigns_any) return true;
+
+    Value key = Obj_Value(new_string(&parser->vm->allocator,
+                                     name->lexeme, name->length));
+    Value value;
+    return dict_get(&parser->assigned, key, &value);
+}
+
+/** Tail Consing **/
+
+// Return true if the code at the given offset returns the value on the
+// top of the stack as is, through the forward jumps and the epilogues
+// of the blocks (OP_SAVE_X, the pops of the block locals, OP_PUSH_X).
+static bool returns_top(Chunk *chunk, int offset) {
+    for (;;) {
+        switch (chunk->opcodes[offset]) {
+        case OP_RETURN:
+            return true;
+
+        case OP_JMP:
+        case OP_JMP_24:
+            offset += instruction_size(chunk, offset) +
+                      read_operand(chunk, offset);
+            break;
+
+        case OP_SAVE_X:
+            offset++;
+
+            while (chunk->opcodes[offset] == OP_POP ||
+                   chunk->opcodes[offset] == OP_POPN ||
+                   chunk->opcodes[offset] == OP_CLOSE_UPVALUE) {
+                offset += instruction_size(chunk, offset);
+            }
+
+            if (chunk->opcodes[offset] != OP_PUSH_X) return false;
+            offset++;
+            break;
+
+        default:
+            return false;
+        }
+    }
+}
+
+// Turn the calls which result is consed then returned (i.e. the
+// 'x :: f(xs)' in a tail position) into OP_CALL_CONS, so the self
+// recursive calls build the list in a loop, in a constant stack.
+static void mark_tail_conses(Chunk *chunk) {
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_size(chunk, offset)) {
+        if (chunk->opcodes[offset] == OP_CALL &&
+            chunk->opcodes[offset + 2] == OP_CONS &&
+            returns_top(chunk, offset + 3)) {
+            chunk->opcodes[offset] = OP_CALL_CONS;
+        }
+    }
 }
 
 /** Parser State **/
@@ -330,10 +682,21 @@ static void add_local(Parser *parser, Token name) {
         return;
     }
 
+    if (context->local_count == context->locals_capacity) {
+        context->locals_capacity = Grow_Capacity(context->locals_capacity);
+        context->locals = realloc(context->locals,
+                                  context->locals_capacity * sizeof (Local));
+    }
+
     Local *local = &context->locals[context->local_count++];
+    if (context->local_count > context->function->slots_count) {
+        context->function->slots_count = context->local_count;
+    }
+
     local->name = name;
     local->depth = -1; // Uninitialized
     local->is_captured = false;
+    local->is_mutable = is_assigned(parser, &name);
 }
 
 static inline void begin_scope(Parser *parser) {
@@ -363,25 +726,36 @@ static void unwind_stack(Parser *parser, int depth) {
 
     // If no closing occurs, optimize the consecutive pop instructions.
     if (!do_closing && local_count != 0) {
-        parser_chunk(parser)->count -= local_count;
+        rewind_code(parser, parser_chunk(parser)->count - local_count);
+
+        for (; local_count > UINT8_MAX; local_count -= UINT8_MAX) {
+            emit_bytes(parser, OP_POPN, UINT8_MAX);
+        }
         emit_bytes(parser, OP_POPN, (uint8_t)local_count);
     }
 }
 
-static void end_scope(Parser *parser, bool loading) {
+// Push the value of the last expression of a block, which its code
+// starts at a given offset.
+static void emit_block_value(Parser *parser, int start) {
+    Chunk *chunk = parser_chunk(parser);
+    int last_save_x = parser->context->last_save_x;
+
+    // If possible optimize out OP_SAVE_X/OP_PUSH_X pattern, that is
+    // the block ends with an expression statement.
+    if (last_save_x >= start && last_save_x == chunk->count - 1) {
+        rewind_code(parser, chunk->count - 1);
+    } else {
+        emit_byte(parser, OP_PUSH_X);
+    }
+}
+
+static void end_scope(Parser *parser, int start, bool loading) {
     unwind_stack(parser, parser->context->scope_depth);
 
     // Push the value of the last expression in the block.
-    if (loading) {
-        Chunk *chunk = parser_chunk(parser);
+    if (loading) emit_block_value(parser, start);
 
-        // If possible optimize out OP_SAVE_X/OP_PUSH_X pattern.
-        if (chunk->opcodes[chunk->count - 1] == OP_SAVE_X) {
-            chunk->count--;
-        } else {
-            emit_byte(parser, OP_PUSH_X);
-        }
-    }
     parser->context->scope_depth--;
 }
 
@@ -415,28 +789,39 @@ static inline int resolve_local(Context *context, Token *name) {
     return -1;
 }
 
-static int add_upvalue(Parser *parser, Context *context, uint8_t index,
-                       bool is_local) {
-    int upvalue_count = context->function->upvalue_count;
+// Add a captured variable to the upvalues list, or to the captures list
+// if it's copied, and return its index in the list.
+static int add_upvalue(Parser *parser, Context *context, int index,
+                       bool is_local, bool copy) {
+    RavFunction *function = context->function;
+    Upvalue **list = copy ? &context->captures : &context->upvalues;
+    int *capacity = copy ? &context->captures_capacity :
+                           &context->upvalues_capacity;
+    int *count = copy ? &function->capture_count : &function->upvalue_count;
 
-    // Check first if the upvalue is already captured.
-    for (int i = 0; i < upvalue_count; i++) {
-        Upvalue *upvalue = &context->upvalues[i];
+    // Check first if the variable is already captured.
+    for (int i = 0; i < *count; i++) {
+        Upvalue *upvalue = &(*list)[i];
 
         if (upvalue->index == index && upvalue->is_local == is_local) {
             return i;
         }
     }
 
-    if (upvalue_count == UPVALUES_LIMIT) {
+    if (*count == UPVALUES_LIMIT) {
         error_limit(parser, "captured variables", UPVALUES_LIMIT);
         return 0;
     }
 
-    context->upvalues[upvalue_count].is_local = is_local;
-    context->upvalues[upvalue_count].index = index;
+    if (*count == *capacity) {
+        *capacity = Grow_Capacity(*capacity);
+        *list = realloc(*list, *capacity * sizeof (Upvalue));
+    }
+
+    (*list)[*count].is_local = is_local;
+    (*list)[*count].index = index;
 
-    return context->function->upvalue_count++;
+    return (*count)++;
 }
 
 //
@@ -468,20 +853,28 @@ static int add_upvalue(Parser *parser, Context *context, uint8_t index,
 //  explaination of how this method work could be found in their amazing
 //  paper 'Closures in Lua'.
 //
+// A local which never changes after its initialization is copied into
+// the closure instead (flat closure), so the copy is set and the index
+// refers to the captures list, the local isn't marked as captured and
+// no upvalue object is created or closed for it.
+//
 
 static int resolve_upvalue(Parser *parser, Context *context,
-                           Token *name) {
+                           Token *name, bool *copy) {
     if (context->enclosing == NULL) return -1;
 
     int local = resolve_local(context->enclosing, name);
     if (local != -1) {
-        context->enclosing->locals[local].is_captured = true;
-        return add_upvalue(parser, context, (uint8_t)local, true);
+        Local *variable = &context->enclosing->locals[local];
+
+        *copy = !variable->is_mutable;
+        if (!*copy) variable->is_captured = true;
+        return add_upvalue(parser, context, local, true, *copy);
     }
 
-    int upvalue = resolve_upvalue(parser, context->enclosing, name);
+    int upvalue = resolve_upvalue(parser, context->enclosing, name, copy);
     if (upvalue != -1) {
-        return add_upvalue(parser, context, (uint8_t)upvalue, false);
+        return add_upvalue(parser, context, upvalue, false, *copy);
     }
 
     return -1;
@@ -495,6 +888,10 @@ static inline void init_parser(Parser *parser, Lexer *lexer, VM *vm) {
     parser->panic_mode = false;
     parser->inner_loop_start = -1;
     parser->inner_loop_depth = -1;
+    parser->operand_start = -1;
+    init_dict(&parser->bindings);
+    init_dict(&parser->assigned);
+    parser->assigns_any = false;
 
 #ifdef DEBUG_TRACE_PARSING
     parser->level = 0;
@@ -511,8 +908,22 @@ static inline void init_context(Context *context, Parser *parser,
 
     context->toplevel = type == FunctionToplevel;
     context->local_count = 0;
+    context->locals_capacity = 8;
+    context->locals = malloc(context->locals_capacity * sizeof (Local));
+    context->upvalues = NULL;
+    context->upvalues_capacity = 0;
+    context->captures = NULL;
+    context->captures_capacity = 0;
     context->scope_depth = 0;
-    context->function = new_function(&parser->vm->allocator);
+    context->last_save_x = -1;
+    context->inlined_end = -1;
+    init_dict(&context->constants);
+    context->constant_uses = NULL;
+    context->constant_uses_capacity = 0;
+
+    // The function of a lazily compiled body already exists.
+    context->function = type == FunctionBody ? NULL :
+                        new_function(&parser->vm->allocator);
 
     // Reserve the first slot of the stack for the function itself.
     Local *local = &context->locals[context->local_count++];
@@ -520,6 +931,7 @@ static inline void init_context(Context *context, Parser *parser,
     local->name.lexeme = "";
     local->name.length = 0;
     local->is_captured = false;
+    local->is_mutable = false;
 
     if (type == FunctionDeclaration) {
         context->function->name = new_string(&parser->vm->allocator,
@@ -535,6 +947,16 @@ static inline RavFunction *end_context(Parser *parser, bool toplevel) {
     RavFunction *function = parser->context->function;
     emit_byte(parser, toplevel ? OP_EXIT : OP_RETURN);
 
+    if (parser->had_error == false) {
+        if (!toplevel) mark_tail_conses(parser_chunk(parser));
+        optimize_chunk(parser_chunk(parser));
+    }
+
+    free_dict(&parser->context->constants);
+    free(parser->context->constant_uses);
+    free(parser->context->locals);
+    shrink_chunk(parser_chunk(parser));
+
 #ifdef DEBUG_DUMP_CODE
     if (parser->had_error == false) {
         RavString *name = function->name;
@@ -549,51 +971,361 @@ static inline RavFunction *end_context(Parser *parser, bool toplevel) {
     return function;
 }
 
+/** Inlining **/
+
+// Drop a global bound again by the code from the inlinable functions,
+// the calls compiled from then on look it up. The calls inlined before
+// are guarded, they call the new binding once it's defined.
+static inline void forget_inline(Parser *parser, int index) {
+    dict_remove(&parser->vm->inlined_globals, Num_Value((double)index));
+}
+
+#ifdef INLINE_CALLS
+
+// Register a global function declaration as inlinable, if its body is
+// a small straight-line code which only reads its parameters, without
+// any local or captured variable. Each parameter must be read, and
+// before any call or global assignment of the body, so the arguments
+// can be evaluated at the place of their parameters.
+static void register_inline(Parser *parser, int index,
+                            RavFunction *function) {
+    Chunk *chunk = &function->chunk;
+    Value count;
+
+    if (!dict_get(&parser->bindings, Obj_Value(function->name), &count) ||
+        As_Num(count) != 1 || function->source != NULL ||
+        function->upvalue_count > 0 ||
+        function->capture_count > 0 ||
+        chunk->count > INLINE_LIMIT ||
+        chunk->opcodes[chunk->count - 1] != OP_RETURN) {
+        return;
+    }
+
+    bool effects = false;  // A call or an assignment was seen
+    int reads = 0;         // Number of the read parameters
+    bool read[PARAMS_LIMIT] = { false };
+
+    for (int offset = 0; offset < chunk->count - 1;
+         offset += instruction_size(chunk, offset)) {
+        uint8_t opcode = narrow_opcode(chunk->opcodes[offset]);
+        int operand = operand_size(opcode) ? read_operand(chunk, offset) : 0;
+
+        switch (opcode) {
+        case OP_GET_LOCAL:
+            if (operand == 0 || operand > function->arity || effects) {
+                return;
+            }
+
+            if (!read[operand - 1]) reads++;
+            read[operand - 1] = true;
+            break;
+
+        case OP_GET_GLOBAL:
+            if (operand == index) return;  // Recursive
+            break;
+
+        case OP_SET_GLOBAL:
+            if (operand == index) return;
+            effects = true;
+            break;
+
+        case OP_CALL:
+            effects = true;
+            break;
+
+        case OP_PUSH_TRUE: case OP_PUSH_FALSE: case OP_PUSH_NIL:
+        case OP_PUSH_CONST:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_NEG: case OP_NOT:
+        case OP_EQ: case OP_NEQ:
+        case OP_LT: case OP_LTQ: case OP_GT: case OP_GTQ:
+        case OP_CONS: case OP_ARRAY_8: case OP_MAP_8:
+        case OP_INDEX_GET: case OP_INDEX_SET:
+            break;
+
+        default:
+            return;
+        }
+    }
+
+    if (reads != function->arity) return;
+
+    dict_set(&parser->vm->inlined_globals, Num_Value((double)index),
+             Obj_Value(function));
+}
+
+// Return true if the code at the given offset is a single instruction
+// which pushes a value without any side effect.
+static bool is_pure_push(Chunk *chunk, int offset, int end) {
+    if (offset + instruction_size(chunk, offset) != end) return false;
+
+    switch (narrow_opcode(chunk->opcodes[offset])) {
+    case OP_PUSH_TRUE: case OP_PUSH_FALSE: case OP_PUSH_NIL:
+    case OP_PUSH_CONST: case OP_GET_GLOBAL:
+    case OP_GET_LOCAL: case OP_GET_UPVALUE: case OP_GET_CAPTURE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Emit the code of an argument copied by an inlined call.
+static void emit_argument(Parser *parser, uint8_t *code, int size) {
+    int start = parser_chunk(parser)->count;
+    for (int i = 0; i < size; i++) emit_byte(parser, code[i]);
+
+    int index = constant_index(parser_chunk(parser), start);
+    if (index != -1) use_constant(parser->context, index);
+}
+
+// Return the number of values pushed, or popped if negative, by the
+// instruction of an inlinable body at a given offset.
+static int stack_effect(Chunk *chunk, int offset) {
+    uint8_t opcode = narrow_opcode(chunk->opcodes[offset]);
+
+    switch (opcode) {
+    case OP_PUSH_TRUE: case OP_PUSH_FALSE: case OP_PUSH_NIL:
+    case OP_PUSH_CONST: case OP_GET_LOCAL: case OP_GET_GLOBAL:
+        return 1;
+    case OP_SET_GLOBAL: case OP_NEG: case OP_NOT:
+        return 0;
+    case OP_CALL:
+        return -read_operand(chunk, offset);
+    case OP_ARRAY_8:
+        return 1 - read_operand(chunk, offset);
+    case OP_MAP_8:
+        return 1 - 2 * read_operand(chunk, offset);
+    case OP_INDEX_SET:
+        return -2;
+    default:
+        return -1;
+    }
+}
+
+// Emit the body of an inlinable function, with the code of the arguments
+// in place of the parameters if they are copied, else with the reads of
+// the arguments left on the stack.
+static void emit_body(Parser *parser, RavFunction *function,
+                      uint8_t (*code)[3], int *sizes) {
+    Chunk *body = &function->chunk;
+    int pushed = 0;  // Number of the values pushed over the arguments
+
+    for (int offset = 0; offset < body->count - 1;
+         offset += instruction_size(body, offset)) {
+        uint8_t opcode = narrow_opcode(body->opcodes[offset]);
+
+        if (operand_size(opcode) == 0) {
+            emit_byte(parser, opcode);
+        } else {
+            int operand = read_operand(body, offset);
+            if (opcode == OP_GET_LOCAL && code != NULL) {
+                emit_argument(parser, code[operand - 1], sizes[operand - 1]);
+            } else if (opcode == OP_GET_LOCAL) {
+                emit_bytes(parser, OP_PEEK,
+                           (uint8_t)(pushed + function->arity - operand));
+            } else if (opcode == OP_PUSH_CONST) {
+                emit_constant(parser, body->constants[operand]);
+            } else if (opcode == OP_CALL) {
+                emit_bytes(parser, opcode, (uint8_t)operand);
+            } else {
+                emit_indexed(parser, opcode, operand);
+            }
+        }
+
+        pushed += stack_effect(body, offset);
+    }
+}
+
+// Emit the guard of an inlined call, with the offset to patch.
+static int emit_guard(Parser *parser, int global, Value function) {
+    emit_byte(parser, OP_JMP_INLINED);
+    int guard = parser_chunk(parser)->count;
+    emit_short(parser, 0);
+    emit_short(parser, global);
+    emit_short(parser, make_constant(parser, function));
+    return guard;
+}
+
+// Patch the guard to jump over the slow path, emitted since. The slow
+// path is a few hundred bytes at most, within the reach of the 2-bytes
+// offset of the guard.
+static void patch_guard(Parser *parser, int guard) {
+    Chunk *chunk = parser_chunk(parser);
+    int skip = chunk->count - (guard + 6);
+
+    chunk->opcodes[guard] = (skip >> 8) & 0xff;
+    chunk->opcodes[guard + 1] = skip & 0xff;
+}
+
+// Replace the call of an inlinable function with its body, the callee
+// code starts at the given offset, followed by the code of the arguments
+// starting at each of the given offsets. Return true if the call got
+// inlined.
+//
+// The body is guarded by OP_JMP_INLINED, the call is still made if the
+// global was bound to another value since, so the inlinable globals may
+// be redefined. If the arguments are pure pushes, they are duplicated or
+// dropped in place of the parameters and the guard jumps over the call
+// to the body:
+//
+//     OP_JMP_INLINED body, global, function
+//     <callee> <arguments> OP_CALL
+//     OP_JMP end
+// body:
+//     <body, with the arguments in place of the parameters>
+// end:
+//
+// Otherwise the arguments are evaluated once as for the call, the body
+// reads them from the stack, and they are dropped with the callee under
+// the result:
+//
+//     <callee> <arguments>
+//     OP_JMP_INLINED body, global, function
+//     OP_CALL
+//     OP_JMP end
+// body:
+//     <body, with OP_PEEK of the arguments in place of the parameters>
+//     OP_SLIDE
+// end:
+//
+// As the guard reads the global after the arguments, the body is run in
+// place of the callee if the arguments bind the global back to it.
+//
+// The inlined calls have no frame of their own, they don't show in the
+// stack trace of an error raised by their body.
+static bool inline_call(Parser *parser, int callee, int *arguments,
+                        int count) {
+    Chunk *chunk = parser_chunk(parser);
+    Value value;
+
+    if (callee < 0 || narrow_opcode(chunk->opcodes[callee]) != OP_GET_GLOBAL ||
+        callee + instruction_size(chunk, callee) != arguments[0] ||
+        !dict_get(&parser->vm->inlined_globals,
+                  Num_Value((double)read_operand(chunk, callee)), &value)) {
+        return false;
+    }
+
+    RavFunction *function = As_Function(value);
+    if (function->arity != count ||
+        count + INLINE_LIMIT > UINT8_MAX) return false;
+
+    int global = read_operand(chunk, callee);
+    bool copied = true;
+
+    for (int i = 0; i < count; i++) {
+        if (!is_pure_push(chunk, arguments[i], arguments[i + 1])) {
+            copied = false;
+            break;
+        }
+    }
+
+    if (!copied) {
+        int guard = emit_guard(parser, global, value);
+        emit_bytes(parser, OP_CALL, (uint8_t)count);
+        int end = emit_jump(parser, OP_JMP);
+        patch_guard(parser, guard);
+
+        emit_body(parser, function, NULL, NULL);
+        emit_bytes(parser, OP_SLIDE, (uint8_t)(count + 1));
+
+        patch_jump(parser, end);
+        parser->context->inlined_end = chunk->count;
+        return true;
+    }
+
+    uint8_t code[PARAMS_LIMIT][3];
+    int sizes[PARAMS_LIMIT];
+
+    for (int i = 0; i < count; i++) {
+        sizes[i] = arguments[i + 1] - arguments[i];
+        memcpy(code[i], &chunk->opcodes[arguments[i]], sizes[i]);
+    }
+
+    rewind_code(parser, callee);
+    int guard = emit_guard(parser, global, value);
+
+    emit_indexed(parser, OP_GET_GLOBAL, global);
+    for (int i = 0; i < count; i++) {
+        emit_argument(parser, code[i], sizes[i]);
+    }
+    emit_bytes(parser, OP_CALL, (uint8_t)count);
+    int end = emit_jump(parser, OP_JMP);
+    patch_guard(parser, guard);
+
+    emit_body(parser, function, code, sizes);
+
+    patch_jump(parser, end);
+    parser->context->inlined_end = chunk->count;
+    return true;
+}
+
+#endif
+
 /** Parsing **/
 
 static void parse_precedence(Parser*, Precedence);
 static void expression(Parser*);
 static void declaration(Parser*);
-static void function(Parser*, FunctionType);
-static inline ParseRule *token_rule(TokenType);
+static RavFunction *function(Parser*, FunctionType);
+static inline const ParseRule *token_rule(TokenType);
 
 static void assignment(Parser *parser) {
     Debug_Log(parser);
 
     Chunk *chunk = parser_chunk(parser);
-    if (chunk->count < 2) {
+    int start = parser->operand_start;
+
+    if (chunk->count < 2 || start < 0 || start >= chunk->count) {
         error_previous(parser, "invalid assignment target");
         return;
     }
 
-    // Special case of indexing
-    if (chunk->opcodes[chunk->count - 1] == OP_INDEX_GET) {
-        chunk->count--;
+    // Special case of indexing, the last instruction of the left hand
+    // side is checked, not its last byte which may be an operand.
+    int last = start;
+    while (last + instruction_size(chunk, last) < chunk->count) {
+        last += instruction_size(chunk, last);
+    }
+
+    // The indexing which ends the body of an inlined call isn't a target,
+    // the slow path of the call jumps over it.
+    if (chunk->opcodes[last] == OP_INDEX_GET &&
+        last >= parser->context->inlined_end) {
+        rewind_code(parser, last);
         parse_precedence(parser, PREC_ASSIGNMENT);
         emit_byte(parser, OP_INDEX_SET);
         return;
     }
 
     // Check if the left hand side was an identifier, it's kind of a hack.
-    // If it's an identifier, the last written opcode should be one of
-    // these getters opcodes.
-    uint8_t opcode = chunk->opcodes[chunk->count - 2];
-    if (opcode != OP_GET_GLOBAL &&
-        opcode != OP_GET_LOCAL &&
-        opcode != OP_GET_UPVALUE) {
+    // If it's an identifier, the left operand code should be a single
+    // getter instruction.
+    uint8_t set_op;
+
+    if (start + instruction_size(chunk, start) != chunk->count) {
+        error_previous(parser, "invalid assignment target");
+        return;
+    }
+
+    switch (narrow_opcode(chunk->opcodes[start])) {
+    case OP_GET_GLOBAL:  set_op = OP_SET_GLOBAL;  break;
+    case OP_GET_LOCAL:   set_op = OP_SET_LOCAL;   break;
+    case OP_GET_UPVALUE: set_op = OP_SET_UPVALUE; break;
+    default:
         error_previous(parser, "invalid assignment target");
         return;
     }
 
-    // Get slot index of the variable and extract the corresponding
-    // set instruction, and then discard the get instruction.
-    uint8_t index = chunk->opcodes[chunk->count - 1];
-    uint8_t set_op = opcode - 1;
-    chunk->count -= 2;
+    // Get slot index of the variable and then discard the get
+    // instruction.
+    int index = read_operand(chunk, start);
+    rewind_code(parser, start);
+
+    if (set_op == OP_SET_GLOBAL) forget_inline(parser, index);
 
     // Not PREC_ASSIGNMENT + 1, since assignment is right associated.
     parse_precedence(parser, PREC_ASSIGNMENT);
-    emit_bytes(parser, set_op, index);
+    emit_indexed(parser, set_op, index);
 
     Debug_Exit(parser);
 }
@@ -619,14 +1351,53 @@ static void indexing(Parser *parser) {
     Debug_Exit(parser);
 }
 
+// Fold a binary expression with constant operands, or simplify an
+// identity operation. Return true if the operator code is emitted.
+static bool fold_binary(Parser *parser, TokenType operator,
+                        int left_start, int right_start) {
+    Chunk *chunk = parser_chunk(parser);
+    Value x, y, result;
+
+    if (!constant_code(chunk, right_start, chunk->count, &y)) return false;
+
+    if (constant_code(chunk, left_start, right_start, &x)) {
+        if (!evaluate_binary(operator, x, y, &result)) return false;
+
+        release_constant(parser, right_start);
+        release_constant(parser, left_start);
+        rewind_code(parser, left_start);
+
+        emit_value(parser, result);
+        return true;
+    }
+
+    // The identities are only applied on an operand known to be
+    // numeric, to preserve the runtime type errors.
+    if (Is_Num(y) && is_identity(operator, As_Num(y)) &&
+        numeric_code(chunk, left_start, right_start)) {
+        release_constant(parser, right_start);
+        rewind_code(parser, right_start);
+        return true;
+    }
+
+    return false;
+}
+
 static void binary(Parser *parser) {
     Debug_Log(parser);
 
     TokenType operator = parser->previous.type;
+    int left_start = parser->operand_start;
+    int right_start = parser_chunk(parser)->count;
 
-    ParseRule *rule = token_rule(operator);
+    const ParseRule *rule = token_rule(operator);
     parse_precedence(parser, (Precedence)(rule->precedence + 1));
 
+    if (fold_binary(parser, operator, left_start, right_start)) {
+        Debug_Exit(parser);
+        return;
+    }
+
     switch (operator) {
     case TOKEN_PLUS:          emit_byte(parser, OP_ADD); break;
     case TOKEN_MINUS:         emit_byte(parser, OP_SUB); break;
@@ -701,6 +1472,7 @@ static void if_block(Parser *parser) {
     Debug_Log(parser);
 
     begin_scope(parser);
+    int start = parser_chunk(parser)->count;
 
     while (!check(parser, TOKEN_END) &&
            !check(parser, TOKEN_EOF) &&
@@ -712,7 +1484,7 @@ static void if_block(Parser *parser) {
         consume(parser, TOKEN_END, "expect closing 'end' after if block");
     }
 
-    end_scope(parser, true);
+    end_scope(parser, start, true);
 
     Debug_Exit(parser);
 }
@@ -728,7 +1500,7 @@ static void loop_block(Parser *parser) {
 
     consume(parser, TOKEN_END, "expect closing 'end' after loop block");
 
-    end_scope(parser, false);
+    end_scope(parser, -1, false);
 
     Debug_Exit(parser);
 }
@@ -737,6 +1509,7 @@ static void block(Parser *parser) {
     Debug_Log(parser);
 
     begin_scope(parser);
+    int start = parser_chunk(parser)->count;
 
     while (!check(parser, TOKEN_END) && !check(parser, TOKEN_EOF)) {
         declaration(parser);
@@ -744,7 +1517,7 @@ static void block(Parser *parser) {
 
     consume(parser, TOKEN_END, "expect closing 'end' after block");
 
-    end_scope(parser, true);
+    end_scope(parser, start, true);
 
     Debug_Exit(parser);
 }
@@ -752,23 +1525,115 @@ static void block(Parser *parser) {
 static void function_block(Parser *parser) {
     Debug_Log(parser);
 
+    int start = parser_chunk(parser)->count;
     while (!check(parser, TOKEN_END) && !check(parser, TOKEN_EOF)) {
         declaration(parser);
     }
 
     consume(parser, TOKEN_END, "expect closing 'end' after function block");
+    emit_block_value(parser, start);
 
-    // Push the value of the last expression in the block.
+    Debug_Exit(parser);
+}
+
+// A run of cond cases comparing the same variable with constants. The
+// first case is compiled as a test, the run is turned into a switch on
+// its second case, then each following case only adds an entry to the
+// jump table, without any test code.
+typedef struct {
+    int start;            // Offset of the first case code, or -1
+    uint8_t variable[3];  // Getter instruction of the compared variable
+    int variable_size;
+    Value constant;       // Constant of the first case
+    int test_jump;        // Jump offset of the first case test
+    RavMap *table;        // NULL until the run gets a second case
+    int table_end;        // The table offsets are relative to this
+} SwitchRun;
+
+// If the condition code between start and end compares a variable with
+// a number or a string constant, set the offset of the variable getter
+// and the constant, and return true.
+static bool switch_case(Chunk *chunk, int start, int end, int *variable,
+                        Value *constant) {
+    if (end - start < 5 || chunk->opcodes[end - 1] != OP_EQ) return false;
+
+    int second = start + instruction_size(chunk, start);
+    if (second >= end - 1 ||
+        second + instruction_size(chunk, second) != end - 1) return false;
+
+    int index = constant_index(chunk, start);
+    *variable = second;
+
+    if (index == -1) {
+        index = constant_index(chunk, second);
+        *variable = start;
+    }
+
+    if (index == -1) return false;
+
+    *constant = chunk->constants[index];
+    if (!Is_Num(*constant) && !Is_String(*constant)) return false;
+
+    switch (narrow_opcode(chunk->opcodes[*variable])) {
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURE:
+    case OP_GET_GLOBAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Turn the test of the run first case into an OP_SWITCH and a jump to
+// the case after the run, in place. Return false if the test size
+// doesn't fit.
+static bool begin_switch(Parser *parser, SwitchRun *run) {
     Chunk *chunk = parser_chunk(parser);
+    int jump = run->test_jump - 1;
+
+    // OP_SWITCH_16 takes the place of a narrow constant push and OP_EQ,
+    // the extra byte of a wide constant push is taken by the wide form
+    // of the variable getter.
+    int padding = jump - run->start - (run->variable_size + 3);
+    if (padding != 0 && (padding != 1 || run->variable_size != 2)) {
+        return false;
+    }
 
-    // If possible optimize out OP_SAVE_X/OP_PUSH_X pattern.
-    if (chunk->opcodes[chunk->count - 1] == OP_SAVE_X) {
-        chunk->count--;
+    RavMap *table = new_map(&parser->vm->allocator);
+    int index = make_constant(parser, Obj_Value(table));
+    uint8_t *code = &chunk->opcodes[run->start];
+
+    if (padding == 0) {
+        memcpy(code, run->variable, run->variable_size);
+        code += run->variable_size;
     } else {
-        emit_byte(parser, OP_PUSH_X);
+        code[0] = wide_opcode(run->variable[0]);
+        code[1] = 0;
+        code[2] = run->variable[1];
+        code += 3;
     }
 
-    Debug_Exit(parser);
+    code[0] = OP_SWITCH_16;
+    code[1] = (index >> 8) & 0xff;
+    code[2] = index & 0xff;
+
+    // The first case code follows the 4-bytes jump.
+    chunk->opcodes[jump] = OP_JMP_24;
+    dict_set(&table->dict, run->constant, Num_Value(4));
+
+    run->table = table;
+    run->table_end = jump;
+    return true;
+}
+
+// Finish a run of cases, the values which aren't in the jump table go
+// to the given target.
+static void end_switch(Parser *parser, SwitchRun *run, int target) {
+    if (run->table != NULL) patch_jump_to(parser, run->test_jump, target);
+
+    run->start = -1;
+    run->table = NULL;
 }
 
 static void cond(Parser *parser) {
@@ -803,6 +1668,10 @@ static void cond(Parser *parser) {
     //                      |    |
     // OP_PUSH_NIL <---------    |
     // ....        <--------------
+    //
+    // Consecutive cases comparing the same variable with constants
+    // are dispatched by a single OP_SWITCH instead (see SwitchRun),
+    // the values which aren't in its table jump to the next case.
 
     Debug_Log(parser);
     consume(parser, TOKEN_COLON, "expect ':' after cond");
@@ -810,6 +1679,12 @@ static void cond(Parser *parser) {
     int cases_exit[COND_LIMIT];
     int cases_count = 0;
 
+    // Set once a case with a constant truthy condition is compiled,
+    // the following cases are dead code.
+    bool exhaustive = false;
+
+    SwitchRun run = { .start = -1, .table = NULL };
+
     do {
         if (cases_count == COND_LIMIT) {
             error_limit(parser, "cond cases", COND_LIMIT);
@@ -817,9 +1692,74 @@ static void cond(Parser *parser) {
         }
 
         // Condition
+        int case_start = parser_chunk(parser)->count;
         expression(parser);
         consume(parser, TOKEN_ARROW, "expect '->' after expression");
+
+        Value condition;
+        bool constant = constant_code(parser_chunk(parser), case_start,
+                                      parser_chunk(parser)->count,
+                                      &condition);
+
+        // Dead case, or a case that is always taken?
+        if (exhaustive || constant) {
+            end_switch(parser, &run, case_start);
+            rewind_code(parser, case_start);
+            expression(parser);
+
+            if (exhaustive || is_falsy(condition)) {
+                rewind_code(parser, case_start);
+            } else {
+                exhaustive = true;
+            }
+
+            continue;
+        }
+
+        Chunk *chunk = parser_chunk(parser);
+        int variable;
+        Value key;
+        bool keyed = switch_case(chunk, case_start, chunk->count,
+                                 &variable, &key);
+        int variable_size = keyed ? instruction_size(chunk, variable) : 0;
+
+        // Another case of the run, its constant is added to the table.
+        if (keyed && run.start != -1 &&
+            variable_size == run.variable_size &&
+            memcmp(&chunk->opcodes[variable], run.variable,
+                   variable_size) == 0 &&
+            (run.table != NULL || begin_switch(parser, &run))) {
+            rewind_code(parser, case_start);
+
+            // A repeated constant is already taken by a previous case.
+            Value target;
+            bool dead = dict_get(&run.table->dict, key, &target);
+            if (!dead) {
+                target = Num_Value((double)(case_start - run.table_end));
+                dict_set(&run.table->dict, key, target);
+            }
+
+            expression(parser);
+
+            if (dead) {
+                rewind_code(parser, case_start);
+            } else {
+                cases_exit[cases_count++] = emit_jump(parser, OP_JMP);
+            }
+
+            continue;
+        }
+
+        end_switch(parser, &run, case_start);
+        if (keyed) {
+            run.start = case_start;
+            run.variable_size = variable_size;
+            memcpy(run.variable, &chunk->opcodes[variable], variable_size);
+            run.constant = key;
+        }
+
         int next_case = emit_jump(parser, OP_JMP_POP_FALSE);
+        if (keyed) run.test_jump = next_case;
 
         // Expression
         expression(parser);
@@ -828,8 +1768,10 @@ static void cond(Parser *parser) {
         patch_jump(parser, next_case);
     } while (match(parser, TOKEN_COMMA));
 
+    end_switch(parser, &run, parser_chunk(parser)->count);
+
     // If all conditions evaluate to false.
-    emit_byte(parser, OP_PUSH_NIL);
+    if (!exhaustive) emit_byte(parser, OP_PUSH_NIL);
 
     for (int i = 0; i < cases_count; i++) {
         patch_jump(parser, cases_exit[i]);
@@ -854,9 +1796,33 @@ static void if_(Parser *parser) {
 
     Debug_Log(parser);
 
+    int condition_start = parser_chunk(parser)->count;
     expression(parser); // Condition
     consume(parser, TOKEN_DO, "expect 'do' after if condition");
 
+    // Constant condition? compile only the taken branch.
+    Value condition;
+    if (constant_code(parser_chunk(parser), condition_start,
+                      parser_chunk(parser)->count, &condition)) {
+        bool taken = !is_falsy(condition);
+        rewind_code(parser, condition_start);
+
+        int then_start = parser_chunk(parser)->count;
+        if_block(parser);
+        if (!taken) rewind_code(parser, then_start);
+
+        if (parser->previous.type == TOKEN_ELSE) {
+            int else_start = parser_chunk(parser)->count;
+            block(parser);
+            if (taken) rewind_code(parser, else_start);
+        } else if (!taken) {
+            emit_byte(parser, OP_PUSH_NIL);
+        }
+
+        Debug_Exit(parser);
+        return;
+    }
+
     int then_jump = emit_jump(parser, OP_JMP_POP_FALSE);  // ---. false
     if_block(parser);                                     //    |
                                                           //    |
@@ -923,7 +1889,10 @@ static void while_(Parser *parser) {
     Debug_Exit(parser);
 }
 
-static uint8_t arguments(Parser *parser) {
+// Parse the call arguments, and store the offset of the code of each
+// argument, followed by the end offset of the arguments code.
+static uint8_t arguments(Parser *parser, int *starts) {
+    starts[0] = parser_chunk(parser)->count;
     if (match(parser, TOKEN_RIGHT_PAREN)) return 0;
 
     int count = 0;
@@ -936,6 +1905,7 @@ static uint8_t arguments(Parser *parser) {
         }
 
         count++;
+        starts[count] = parser_chunk(parser)->count;
     } while (match(parser, TOKEN_COMMA));
 
     consume(parser, TOKEN_RIGHT_PAREN, "expect ')' after arguments");
@@ -943,7 +1913,17 @@ static uint8_t arguments(Parser *parser) {
 }
 
 static void call(Parser *parser) {
-    emit_bytes(parser, OP_CALL, arguments(parser));
+    int callee = parser->operand_start;
+    int starts[PARAMS_LIMIT + 1];
+    uint8_t count = arguments(parser, starts);
+
+#ifdef INLINE_CALLS
+    if (inline_call(parser, callee, starts, count)) return;
+#else
+    (void)callee;
+#endif
+
+    emit_bytes(parser, OP_CALL, count);
 }
 
 static void grouping(Parser *parser) {
@@ -967,18 +1947,19 @@ static void identifier(Parser *parser) {
     if (index != -1) {
         get_op = OP_GET_LOCAL;
     } else {
-        index = resolve_upvalue(parser, parser->context, name);
+        bool copy;
+        index = resolve_upvalue(parser, parser->context, name, &copy);
 
         // Upvalue?
         if (index != -1) {
-            get_op = OP_GET_UPVALUE;
+            get_op = copy ? OP_GET_CAPTURE : OP_GET_UPVALUE;
         } else {
             index = register_identifier(parser, &parser->previous);
             get_op = OP_GET_GLOBAL;
         }
     }
 
-    emit_bytes(parser, get_op, index);
+    emit_indexed(parser, get_op, index);
 
     Debug_Exit(parser);
 }
@@ -1032,13 +2013,18 @@ static void map(Parser* parser) {
 
     size_t count = 0;
     do {
-        consume(parser, TOKEN_IDENTIFIER, "expect a map key name");
+        // key, either a name or a computed key '[expression]'
+        if (match(parser, TOKEN_LEFT_BRACKET)) {
+            expression(parser);
+            consume(parser, TOKEN_RIGHT_BRACKET, "expect ']' after map key");
+        } else {
+            consume(parser, TOKEN_IDENTIFIER, "expect a map key");
 
-        // key
-        RavString *key = new_string(&parser->vm->allocator,
-                                   parser->previous.lexeme,
-                                   parser->previous.length);
-        emit_constant(parser, Obj_Value(key));
+            RavString *key = new_string(&parser->vm->allocator,
+                                        parser->previous.lexeme,
+                                        parser->previous.length);
+            emit_constant(parser, Obj_Value(key));
+        }
 
         consume(parser, TOKEN_COLON, "expect ':' after map key");
 
@@ -1115,8 +2101,27 @@ static void unary(Parser *parser) {
     Debug_Log(parser);
 
     TokenType operator = parser->previous.type;
+    int start = parser_chunk(parser)->count;
     parse_precedence(parser, PREC_UNARY);
 
+    // Fold constant operands, non-numeric negation fails at runtime.
+    Value value;
+    if (constant_code(parser_chunk(parser), start,
+                      parser_chunk(parser)->count, &value) &&
+        (operator == TOKEN_NOT || Is_Num(value))) {
+        release_constant(parser, start);
+        rewind_code(parser, start);
+
+        if (operator == TOKEN_NOT) {
+            emit_value(parser, Bool_Value(is_falsy(value)));
+        } else {
+            emit_value(parser, Num_Value(-As_Num(value)));
+        }
+
+        Debug_Exit(parser);
+        return;
+    }
+
     switch (operator) {
     case TOKEN_MINUS: emit_byte(parser, OP_NEG); break;
     case TOKEN_NOT:   emit_byte(parser, OP_NOT); break;
@@ -1127,8 +2132,9 @@ static void unary(Parser *parser) {
     Debug_Exit(parser);
 }
 
-// Parsing rule table
-static ParseRule rules[] = {
+// Parsing rule table, read-only as the compilers may run in parallel
+// threads.
+static const ParseRule rules[] = {
     { NULL,       NULL,       PREC_NONE },         // TOKEN_ASSERT
     { NULL,       NULL,       PREC_NONE },         // TOKEN_BREAK
     { cond,       NULL,       PREC_NONE },         // TOKEN_COND
@@ -1186,7 +2192,7 @@ static ParseRule rules[] = {
 };
 
 // Return the parsing rule of a given token type.
-static inline ParseRule *token_rule(TokenType type) {
+static inline const ParseRule *token_rule(TokenType type) {
     return &rules[type];
 }
 
@@ -1201,9 +2207,12 @@ static void parse_precedence(Parser *parser, Precedence precedence) {
         return;
     }
 
+    int start = parser_chunk(parser)->count;
     prefix(parser);
+
     while (precedence <= token_rule(parser->current.type)->precedence) {
         advance(parser);
+        parser->operand_start = start;
         token_rule(parser->previous.type)->infix(parser);
     }
 
@@ -1239,7 +2248,7 @@ static inline void mark_initialized(Context *context) {
     context->locals[last_index].depth = context->scope_depth;
 }
 
-static void define_variable(Parser *parser, uint8_t name_index) {
+static void define_variable(Parser *parser, int name_index) {
     Context *context = parser->context;
 
     // Local Scope?
@@ -1249,22 +2258,24 @@ static void define_variable(Parser *parser, uint8_t name_index) {
         return;
     }
 
-    emit_bytes(parser, OP_DEF_GLOBAL, name_index);
+    emit_indexed(parser, OP_DEF_GLOBAL, name_index);
 }
 
-static uint8_t variable(Parser *parser, const char *error) {
+static int variable(Parser *parser, const char *error) {
     consume(parser, TOKEN_IDENTIFIER, error);
 
     declare_variable(parser);
     if (parser->context->scope_depth > 0) return 0;
 
-    return register_identifier(parser, &parser->previous);
+    int index = register_identifier(parser, &parser->previous);
+    forget_inline(parser, index);
+    return index;
 }
 
 static void let_declaration(Parser *parser) {
     Debug_Log(parser);
 
-    uint8_t index = variable(parser, "expect a variable name");
+    int index = variable(parser, "expect a variable name");
 
     if (match(parser, TOKEN_EQUAL)) {
         expression(parser);
@@ -1290,14 +2301,14 @@ static void parameters(Parser *parser, TokenType closing_token) {
             error_current(parser, "exceeds parameters limit (255)");
         }
 
-        uint8_t index = variable(parser, "expect parameter name");
+        int index = variable(parser, "expect parameter name");
         define_variable(parser, index);
     } while (match(parser, TOKEN_COMMA));
 
     consume(parser, closing_token, "expect a closing pararmeters token");
 }
 
-static void function(Parser *parser, FunctionType type) {
+static RavFunction *function(Parser *parser, FunctionType type) {
     Context context;
     init_context(&context, parser, type);
     begin_scope(parser);
@@ -1316,27 +2327,197 @@ static void function(Parser *parser, FunctionType type) {
     }
 
     RavFunction *function = end_context(parser, false);
-    uint8_t index = make_constant(parser, Obj_Value(function));
-    emit_bytes(parser, OP_CLOSURE, index);
 
+    // A function which captures nothing gets a single closure, created
+    // at compile time and pushed as a constant.
+    if (function->upvalue_count == 0 && function->capture_count == 0) {
+        RavClosure *closure = new_closure(&parser->vm->allocator, function);
+        emit_constant(parser, Obj_Value(closure));
+        return function;
+    }
+
+    int index = make_constant(parser, Obj_Value(function));
+
+    // The wide closure is used if any of its indexes needs 2 bytes.
+    bool wide = index > UINT8_MAX;
     for (int i = 0; i < function->upvalue_count; i++) {
-        emit_byte(parser, context.upvalues[i].is_local ? 1 : 0);
-        emit_byte(parser, context.upvalues[i].index);
+        if (context.upvalues[i].index > UINT8_MAX) wide = true;
+    }
+    for (int i = 0; i < function->capture_count; i++) {
+        if (context.captures[i].index > UINT8_MAX) wide = true;
+    }
+
+    if (wide) {
+        emit_byte(parser, OP_CLOSURE_16);
+        emit_short(parser, index);
+    } else {
+        emit_bytes(parser, OP_CLOSURE, (uint8_t)index);
+    }
+
+    // The upvalues entries, then the captures entries.
+    int count = function->upvalue_count + function->capture_count;
+    for (int i = 0; i < count; i++) {
+        Upvalue *upvalue = i < function->upvalue_count ?
+            &context.upvalues[i] :
+            &context.captures[i - function->upvalue_count];
+
+        emit_byte(parser, upvalue->is_local ? 1 : 0);
+
+        if (wide) {
+            emit_short(parser, upvalue->index);
+        } else {
+            emit_byte(parser, (uint8_t)upvalue->index);
+        }
+    }
+
+    free(context.upvalues);
+    free(context.captures);
+    return function;
+}
+
+#ifdef LAZY_COMPILE
+
+// Skim the parameters and the body of a global function declaration,
+// and push the closure of a function holding their source, to be
+// compiled on its first call. A global function captures nothing, so
+// its body can be compiled later without the enclosing scopes.
+//
+// The skim matches the brackets and the blocks of the body up to its
+// closing 'end'. Return NULL, leaving the parser untouched, if the body
+// is small (it compiles fast, and may get inlined), or if the skim finds
+// an error, a bad token or an unbalanced bracket or block, so the body
+// is compiled at once and the error is reported as usual. The other
+// syntax errors of a skimmed body are reported on its first call.
+static RavFunction *lazy_function(Parser *parser) {
+    Token name = parser->previous;
+    Token start = parser->current;
+    if (start.type != TOKEN_LEFT_PAREN) return NULL;
+
+    Lexer lexer = *parser->lexer;
+    lexer.silent = true;
+
+    Token params[PARAMS_LIMIT];
+    int arity = 0;
+    Token token = next_token(&lexer);
+
+    while (token.type == TOKEN_IDENTIFIER) {
+        for (int i = 0; i < arity; i++) {
+            if (same_identifier(&token, &params[i])) return NULL;
+        }
+
+        if (arity == UINT8_MAX) return NULL;
+        params[arity++] = token;
+
+        token = next_token(&lexer);
+        if (token.type != TOKEN_COMMA) break;
+
+        token = next_token(&lexer);
+        if (token.type != TOKEN_IDENTIFIER) return NULL;
+    }
+
+    if (token.type != TOKEN_RIGHT_PAREN) return NULL;
+
+    // The closing token expected by each open bracket or block, from
+    // the body itself.
+    TokenType closing[UINT8_MAX];
+    int depth = 0;
+    int count = 0;
+    closing[depth++] = TOKEN_END;
+
+    while (depth > 0) {
+        token = next_token(&lexer);
+        count++;
+
+        TokenType expected = TOKEN_EOF;
+        switch (token.type) {
+        case TOKEN_DO: case TOKEN_COND: case TOKEN_FN:
+            expected = TOKEN_END;
+            break;
+        case TOKEN_LEFT_PAREN:
+            expected = TOKEN_RIGHT_PAREN;
+            break;
+        case TOKEN_LEFT_BRACKET:
+            expected = TOKEN_RIGHT_BRACKET;
+            break;
+        case TOKEN_LEFT_BRACE:
+            expected = TOKEN_RIGHT_BRACE;
+            break;
+
+        case TOKEN_END: case TOKEN_RIGHT_PAREN:
+        case TOKEN_RIGHT_BRACKET: case TOKEN_RIGHT_BRACE:
+            if (closing[depth - 1] != token.type) return NULL;
+            depth--;
+            break;
+
+        case TOKEN_ERROR: case TOKEN_EOF:
+            return NULL;
+
+        default:
+            break;
+        }
+
+        if (expected != TOKEN_EOF) {
+            if (depth == UINT8_MAX) return NULL;
+            closing[depth++] = expected;
+        }
     }
+
+    if (count < LAZY_LIMIT) return NULL;
+
+    Allocator *allocator = &parser->vm->allocator;
+    RavFunction *function = new_function(allocator);
+    function->name = new_string(allocator, name.lexeme, name.length);
+    function->arity = arity;
+    function->source = new_string(allocator, start.lexeme,
+                                  (int)(token.lexeme + token.length -
+                                        start.lexeme));
+    function->line = start.line;
+
+    // Resume the parsing after the closing 'end'.
+    lexer.silent = parser->lexer->silent;
+    *parser->lexer = lexer;
+    parser->current = token;
+    advance(parser);
+
+    RavClosure *closure = new_closure(allocator, function);
+    emit_constant(parser, Obj_Value(closure));
+    return function;
 }
 
+#endif
+
 static void fn_declaration(Parser *parser) {
     Debug_Log(parser);
 
-    uint8_t index = variable(parser, "expect a function name");
+    int index = variable(parser, "expect a function name");
 
+    // The function body may capture its own local before the closure is
+    // stored, so it's captured by reference.
     if (parser->context->scope_depth > 0) {
         mark_initialized(parser->context);
+        parser->context->locals[parser->context->local_count - 1]
+            .is_mutable = true;
+    }
+
+    RavFunction *callee = NULL;
+
+#ifdef LAZY_COMPILE
+    if (parser->context->toplevel && parser->context->scope_depth == 0) {
+        callee = lazy_function(parser);
     }
+#endif
 
-    function(parser, FunctionDeclaration);
+    if (callee == NULL) callee = function(parser, FunctionDeclaration);
     define_variable(parser, index);
 
+#ifdef INLINE_CALLS
+    if (parser->context->scope_depth == 0 && !parser->had_error) {
+        register_inline(parser, index, callee);
+    }
+#else
+    (void)callee;
+#endif
+
     Debug_Exit(parser);
 }
 
@@ -1427,6 +2608,7 @@ static void declaration(Parser *parser) {
         expression(parser);
         // consume(parser, TOKEN_SEMICOLON,
         //         "expect ';' or newline after expression");
+        parser->context->last_save_x = parser_chunk(parser)->count;
         emit_byte(parser, OP_SAVE_X);
     }
 
@@ -1441,6 +2623,7 @@ RavFunction *compile(VM *vm, const char *source, const char *file) {
 
     Parser parser;
     init_parser(&parser, &lexer, vm);
+    scan_bindings(&parser, source, file);
 
     Context context;
     init_context(&context, &parser, FunctionToplevel);
@@ -1450,5 +2633,41 @@ RavFunction *compile(VM *vm, const char *source, const char *file) {
     }
 
     RavFunction *function = end_context(&parser, true);
+    free_dict(&parser.bindings);
+    free_dict(&parser.assigned);
+
     return parser.had_error ? NULL : function;
 }
+
+bool compile_function(VM *vm, RavFunction *function, const char *file) {
+    Lexer lexer;
+    init_lexer(&lexer, function->source->chars, file);
+    lexer.line = function->line;
+
+    Parser parser;
+    init_parser(&parser, &lexer, vm);
+    scan_bindings(&parser, function->source->chars, file);
+
+    Context context;
+    init_context(&context, &parser, FunctionBody);
+    context.function = function;
+    function->arity = 0;  // Counted again by the parameters parsing
+
+    begin_scope(&parser);
+    consume(&parser, TOKEN_LEFT_PAREN, "expect '(' after name");
+    parameters(&parser, TOKEN_RIGHT_PAREN);
+    function_block(&parser);
+    end_context(&parser, false);
+
+    free_dict(&parser.bindings);
+    free_dict(&parser.assigned);
+
+    if (parser.had_error) {
+        free_chunk(&function->chunk);
+        init_chunk(&function->chunk);
+        return false;
+    }
+
+    function->source = NULL;
+    return true;
+}
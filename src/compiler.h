@@ -9,4 +9,9 @@
 // or NULL on compilation error.
 RavFunction *compile(VM *vm, const char *source, const char *file);
 
+// Compile the body of a lazily compiled function (one with a source),
+// on its first call. Return false on compilation error, the function
+// stays uncompiled.
+bool compile_function(VM *vm, RavFunction *function, const char *file);
+
 #endif
@@ -17,6 +17,16 @@ static int const_instruction(const char *tag, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
+static int const16_instruction(const char *tag, Chunk *chunk,
+                               int offset) {
+    uint16_t constant_index = (uint16_t)(chunk->opcodes[offset + 1] << 8 |
+                                         chunk->opcodes[offset + 2]);
+    printf("%-16s %4d '", tag, constant_index);
+    print_value(chunk->constants[constant_index]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int byte_instruction(const char *tag, Chunk *chunk, int offset) {
     uint8_t count = chunk->opcodes[offset + 1];
     printf("%-16s %4d\n", tag, count);
@@ -33,28 +43,69 @@ static int short_instruction(const char *tag, Chunk *chunk, int offset) {
 
 static int jump_instruction(const char *tag, Chunk *chunk, int sign,
                             int offset) {
-    uint16_t jump = (uint16_t)(chunk->opcodes[offset + 1] << 8 |
-                               chunk->opcodes[offset + 2]);
+    int jump = read_operand(chunk, offset);
+    int size = instruction_size(chunk, offset);
 
-    printf("%-16s %4d -> %d\n", tag, offset, offset + 3 + sign * jump);
-    return offset + 3;
+    printf("%-16s %4d -> %d\n", tag, offset, offset + size + sign * jump);
+    return offset + size;
+}
+
+static int inlined_instruction(const char *tag, Chunk *chunk, int offset) {
+    uint8_t *operands = &chunk->opcodes[offset + 3];
+    int global = operands[0] << 8 | operands[1];
+    int index = operands[2] << 8 | operands[3];
+
+    printf("%-16s %4d -> %d global %d '", tag, offset,
+           offset + 7 + read_operand(chunk, offset), global);
+    print_value(chunk->constants[index]);
+    printf("'\n");
+    return offset + 7;
 }
 
-static int closure_instruction(Chunk *chunk, int offset) {
-    offset++;
-    uint8_t index = chunk->opcodes[offset++];
+static int switch_instruction(const char *tag, Chunk *chunk, int offset) {
+    int index = read_operand(chunk, offset);
+    int size = instruction_size(chunk, offset);
+    Dict *table = &As_Map(chunk->constants[index])->dict;
+
+    printf("%-16s %4d\n", tag, index);
+
+    for (int i = 0; i < table->entries_count; i++) {
+        DictEntry *entry = &table->entries[i];
+        if (Is_Void(entry->key)) continue;
+
+        printf("%04d     |                     ", offset);
+        print_value(entry->key);
+        printf(" -> %d\n", offset + size + (int)As_Num(entry->value));
+    }
+
+    return offset + size;
+}
+
+static int closure_instruction(const char *tag, Chunk *chunk, int offset) {
+    bool wide = chunk->opcodes[offset] == OP_CLOSURE_16;
+    int index = read_operand(chunk, offset);
     Value value = chunk->constants[index];
+    offset += wide ? 3 : 2;
 
-    printf("%-16s %4d ", "CLOSURE", index);
+    printf("%-16s %4d ", tag, index);
     print_value(value);
     putchar('\n');
 
+    // The upvalues entries, then the captured values entries.
     RavFunction *function = As_Function(value);
-    for (int i = 0; i < function->upvalue_count; i++) {
+    int count = function->upvalue_count + function->capture_count;
+
+    for (int i = 0; i < count; i++) {
+        int entry = offset;
         uint8_t is_local = chunk->opcodes[offset++];
-        uint8_t index = chunk->opcodes[offset++];
-        printf("%04d     |                     %s %d\n",
-               offset - 2, is_local ? "local" : "upvalue", index);
+        int index = chunk->opcodes[offset++];
+        if (wide) index = index << 8 | chunk->opcodes[offset++];
+
+        const char *kind = i < function->upvalue_count ?
+            (is_local ? "local" : "upvalue") :
+            (is_local ? "copy local" : "copy capture");
+
+        printf("%04d     |                     %s %d\n", entry, kind, index);
     }
 
     return offset;
@@ -85,6 +136,9 @@ int disassemble_instruction(Chunk *chunk, int offset) {
     case OP_PUSH_CONST:
         return const_instruction("PUSH_CONST", chunk, offset);
 
+    case OP_PUSH_CONST_16:
+        return const16_instruction("PUSH_CONST_16", chunk, offset);
+
     case OP_PUSH_X:
         return basic_instruction("PUSH_X", offset);
 
@@ -97,6 +151,12 @@ int disassemble_instruction(Chunk *chunk, int offset) {
     case OP_POPN:
         return byte_instruction("POPN", chunk, offset);
 
+    case OP_PEEK:
+        return byte_instruction("PEEK", chunk, offset);
+
+    case OP_SLIDE:
+        return byte_instruction("SLIDE", chunk, offset);
+
     case OP_ADD:
         return basic_instruction("ADD", offset);
 
@@ -178,9 +238,39 @@ int disassemble_instruction(Chunk *chunk, int offset) {
     case OP_GET_UPVALUE:
         return byte_instruction("GET_UPVALUE", chunk, offset);
 
+    case OP_GET_CAPTURE:
+        return byte_instruction("GET_CAPTURE", chunk, offset);
+
+    case OP_DEF_GLOBAL_16:
+        return short_instruction("DEF_GLOBAL_16", chunk, offset);
+
+    case OP_SET_GLOBAL_16:
+        return short_instruction("SET_GLOBAL_16", chunk, offset);
+
+    case OP_GET_GLOBAL_16:
+        return short_instruction("GET_GLOBAL_16", chunk, offset);
+
+    case OP_SET_LOCAL_16:
+        return short_instruction("SET_LOCAL_16", chunk, offset);
+
+    case OP_GET_LOCAL_16:
+        return short_instruction("GET_LOCAL_16", chunk, offset);
+
+    case OP_SET_UPVALUE_16:
+        return short_instruction("SET_UPVALUE_16", chunk, offset);
+
+    case OP_GET_UPVALUE_16:
+        return short_instruction("GET_UPVALUE_16", chunk, offset);
+
+    case OP_GET_CAPTURE_16:
+        return short_instruction("GET_CAPTURE_16", chunk, offset);
+
     case OP_CALL:
         return byte_instruction("CALL", chunk, offset);
 
+    case OP_CALL_CONS:
+        return byte_instruction("CALL_CONS", chunk, offset);
+
     case OP_JMP:
         return jump_instruction("JMP", chunk, 1, offset);
 
@@ -193,8 +283,32 @@ int disassemble_instruction(Chunk *chunk, int offset) {
     case OP_JMP_POP_FALSE:
         return jump_instruction("JMP_POP_FALSE", chunk, 1, offset);
 
+    case OP_JMP_24:
+        return jump_instruction("JMP_24", chunk, 1, offset);
+
+    case OP_JMP_BACK_24:
+        return jump_instruction("JMP_BACK_24", chunk, -1, offset);
+
+    case OP_JMP_FALSE_24:
+        return jump_instruction("JMP_FALSE_24", chunk, 1, offset);
+
+    case OP_JMP_POP_FALSE_24:
+        return jump_instruction("JMP_POP_FALSE_24", chunk, 1, offset);
+
+    case OP_JMP_INLINED:
+        return inlined_instruction("JMP_INLINED", chunk, offset);
+
+    case OP_SWITCH:
+        return switch_instruction("SWITCH", chunk, offset);
+
+    case OP_SWITCH_16:
+        return switch_instruction("SWITCH_16", chunk, offset);
+
     case OP_CLOSURE:
-        return closure_instruction(chunk, offset);
+        return closure_instruction("CLOSURE", chunk, offset);
+
+    case OP_CLOSURE_16:
+        return closure_instruction("CLOSURE_16", chunk, offset);
 
     case OP_CLOSE_UPVALUE:
         return basic_instruction("CLOSE_UPVALUE", offset);
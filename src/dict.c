@@ -0,0 +1,171 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "dict.h"
+#include "object.h"
+#include "value.h"
+
+// Index slots markers, the rest are positions in the entries array.
+#define SLOT_EMPTY -1
+#define SLOT_DUMMY -2  // Removed entry, the probing continues past it
+
+// The number of usable entries for an index size, keeping the index
+// load factor at most 2/3.
+#define Usable_Size(index_size) (((index_size) * 2) / 3)
+
+#define DICT_MIN_INDEX 8
+
+void init_dict(Dict *dict) {
+    dict->entries = NULL;
+    dict->entries_count = 0;
+    dict->count = 0;
+    dict->index = NULL;
+    dict->index_mask = -1;
+}
+
+void free_dict(Dict *dict) {
+    free(dict->entries);
+    free(dict->index);
+    init_dict(dict);
+}
+
+static inline int index_size(Dict *dict) {
+    return dict->index_mask + 1;
+}
+
+static inline int slot_width(int size) {
+    if (size <= INT8_MAX + 1) return 1;
+    if (size <= INT16_MAX + 1) return 2;
+    return 4;
+}
+
+static inline int get_slot(Dict *dict, uint32_t slot) {
+    int size = index_size(dict);
+
+    if (size <= INT8_MAX + 1) return ((int8_t *)dict->index)[slot];
+    if (size <= INT16_MAX + 1) return ((int16_t *)dict->index)[slot];
+    return ((int32_t *)dict->index)[slot];
+}
+
+static inline void set_slot(Dict *dict, uint32_t slot, int position) {
+    int size = index_size(dict);
+
+    if (size <= INT8_MAX + 1) {
+        ((int8_t *)dict->index)[slot] = (int8_t)position;
+    } else if (size <= INT16_MAX + 1) {
+        ((int16_t *)dict->index)[slot] = (int16_t)position;
+    } else {
+        ((int32_t *)dict->index)[slot] = (int32_t)position;
+    }
+}
+
+// Return the index slot of key, or SLOT_EMPTY if it's not found.
+static int64_t find_slot(Dict *dict, Value key, uint32_t hash) {
+    uint32_t slot = hash & dict->index_mask;
+
+    for (;;) {
+        int position = get_slot(dict, slot);
+
+        if (position == SLOT_EMPTY) return SLOT_EMPTY;
+
+        if (position != SLOT_DUMMY &&
+            equal_values(dict->entries[position].key, key)) {
+            return slot;
+        }
+
+        slot = (slot + 1) & dict->index_mask;
+    }
+}
+
+// Return the first empty slot for a hash, the key must not be present.
+static uint32_t find_empty_slot(Dict *dict, uint32_t hash) {
+    uint32_t slot = hash & dict->index_mask;
+
+    while (get_slot(dict, slot) >= 0) {
+        slot = (slot + 1) & dict->index_mask;
+    }
+
+    return slot;
+}
+
+// Rebuild the dict, dropping the removed entries and sizing the index
+// to fit the live entries plus at least one new entry.
+static void resize(Dict *dict) {
+    int size = DICT_MIN_INDEX;
+    while (Usable_Size(size) <= dict->count) size *= 2;
+
+    int usable = Usable_Size(size);
+
+    // Compact the live entries in place, keeping their order.
+    int live = 0;
+    for (int i = 0; i < dict->entries_count; i++) {
+        if (Is_Void(dict->entries[i].key)) continue;
+        dict->entries[live++] = dict->entries[i];
+    }
+
+    dict->entries = realloc(dict->entries, usable * sizeof (DictEntry));
+    dict->entries_count = live;
+
+    free(dict->index);
+    dict->index = malloc(size * slot_width(size));
+    dict->index_mask = size - 1;
+
+    for (int i = 0; i < size; i++) set_slot(dict, i, SLOT_EMPTY);
+
+    for (int i = 0; i < live; i++) {
+        uint32_t hash = hash_value(dict->entries[i].key);
+        uint32_t slot = find_empty_slot(dict, hash);
+        set_slot(dict, slot, i);
+    }
+}
+
+bool dict_get(Dict *dict, Value key, Value *value) {
+    if (dict->count == 0) return false;
+
+    int64_t slot = find_slot(dict, key, hash_value(key));
+    if (slot == SLOT_EMPTY) return false;
+
+    *value = dict->entries[get_slot(dict, slot)].value;
+    return true;
+}
+
+bool dict_set(Dict *dict, Value key, Value value) {
+    uint32_t hash = hash_value(key);
+
+    if (dict->count > 0) {
+        int64_t slot = find_slot(dict, key, hash);
+
+        if (slot != SLOT_EMPTY) {
+            dict->entries[get_slot(dict, slot)].value = value;
+            return false;
+        }
+    }
+
+    if (dict->entries_count == Usable_Size(index_size(dict))) {
+        resize(dict);
+    }
+
+    int position = dict->entries_count++;
+    dict->entries[position].key = key;
+    dict->entries[position].value = value;
+    dict->count++;
+
+    set_slot(dict, find_empty_slot(dict, hash), position);
+    return true;
+}
+
+bool dict_remove(Dict *dict, Value key) {
+    if (dict->count == 0) return false;
+
+    int64_t slot = find_slot(dict, key, hash_value(key));
+    if (slot == SLOT_EMPTY) return false;
+
+    DictEntry *entry = &dict->entries[get_slot(dict, slot)];
+    entry->key = Void_Value;
+    entry->value = Nil_Value;
+
+    set_slot(dict, slot, SLOT_DUMMY);
+    dict->count--;
+
+    return true;
+}
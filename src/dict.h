@@ -0,0 +1,53 @@
+#ifndef raven_dict_h
+#define raven_dict_h
+
+// Compact insertion-ordered hash table (used by map objects).
+//
+// The keys are arbitrary values, compared with 'equal_values' and
+// hashed with 'hash_value'. The entries are stored densely in insertion
+// order, and a separate open-addressing index array maps hash slots to
+// entry positions.
+// The index slots are 1, 2 or 4 bytes wide depending on the size of
+// the table, which makes the table much smaller than a sparse array
+// of entries, and the iteration only touches the entries array.
+
+#include "common.h"
+#include "value.h"
+
+typedef struct {
+    Value key;  // Void_Value indicates a removed entry
+    Value value;
+} DictEntry;
+
+typedef struct {
+    // Dense array of entries in insertion order.
+    DictEntry *entries;
+    int entries_count;  // Used entries, including removed ones
+    int count;          // Live entries
+
+    // Sparse index of entry positions, its width is determined
+    // by the index size.
+    void *index;
+    int index_mask;
+} Dict;
+
+// Initialize dict state.
+void init_dict(Dict *dict);
+
+// Dispose dict owned memory.
+void free_dict(Dict *dict);
+
+// Set value to the value corresponding to key if it's found.
+// Return true if a value is found, false otherwise.
+bool dict_get(Dict *dict, Value key, Value *value);
+
+// Set the value corresponding to key to value, or append a new
+// entry if there is no entry for the key.
+// Return true if it's a new key, false otherwise.
+bool dict_set(Dict *dict, Value key, Value value);
+
+// Remove the entry corresponding to key, if it's found.
+// Return true if there is an entry, false otherwise.
+bool dict_remove(Dict *dict, Value key);
+
+#endif
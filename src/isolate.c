@@ -0,0 +1,703 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "dict.h"
+#include "isolate.h"
+#include "mem.h"
+#include "object.h"
+#include "raven.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+struct RavIsolate {
+    VM vm;
+    pthread_t thread;
+    char *path;
+
+    // The call to run, in the heap of the isolate.
+    Value callee;
+    Value *args;
+    int count;
+
+    InterpretResult status;
+    Value result;
+};
+
+// Return a malloc'ed copy of a raw array, or NULL if it's empty.
+static void *copy_bytes(const void *bytes, size_t size) {
+    if (size == 0) return NULL;
+
+    void *copied = malloc(size);
+    memcpy(copied, bytes, size);
+    return copied;
+}
+
+/** Frozen Values **/
+
+struct Region {
+    int references;   // Number of the holding vms, updated atomically
+    Object *objects;  // The frozen objects, linked by their next field
+};
+
+// Each frozen object is preceded by a pointer to its region.
+#define Region_Of(object) (((Region **)(object))[-1])
+
+static Object *frozen_object(Region *region, ObjectType type, size_t size) {
+    Region **block = malloc(sizeof (Region *) + size);
+    *block = region;
+
+    Object *object = (Object *)(block + 1);
+    object->type = type;
+    object->marked = false;
+    object->frozen = true;
+    object->next = region->objects;
+    region->objects = object;
+
+    return object;
+}
+
+static void free_region(Region *region) {
+    Object *object = region->objects;
+
+    while (object != NULL) {
+        Object *next = object->next;
+
+        switch (object->type) {
+        case OBJ_STRING:
+            free(((RavString *)object)->chars);
+            break;
+        case OBJ_ARRAY:
+            free(((RavArray *)object)->values);
+            break;
+        case OBJ_TYPED_ARRAY:
+            free(((RavTypedArray *)object)->as.bytes);
+            break;
+        case OBJ_MAP:
+            free_dict(&((RavMap *)object)->dict);
+            break;
+        default:
+            break;
+        }
+
+        free((Region **)object - 1);
+        object = next;
+    }
+
+    free(region);
+}
+
+typedef struct {
+    Region *region;
+    Dict copies;  // The frozen objects, by their source
+    bool failed;  // A function was found
+} Freezer;
+
+static Value freeze(Freezer *freezer, Value value);
+
+// Freeze a list, iteratively along its tail.
+static Value freeze_list(Freezer *freezer, Value value) {
+    RavPair *root = NULL, *last = NULL;
+
+    while (Is_Pair(value)) {
+        Value copied;
+        if (dict_get(&freezer->copies, value, &copied)) break;
+
+        RavPair *pair = (RavPair *)frozen_object(freezer->region, OBJ_PAIR,
+                                                 sizeof (RavPair));
+        pair->tail = Nil_Value;
+        dict_set(&freezer->copies, value, Obj_Value(pair));
+        pair->head = freeze(freezer, As_Pair(value)->head);
+
+        if (last == NULL) {
+            root = pair;
+        } else {
+            last->tail = Obj_Value(pair);
+        }
+
+        last = pair;
+        value = As_Pair(value)->tail;
+    }
+
+    last->tail = freeze(freezer, value);
+    return Obj_Value(root);
+}
+
+static Value freeze(Freezer *freezer, Value value) {
+    if (!Is_Obj(value)) return value;
+
+    Value copied;
+    if (dict_get(&freezer->copies, value, &copied)) return copied;
+
+    Region *region = freezer->region;
+    Object *object;
+
+    switch (Obj_Type(value)) {
+    case OBJ_STRING: {
+        RavString *from = As_String(value);
+        RavString *string = (RavString *)
+            frozen_object(region, OBJ_STRING, sizeof (RavString));
+
+        string->length = from->length;
+        string->hash = from->hash;
+        string->chars = malloc(from->length + 1);
+        memcpy(string->chars, from->chars, from->length + 1);
+        object = (Object *)string;
+        break;
+    }
+
+    case OBJ_PAIR:
+        return freeze_list(freezer, value);
+
+    case OBJ_ARRAY: {
+        RavArray *from = As_Array(value);
+        RavArray *array = (RavArray *)
+            frozen_object(region, OBJ_ARRAY, sizeof (RavArray));
+
+        array->values = copy_bytes(from->values,
+                                   from->count * sizeof (Value));
+        array->count = array->capacity = from->count;
+        dict_set(&freezer->copies, value, Obj_Value(array));
+
+        for (size_t i = 0; i < from->count; i++) {
+            array->values[i] = freeze(freezer, from->values[i]);
+        }
+        return Obj_Value(array);
+    }
+
+    case OBJ_TYPED_ARRAY: {
+        RavTypedArray *from = As_Typed_Array(value);
+        RavTypedArray *array = (RavTypedArray *)
+            frozen_object(region, OBJ_TYPED_ARRAY, sizeof (RavTypedArray));
+
+        array->type = from->type;
+        array->count = from->count;
+        array->as.bytes = copy_bytes(from->as.bytes, from->count *
+                                     typed_element_size(from->type));
+        object = (Object *)array;
+        break;
+    }
+
+    case OBJ_MAP: {
+        Dict *from = &As_Map(value)->dict;
+        RavMap *map = (RavMap *)
+            frozen_object(region, OBJ_MAP, sizeof (RavMap));
+
+        init_dict(&map->dict);
+        dict_set(&freezer->copies, value, Obj_Value(map));
+
+        for (int i = 0; i < from->entries_count; i++) {
+            DictEntry *entry = &from->entries[i];
+            if (Is_Void(entry->key)) continue;
+
+            Value key = freeze(freezer, entry->key);
+            dict_set(&map->dict, key, freeze(freezer, entry->value));
+        }
+        return Obj_Value(map);
+    }
+
+    default:
+        freezer->failed = true;
+        return Nil_Value;
+    }
+
+    dict_set(&freezer->copies, value, Obj_Value(object));
+    return Obj_Value(object);
+}
+
+Value freeze_value(VM *vm, Value value) {
+    if (!Is_Obj(value) || As_Obj(value)->frozen) return value;
+
+    return freeze_values(vm, &value, 1) ? value : Void_Value;
+}
+
+bool freeze_values(VM *vm, Value *values, int count) {
+    Freezer freezer = { .failed = false };
+    freezer.region = malloc(sizeof (Region));
+    freezer.region->references = 0;
+    freezer.region->objects = NULL;
+    init_dict(&freezer.copies);
+
+    for (int i = 0; i < count && !freezer.failed; i++) {
+        freeze(&freezer, values[i]);
+    }
+
+    // The values not found in the copies aren't objects.
+    for (int i = 0; i < count && !freezer.failed; i++) {
+        dict_get(&freezer.copies, values[i], &values[i]);
+    }
+
+    free_dict(&freezer.copies);
+
+    if (freezer.failed || freezer.region->objects == NULL) {
+        free_region(freezer.region);
+        return !freezer.failed;
+    }
+
+    hold_region(&vm->regions, freezer.region->objects);
+    return true;
+}
+
+void hold_region(Regions *regions, Object *object) {
+    Region *region = Region_Of(object);
+
+    // Most references of a round are to the same few regions, searched
+    // from the most recently held.
+    for (int i = regions->count - 1; i >= 0; i--) {
+        if (regions->entries[i].region == region) {
+            regions->entries[i].reached = true;
+            return;
+        }
+    }
+
+    if (regions->count == regions->capacity) {
+        regions->capacity = Grow_Capacity(regions->capacity);
+        regions->entries = realloc(regions->entries, regions->capacity *
+                                                     sizeof (HeldRegion));
+    }
+
+    __atomic_add_fetch(&region->references, 1, __ATOMIC_RELAXED);
+    regions->entries[regions->count++] = (HeldRegion){ region, true };
+}
+
+void release_regions(Regions *regions, bool all) {
+    int count = 0;
+
+    for (int i = 0; i < regions->count; i++) {
+        HeldRegion *held = &regions->entries[i];
+
+        if (held->reached && !all) {
+            held->reached = false;
+            regions->entries[count++] = *held;
+        } else if (__atomic_sub_fetch(&held->region->references, 1,
+                                      __ATOMIC_ACQ_REL) == 0) {
+            free_region(held->region);
+        }
+    }
+
+    regions->count = count;
+    if (all) {
+        free(regions->entries);
+        regions->entries = NULL;
+        regions->capacity = 0;
+    }
+}
+
+/** Copying **/
+
+typedef struct {
+    Allocator *allocator;  // The destination heap
+    Regions *regions;      // Holding the shared frozen objects
+    Dict copies;           // The copied objects of the source, by their copy
+} Copier;
+
+static Value copy(Copier *copier, Value value);
+
+static RavString *copy_string(Copier *copier, RavString *string) {
+    if (string == NULL) return NULL;
+
+    return new_string(copier->allocator, string->chars,
+                      string->length);
+}
+
+static void copy_chunk(Copier *copier, Chunk *to, Chunk *from) {
+    to->opcodes = copy_bytes(from->opcodes, from->count);
+    to->count = to->capacity = from->count;
+
+    to->lines = copy_bytes(from->lines, from->lines_count * sizeof (Line));
+    to->lines_count = to->lines_capacity = from->lines_count;
+
+    // The constants are appended one by one, so the chunk is consistent
+    // if a constant refers back to its function.
+    int count = from->constants_count;
+    to->constants = count == 0 ? NULL : malloc(count * sizeof (Value));
+    to->constants_capacity = count;
+
+    for (int i = 0; i < count; i++) {
+        to->constants[to->constants_count++] =
+            copy(copier, from->constants[i]);
+    }
+}
+
+// Copy a list, the pairs along the tail are copied iteratively, so
+// a long list doesn't overflow the C stack.
+static Value copy_list(Copier *copier, RavPair *pair) {
+    Allocator *allocator = copier->allocator;
+    RavPair *root = NULL, *last = NULL;
+    Value value = Obj_Value(pair);
+
+    while (Is_Pair(value)) {
+        Value copied;
+        if (dict_get(&copier->copies, value, &copied)) break;
+
+        RavPair *node = new_pair(allocator, Nil_Value, Nil_Value);
+        dict_set(&copier->copies, value, Obj_Value(node));
+        node->head = copy(copier, As_Pair(value)->head);
+
+        if (last == NULL) {
+            root = node;
+        } else {
+            last->tail = Obj_Value(node);
+        }
+
+        last = node;
+        value = As_Pair(value)->tail;
+    }
+
+    last->tail = copy(copier, value);
+    return Obj_Value(root);
+}
+
+static Value copy(Copier *copier, Value value) {
+    if (!Is_Obj(value)) return value;
+
+    // The frozen objects are shared.
+    if (As_Obj(value)->frozen) {
+        hold_region(copier->regions, As_Obj(value));
+        return value;
+    }
+
+    Value copied;
+    if (dict_get(&copier->copies, value, &copied)) return copied;
+
+    Allocator *allocator = copier->allocator;
+    Object *object = NULL;
+
+    // The copy is registered before copying the references, for the
+    // cycles to refer to it.
+    switch (Obj_Type(value)) {
+    case OBJ_STRING:
+        object = (Object *)copy_string(copier, As_String(value));
+        break;
+
+    case OBJ_PAIR:
+        return copy_list(copier, As_Pair(value));
+
+    case OBJ_ARRAY: {
+        RavArray *from = As_Array(value);
+        RavArray *array = new_array_capacity(allocator, from->count);
+        dict_set(&copier->copies, value, Obj_Value(array));
+
+        for (size_t i = 0; i < from->count; i++) {
+            array->values[array->count++] = copy(copier, from->values[i]);
+        }
+        return Obj_Value(array);
+    }
+
+    case OBJ_TYPED_ARRAY: {
+        RavTypedArray *from = As_Typed_Array(value);
+        RavTypedArray *array = new_typed_array(allocator, from->type,
+                                               from->count);
+        memcpy(array->as.bytes, from->as.bytes,
+               from->count * typed_element_size(from->type));
+        object = (Object *)array;
+        break;
+    }
+
+    case OBJ_MAP: {
+        Dict *from = &As_Map(value)->dict;
+        RavMap *map = new_map(allocator);
+        dict_set(&copier->copies, value, Obj_Value(map));
+
+        for (int i = 0; i < from->entries_count; i++) {
+            DictEntry *entry = &from->entries[i];
+            if (Is_Void(entry->key)) continue;
+
+            Value key = copy(copier, entry->key);
+            dict_set(&map->dict, key, copy(copier, entry->value));
+        }
+        return Obj_Value(map);
+    }
+
+    case OBJ_FUNCTION: {
+        RavFunction *from = As_Function(value);
+        RavFunction *function = new_function(allocator);
+        dict_set(&copier->copies, value, Obj_Value(function));
+
+        function->name = copy_string(copier, from->name);
+        function->arity = from->arity;
+        function->upvalue_count = from->upvalue_count;
+        function->capture_count = from->capture_count;
+        function->slots_count = from->slots_count;
+        function->source = copy_string(copier, from->source);
+        function->line = from->line;
+
+        copy_chunk(copier, &function->chunk, &from->chunk);
+        return Obj_Value(function);
+    }
+
+    case OBJ_UPVALUE: {
+        // An open upvalue gets closed over the current value of its
+        // variable.
+        RavUpvalue *from = (RavUpvalue *)As_Obj(value);
+        RavUpvalue *upvalue = new_upvalue(allocator, NULL);
+        upvalue->location = &upvalue->captured;
+        dict_set(&copier->copies, value, Obj_Value(upvalue));
+
+        upvalue->captured = copy(copier, *from->location);
+        return Obj_Value(upvalue);
+    }
+
+    case OBJ_CLOSURE: {
+        RavClosure *from = As_Closure(value);
+        Value function = copy(copier, Obj_Value(from->function));
+
+        RavClosure *closure = new_closure(allocator, As_Function(function));
+        dict_set(&copier->copies, value, Obj_Value(closure));
+
+        for (int i = 0; i < from->upvalue_count; i++) {
+            Value upvalue = copy(copier, Obj_Value(from->upvalues[i]));
+            closure->upvalues[i] = (RavUpvalue *)As_Obj(upvalue);
+        }
+
+        for (int i = 0; i < from->capture_count; i++) {
+            closure->captures[i] = copy(copier, from->captures[i]);
+        }
+        return Obj_Value(closure);
+    }
+
+    case OBJ_NATIVE: {
+        RavNative *from = As_Native(value);
+        object = (Object *)new_native(allocator,
+                                      copy_string(copier, from->name),
+                                      from->arity, from->function);
+        break;
+    }
+
+    case OBJ_COROUTINE:
+    case OBJ_FUTURE:
+    case OBJ_TYPES_COUNT:
+        // Its stacks, or its task, belong to the source vm, it isn't
+        // copied.
+        return Nil_Value;
+    }
+
+    dict_set(&copier->copies, value, Obj_Value(object));
+    return Obj_Value(object);
+}
+
+// The GC of the destination is off during the whole copy, the copied
+// objects aren't reachable until it's done.
+static void begin_copy(Copier *copier, Allocator *allocator,
+                       Regions *regions) {
+    copier->allocator = allocator;
+    copier->regions = regions;
+    init_dict(&copier->copies);
+}
+
+static void end_copy(Copier *copier) {
+    free_dict(&copier->copies);
+}
+
+Value copy_value(VM *vm, Value value) {
+    bool gc_off = vm->allocator.gc_off;
+    vm->allocator.gc_off = true;
+
+    Copier copier;
+    begin_copy(&copier, &vm->allocator, &vm->regions);
+    Value copied = copy(&copier, value);
+    end_copy(&copier);
+
+    vm->allocator.gc_off = gc_off;
+    return copied;
+}
+
+// Define the globals of a given count into a vm, at the same indexes as
+// the copied code refers to them by index, from their names and values
+// in the source heap, along with the inlined functions. The vm already
+// has the builtins, defined first by every vm, its globals are assigned.
+static void define_globals(Copier *copier, VM *vm, int count, Value *names,
+                           Value *values, Dict *inlined) {
+    for (int i = vm->globals.count; i < count; i++) {
+        add_global(vm, copy_string(copier, As_String(names[i])));
+    }
+
+    for (int i = 0; i < count; i++) {
+        vm->global_buffer[i] = copy(copier, values[i]);
+    }
+
+    for (int i = 0; i < inlined->entries_count; i++) {
+        DictEntry *entry = &inlined->entries[i];
+        if (Is_Void(entry->key)) continue;
+
+        dict_set(&vm->inlined_globals, entry->key,
+                 copy(copier, entry->value));
+    }
+}
+
+// Return the names of the globals of a vm, in the order of their indexes.
+static Value *global_names(VM *vm) {
+    Value *names = calloc(vm->globals.count + 1, sizeof (Value));
+
+    for (int i = 0; i <= vm->globals.hash_mask; i++) {
+        Entry *entry = &vm->globals.entries[i];
+        if (entry->key == NULL) continue;
+
+        names[(int)As_Num(entry->value)] = Obj_Value(entry->key);
+    }
+
+    return names;
+}
+
+/** Parcels **/
+
+static Parcel *new_parcel(void) {
+    Parcel *parcel = malloc(sizeof (Parcel));
+
+    init_allocator(&parcel->allocator);
+    parcel->allocator.gc_off = true;
+    parcel->regions.entries = NULL;
+    parcel->regions.count = 0;
+    parcel->regions.capacity = 0;
+    parcel->allocator.regions = &parcel->regions;
+    parcel->value = Nil_Value;
+
+    return parcel;
+}
+
+Parcel *pack_values(Value *values, int count) {
+    Parcel *parcel = new_parcel();
+
+    Copier copier;
+    begin_copy(&copier, &parcel->allocator, &parcel->regions);
+
+    RavArray *array = new_array_capacity(&parcel->allocator, count);
+    for (int i = 0; i < count; i++) {
+        array->values[array->count++] = copy(&copier, values[i]);
+    }
+
+    end_copy(&copier);
+    parcel->value = Obj_Value(array);
+    return parcel;
+}
+
+Parcel *pack_globals(VM *vm) {
+    Parcel *parcel = new_parcel();
+    Allocator *allocator = &parcel->allocator;
+    int count = vm->globals.count;
+
+    Copier copier;
+    begin_copy(&copier, allocator, &parcel->regions);
+
+    Value *names = global_names(vm);
+    RavArray *names_array = new_array_capacity(allocator, count);
+    RavArray *values_array = new_array_capacity(allocator, count);
+
+    for (int i = 0; i < count; i++) {
+        names_array->values[names_array->count++] = copy(&copier, names[i]);
+        values_array->values[values_array->count++] =
+            copy(&copier, vm->global_buffer[i]);
+    }
+    free(names);
+
+    RavMap *inlined = new_map(allocator);
+    Dict *from = &vm->inlined_globals;
+    for (int i = 0; i < from->entries_count; i++) {
+        DictEntry *entry = &from->entries[i];
+        if (Is_Void(entry->key)) continue;
+
+        dict_set(&inlined->dict, entry->key, copy(&copier, entry->value));
+    }
+
+    end_copy(&copier);
+
+    Value parts[] = {
+        Obj_Value(names_array), Obj_Value(values_array), Obj_Value(inlined),
+    };
+    parcel->value = Obj_Value(new_array(allocator, parts, 3));
+    return parcel;
+}
+
+void unpack_globals(VM *vm, Parcel *parcel) {
+    bool gc_off = vm->allocator.gc_off;
+    vm->allocator.gc_off = true;
+
+    Value *parts = As_Array(parcel->value)->values;
+    RavArray *names = As_Array(parts[0]);
+
+    Copier copier;
+    begin_copy(&copier, &vm->allocator, &vm->regions);
+    define_globals(&copier, vm, (int)names->count, names->values,
+                   As_Array(parts[1])->values, &As_Map(parts[2])->dict);
+    end_copy(&copier);
+
+    vm->allocator.gc_off = gc_off;
+}
+
+void free_parcel(Parcel *parcel) {
+    release_regions(&parcel->regions, true);
+    free_allocator(&parcel->allocator);
+    free(parcel);
+}
+
+/** Spawning **/
+
+// Copy the globals of the parent into the isolate.
+static void copy_globals(Copier *copier, VM *vm, VM *parent) {
+    Value *names = global_names(parent);
+    define_globals(copier, vm, parent->globals.count, names,
+                   parent->global_buffer, &parent->inlined_globals);
+    free(names);
+}
+
+static void *run_isolate(void *data) {
+    RavIsolate *isolate = data;
+
+    isolate->status = call_function(&isolate->vm, isolate->callee,
+                                    isolate->count, isolate->args,
+                                    &isolate->result);
+    return NULL;
+}
+
+RavIsolate *spawn_isolate(VM *vm, Value callee, int count, Value *args) {
+    RavIsolate *isolate = malloc(sizeof (RavIsolate));
+    init_vm(&isolate->vm);
+    isolate->path = strdup(vm->path);
+    isolate->vm.path = isolate->path;
+
+    Copier copier;
+    isolate->vm.allocator.gc_off = true;
+    begin_copy(&copier, &isolate->vm.allocator, &isolate->vm.regions);
+
+    copy_globals(&copier, &isolate->vm, vm);
+    isolate->callee = copy(&copier, callee);
+    isolate->args = copy_bytes(args, count * sizeof (Value));
+    isolate->count = count;
+
+    for (int i = 0; i < count; i++) {
+        isolate->args[i] = copy(&copier, args[i]);
+    }
+
+    end_copy(&copier);
+
+    // The call pushes the callee and the arguments on the stack of the
+    // isolate before anything gets allocated.
+    isolate->vm.allocator.gc_off = false;
+
+    if (pthread_create(&isolate->thread, NULL, run_isolate, isolate) != 0) {
+        free_vm(&isolate->vm);
+        free(isolate->args);
+        free(isolate->path);
+        free(isolate);
+        return NULL;
+    }
+
+    return isolate;
+}
+
+InterpretResult join_isolate(VM *vm, RavIsolate *isolate, Value *result) {
+    pthread_join(isolate->thread, NULL);
+
+    InterpretResult status = isolate->status;
+    if (status == INTERPRET_OK && result != NULL) {
+        *result = copy_value(vm, isolate->result);
+    }
+
+    free_vm(&isolate->vm);
+    free(isolate->args);
+    free(isolate->path);
+    free(isolate);
+    return status;
+}
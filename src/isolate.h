@@ -0,0 +1,88 @@
+#ifndef raven_isolate_h
+#define raven_isolate_h
+
+// Isolates.
+//
+// An isolate is a vm with its own heap, running a function in its own
+// thread. Nothing is shared between the vms, the objects of a heap are
+// only ever touched by the thread running its vm, so the vm needs no
+// locking. The values are passed between isolates by deep copies: the
+// new isolate starts with a copy of the globals of its parent, of the
+// function and of its arguments (like a fork), and its result is copied
+// back into the heap of the vm joining it.
+//
+// The embedding API is in raven.h, the scripts use the 'spawn' and
+// 'join' natives.
+//
+// Frozen values.
+//
+// A frozen value is a deep immutable copy of a data graph (strings,
+// lists, arrays, typed arrays and maps), allocated out of any heap in
+// a region shared by the vms. It's passed to an isolate as is, without
+// copying. A region is reference counted, each vm which can reach it
+// holds one reference, the GC of the vm releases it once it's no longer
+// reachable. The frozen objects are never written, not even by the GC,
+// and the frozen strings aren't interned.
+//
+// Parcels.
+//
+// A parcel holds copies of values in a heap of its own, out of any vm,
+// so it can be handed over to another thread, then copied into the heap
+// of the vm receiving it with 'copy_value', by any number of vms at once
+// since the copy doesn't modify it. Its heap has no GC, it's freed along
+// with the parcel. The tasks carry their calls and their results between
+// the vms of the scheduler workers this way (see scheduler.h).
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+typedef struct {
+    Allocator allocator;
+    Regions regions;  // Of the frozen values it references
+    Value value;
+} Parcel;
+
+// Return a copy of a value of another heap in the heap of a given vm,
+// along with every object reachable from it, but the frozen ones which
+// are shared, and the coroutines and futures which are replaced with
+// nil. The source heap must not be running during the copy.
+Value copy_value(VM *vm, Value value);
+
+// Return a frozen copy of a value, or Void_Value if it references a
+// function, a coroutine or a future, which can't be frozen. The value
+// isn't modified, its objects stay mutable and the other references to
+// them don't see the copy. A frozen value is returned as is.
+Value freeze_value(VM *vm, Value value);
+
+// Replace given values with frozen copies of them, made into a single
+// region, so the objects they have in common stay shared by the copies.
+// Like 'freeze_value', the source objects aren't modified. Return false,
+// leaving the values untouched, if one references a function, a
+// coroutine or a future.
+bool freeze_values(VM *vm, Value *values, int count);
+
+// Make a vm (or a parcel) hold the region of a frozen object, and mark
+// it as reached by the current GC round.
+void hold_region(Regions *regions, Object *object);
+
+// Release the regions held by a vm which weren't reached since the last
+// call, or all of them.
+void release_regions(Regions *regions, bool all);
+
+// Return a new parcel holding an array of copies of given values, of the
+// heap of the vm of the calling thread.
+Parcel *pack_values(Value *values, int count);
+
+// Return a new parcel holding a copy of the globals of a vm, with their
+// names and the inlined functions.
+Parcel *pack_globals(VM *vm);
+
+// Copy the globals of a parcel made by 'pack_globals' into a vm, at the
+// same indexes, the globals it already has are assigned.
+void unpack_globals(VM *vm, Parcel *parcel);
+
+// Dispose a parcel, with the copies it holds.
+void free_parcel(Parcel *parcel);
+
+#endif
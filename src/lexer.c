@@ -10,6 +10,7 @@ void init_lexer(Lexer *lexer, const char *source, const char *file) {
     lexer->start = source;
     lexer->current = source;
     lexer->line = 1;
+    lexer->silent = false;
 }
 
 static inline bool at_end(Lexer *lexer) {
@@ -49,8 +50,10 @@ static inline Token new_token(Lexer *lexer, TokenType type) {
 }
 
 static Token error_token(Lexer *lexer, const char *message) {
-    fprintf(stderr, "[%s: %d] SyntaxError at '%.1s': %s\n",
-            lexer->file, lexer->line, lexer->start, message);
+    if (!lexer->silent) {
+        fprintf(stderr, "[%s: %d] SyntaxError at '%.1s': %s\n",
+                lexer->file, lexer->line, lexer->start, message);
+    }
 
     Token token;
     token.type = TOKEN_ERROR;
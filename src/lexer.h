@@ -1,6 +1,8 @@
 #ifndef raven_lexer_h
 #define raven_lexer_h
 
+#include <stdbool.h>
+
 typedef enum {
     // Keywords
     TOKEN_ASSERT,   TOKEN_BREAK,  TOKEN_COND,
@@ -49,6 +51,7 @@ typedef struct {
     const char *start;
     const char *current;
     int line;
+    bool silent;  // Don't report the errors, if set
 } Lexer;
 
 // Initialize a lexer with a given string source.
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 
+#include "isolate.h"
 #include "mem.h"
 #include "object.h"
 #include "table.h"
@@ -17,6 +18,8 @@ void init_allocator(Allocator *allocator) {
     allocator->bytes_allocated = 0;
     allocator->next_gc = GC_INITIAL_NEXT;
     allocator->gc_off = false;
+    allocator->spare_count = 0;
+    allocator->regions = NULL;
     init_table(&allocator->strings);
 }
 
@@ -45,9 +48,17 @@ static void free_object(Allocator *allocator, Object *object) {
         break;
     }
 
+    case OBJ_TYPED_ARRAY: {
+        RavTypedArray *array = (RavTypedArray *)object;
+        size_t size = array->count * typed_element_size(array->type);
+        Free_Array(allocator, uint8_t, array->as.bytes, size);
+        Free(allocator, RavTypedArray, array);
+        break;
+    }
+
     case OBJ_MAP: {
         RavMap *map = (RavMap *)object;
-        free_table(&map->table);
+        free_dict(&map->dict);
         Free(allocator, RavMap, map);
         break;
     }
@@ -70,10 +81,28 @@ static void free_object(Allocator *allocator, Object *object) {
                    RavClosure*,
                    closure->upvalues,
                    closure->upvalue_count);
+        Free_Array(allocator, Value, closure->captures,
+                   closure->capture_count);
         Free(allocator, RavClosure, object);
         break;
     }
 
+    case OBJ_NATIVE: {
+        Free(allocator, RavNative, object);
+        break;
+    }
+
+    case OBJ_COROUTINE: {
+        free_coroutine_stacks(allocator, (RavCoroutine *)object);
+        Free(allocator, RavCoroutine, object);
+        break;
+    }
+
+    case OBJ_FUTURE: {
+        Free(allocator, RavFuture, object);
+        break;
+    }
+
     default:
         assert(!"invalid object type");
     }
@@ -90,6 +119,7 @@ void free_allocator(Allocator *allocator) {
         objects = next;
     }
 
+    free_spare_stacks(allocator);
     init_allocator(allocator);
 }
 
@@ -117,6 +147,14 @@ void *allocate(Allocator *allocator, void *previous, size_t old_size,
 
 static void mark_object(Allocator *allocator, Object *object) {
     if (object == NULL) return;
+
+    // The frozen objects are shared by the vms, they aren't marked, but
+    // their region is kept.
+    if (object->frozen) {
+        hold_region(allocator->regions, object);
+        return;
+    }
+
     if (object->marked) return;
 
 #ifdef DEBUG_TRACE_MEMORY
@@ -127,8 +165,9 @@ static void mark_object(Allocator *allocator, Object *object) {
 
     object->marked = true;
 
-    // No need to be a gray object, if it's a string object.
-    if (object->type == OBJ_STRING) return;
+    // No need to be a gray object, if it has no outgoing references.
+    if (object->type == OBJ_STRING ||
+        object->type == OBJ_TYPED_ARRAY) return;
 
     // Add the object to the marked stack.
     if (allocator->gray_count == allocator->gray_capacity) {
@@ -153,17 +192,40 @@ static void mark_array(Allocator *allocator, Value *values, size_t size) {
     }
 }
 
-void mark_roots(Allocator *allocator) {
-    VM *vm = (VM *)allocator;
-
+static void mark_stacks(Allocator *allocator, Stacks *stacks) {
     // Locals and Temporaries
-    for (Value *slot = vm->stack; slot < vm->stack_top; slot++) {
+    for (Value *slot = stacks->stack; slot < stacks->stack_top; slot++) {
         mark_value(allocator, *slot);
     }
 
     // Call Stack
-    for (int i = 0; i < vm->frame_count; i++) {
-        mark_object(allocator, (Object *)vm->frames[i].closure);
+    for (int i = 0; i < stacks->frame_count; i++) {
+        mark_object(allocator, (Object *)stacks->frames[i].closure);
+        mark_object(allocator, (Object *)stacks->frames[i].root);
+    }
+
+    // Upvalues
+    for (Value *slot = stacks->stack; slot < stacks->stack_top; slot++) {
+        RavUpvalue *upvalue = stacks->open_upvalues[slot - stacks->stack];
+        mark_object(allocator, (Object *)upvalue);
+    }
+}
+
+void mark_roots(Allocator *allocator) {
+    VM *vm = (VM *)allocator;
+
+    Stacks stacks = {
+        vm->stack, vm->stack_top, vm->stack_end,
+        vm->frames, vm->frame_count, vm->frames_limit,
+        vm->open_upvalues,
+    };
+    mark_stacks(allocator, &stacks);
+
+    // The running coroutine, its resumers, and the main stacks, the
+    // stacks of the others are marked along with their coroutine.
+    if (vm->coroutine != NULL) {
+        mark_object(allocator, (Object *)vm->coroutine);
+        mark_stacks(allocator, &vm->main);
     }
 
     // Globals
@@ -180,10 +242,23 @@ void mark_roots(Allocator *allocator) {
         }
     }
 
-    // Upvalues
-    for (RavUpvalue *upvalue = vm->open_upvalues; upvalue != NULL; ) {
-        mark_object(allocator, (Object *)upvalue);
-        upvalue = upvalue->next;
+    // Last Expression Value
+    mark_value(allocator, vm->x);
+
+    // Pending Futures
+    for (int i = 0; i < vm->futures_count; i++) {
+        mark_object(allocator, (Object *)vm->futures[i]);
+    }
+
+    // Embedder Values
+    for (int i = 0; i < vm->pinned.entries_count; i++) {
+        mark_value(allocator, vm->pinned.entries[i].key);
+    }
+
+    // Inlinable Functions
+    Dict *inlined = &vm->inlined_globals;
+    for (int i = 0; i < inlined->entries_count; i++) {
+        mark_value(allocator, inlined->entries[i].value);
     }
 }
 
@@ -211,11 +286,11 @@ static void blacken_object(Allocator *allocator, Object *object) {
     case OBJ_MAP: {
         RavMap *map = (RavMap *)object;
 
-        for (int i = 0; i <= map->table.hash_mask; i++) {
-            Entry *entry = &map->table.entries[i];
+        for (int i = 0; i < map->dict.entries_count; i++) {
+            DictEntry *entry = &map->dict.entries[i];
 
-            if (entry->key != NULL) {
-                mark_object(allocator, (Object *)entry->key);
+            if (!Is_Void(entry->key)) {
+                mark_value(allocator, entry->key);
                 mark_value(allocator, entry->value);
             }
         }
@@ -229,13 +304,18 @@ static void blacken_object(Allocator *allocator, Object *object) {
 
         mark_array(allocator, chunk->constants, chunk->constants_count);
         mark_object(allocator, (Object *)function->name);
+        mark_object(allocator, (Object *)function->source);
 
         break;
     }
 
-    case OBJ_UPVALUE:
-        mark_value(allocator, ((RavUpvalue *)object)->captured);
+    case OBJ_UPVALUE: {
+        // An open upvalue keeps the stack of its coroutine.
+        RavUpvalue *upvalue = (RavUpvalue *)object;
+        mark_value(allocator, upvalue->captured);
+        mark_object(allocator, (Object *)upvalue->coroutine);
         break;
+    }
 
     case OBJ_CLOSURE: {
         RavClosure *closure = (RavClosure *)object;
@@ -245,9 +325,34 @@ static void blacken_object(Allocator *allocator, Object *object) {
             mark_object(allocator, (Object *)closure->upvalues[i]);
         }
 
+        for (int i = 0; i < closure->capture_count; i++) {
+            mark_value(allocator, closure->captures[i]);
+        }
+
+        break;
+    }
+
+    case OBJ_NATIVE:
+        mark_object(allocator, (Object *)((RavNative *)object)->name);
+        break;
+
+    case OBJ_COROUTINE: {
+        RavCoroutine *coroutine = (RavCoroutine *)object;
+        mark_object(allocator, (Object *)coroutine->closure);
+        mark_object(allocator, (Object *)coroutine->caller);
+
+        // The stacks of the running coroutine are the vm ones.
+        if (coroutine->state == COROUTINE_SUSPENDED ||
+            coroutine->state == COROUTINE_NORMAL) {
+            mark_stacks(allocator, &coroutine->stacks);
+        }
+
         break;
     }
 
+    case OBJ_FUTURE:
+        break;
+
     default:
         assert(!"invalid object type");
     }
@@ -294,6 +399,9 @@ void run_gc(Allocator *allocator) {
     // Free the memory of the unreachable objects.
     sweep(allocator);
 
+    // Release the regions of frozen values which weren't reached.
+    release_regions(allocator->regions, false);
+
     // Adjust the threshold of the next GC round.
     allocator->next_gc = allocator->bytes_allocated * GC_GROWTH_FACTOR;
 
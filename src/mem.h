@@ -19,6 +19,21 @@
 //            not present in the gray stack
 //
 
+typedef struct Region Region;
+
+// A region of frozen values held by a vm (see isolate.h).
+typedef struct {
+    Region *region;
+    bool reached;  // By the current GC round
+} HeldRegion;
+
+// The regions held by a vm, or by a parcel.
+typedef struct {
+    HeldRegion *entries;
+    int count;
+    int capacity;
+} Regions;
+
 // Raven Objects Allocator
 typedef struct {
     // Table of all interned strings in a vm image.
@@ -38,6 +53,15 @@ typedef struct {
 
     // Flag to disable the Garbage Collector.
     bool gc_off;
+
+    // The stacks of the freed coroutines, reused by the next ones (see
+    // new_coroutine).
+    void *spare_stacks[SPARE_STACKS];
+    int spare_count;
+
+    // The regions of the frozen values reached from the heap, those of
+    // its vm or of its parcel.
+    Regions *regions;
 } Allocator;
 
 
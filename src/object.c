@@ -1,11 +1,16 @@
+#include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
 #include "mem.h"
 #include "object.h"
+#include "simd.h"
 #include "value.h"
 #include "vm.h"
 
@@ -19,6 +24,7 @@ static Object *alloc_object(Allocator *allocator, ObjectType type,
     Object *object = (Object *)allocate(allocator, NULL, 0, size);
     object->type = type;
     object->marked = false;
+    object->frozen = false;
     object->next = allocator->objects;
 
 #ifdef DEBUG_TRACE_MEMORY
@@ -105,9 +111,128 @@ RavArray *new_array(Allocator *allocator, Value *values, size_t count) {
     return array;
 }
 
+RavArray *new_array_capacity(Allocator *allocator, size_t capacity) {
+    RavArray *array = Alloc_Object(allocator, RavArray, OBJ_ARRAY);
+
+    array->header.marked = true; // for gc
+    array->values = Alloc(allocator, Value, capacity);
+    array->header.marked = false;
+    array->count = 0;
+    array->capacity = capacity;
+
+    // Left empty for the GC to collect.
+    if (array->values == NULL && capacity > 0) {
+        allocator->bytes_allocated -= capacity * sizeof (Value);
+        array->capacity = 0;
+        return NULL;
+    }
+
+    return array;
+}
+
+static void array_resize(Allocator *allocator, RavArray *array,
+                         size_t capacity) {
+    array->values = Grow_Array(allocator, array->values, Value,
+                               array->capacity, capacity);
+    array->capacity = capacity;
+}
+
+void array_push(Allocator *allocator, RavArray *array, Value value) {
+    if (array->count == array->capacity) {
+        array_resize(allocator, array, Grow_Capacity(array->capacity));
+    }
+
+    array->values[array->count++] = value;
+}
+
+Value array_pop(Allocator *allocator, RavArray *array) {
+    assert(array->count > 0);
+    Value value = array->values[--array->count];
+
+    // Shrink by half only when a quarter is used, so alternating
+    // push/pop at the boundary doesn't reallocate on every operation.
+    if (array->capacity > 8 && array->count < array->capacity / 4) {
+        array_resize(allocator, array, array->capacity / 2);
+    }
+
+    return value;
+}
+
+void array_insert(Allocator *allocator, RavArray *array, size_t index,
+                  Value value) {
+    assert(index <= array->count);
+
+    if (array->count == array->capacity) {
+        array_resize(allocator, array, Grow_Capacity(array->capacity));
+    }
+
+    memmove(array->values + index + 1, array->values + index,
+            (array->count - index) * sizeof (Value));
+
+    array->values[index] = value;
+    array->count++;
+}
+
+size_t typed_element_size(TypedType type) {
+    switch (type) {
+    case TYPED_F64: return sizeof (double);
+    case TYPED_I32: return sizeof (int32_t);
+    case TYPED_U8:  return sizeof (uint8_t);
+    }
+
+    assert(!"invalid typed array type");
+    return 0; // For warnings
+}
+
+RavTypedArray *new_typed_array(Allocator *allocator, TypedType type,
+                               size_t count) {
+    RavTypedArray *array = Alloc_Object(allocator, RavTypedArray,
+                                        OBJ_TYPED_ARRAY);
+    size_t size = count * typed_element_size(type);
+
+    array->header.marked = true; // for gc
+    array->as.bytes = Alloc(allocator, uint8_t, size);
+    array->header.marked = false;
+    array->type = type;
+    array->count = count;
+
+    // Left empty for the GC to collect.
+    if (array->as.bytes == NULL && size > 0) {
+        allocator->bytes_allocated -= size;
+        array->count = 0;
+        return NULL;
+    }
+
+    memset(array->as.bytes, 0, size);
+    return array;
+}
+
+Value typed_array_get(RavTypedArray *array, size_t index) {
+    switch (array->type) {
+    case TYPED_F64: return Num_Value(array->as.f64[index]);
+    case TYPED_I32: return Num_Value((double)array->as.i32[index]);
+    case TYPED_U8:  return Num_Value((double)array->as.u8[index]);
+    }
+
+    assert(!"invalid typed array type");
+    return Nil_Value; // For warnings
+}
+
+void typed_array_set(RavTypedArray *array, size_t index, double number) {
+    switch (array->type) {
+    case TYPED_F64: array->as.f64[index] = number; return;
+    case TYPED_I32: array->as.i32[index] = (int32_t)typed_integer(number);
+                    return;
+    case TYPED_U8:  array->as.u8[index] = (uint8_t)typed_integer(number);
+                    return;
+    }
+
+    assert(!"invalid typed array type");
+}
+
 RavMap *new_map(Allocator *allocator) {
     RavMap *map = Alloc_Object(allocator, RavMap, OBJ_MAP);
-    init_table(&map->table);
+    init_dict(&map->dict);
     return map;
 }
 
@@ -118,6 +243,10 @@ RavFunction *new_function(Allocator *allocator) {
     function->name = NULL;
     function->arity = 0;
     function->upvalue_count = 0;
+    function->capture_count = 0;
+    function->slots_count = 1;
+    function->source = NULL;
+    function->line = 0;
 
     init_chunk(&function->chunk);
     return function;
@@ -129,7 +258,7 @@ RavUpvalue *new_upvalue(Allocator *allocator, Value *location) {
 
     upvalue->location = location;
     upvalue->captured = Void_Value;
-    upvalue->next = NULL;
+    upvalue->coroutine = NULL;
 
     return upvalue;
 }
@@ -142,15 +271,128 @@ RavClosure *new_closure(Allocator *allocator, RavFunction *function) {
         upvalues[i] = NULL;
     }
 
+    Value *captures = Alloc(allocator, Value, function->capture_count);
+
+    for (int i = 0; i < function->capture_count; i++) {
+        captures[i] = Nil_Value;
+    }
+
     RavClosure *closure = Alloc_Object(allocator, RavClosure,
                                        OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
+    closure->captures = captures;
+    closure->capture_count = function->capture_count;
 
     return closure;
 }
 
+RavNative *new_native(Allocator *allocator, RavString *name, int arity,
+                      NativeFn function) {
+    RavNative *native = Alloc_Object(allocator, RavNative, OBJ_NATIVE);
+
+    native->name = name;
+    native->arity = arity;
+    native->function = function;
+
+    return native;
+}
+
+// The stacks of a coroutine are as deep as the main ones. They're
+// mapped at once, and the pages of the mapping are only committed once
+// touched, so a coroutine costs a few pages until it makes deep calls.
+// The stacks never move, as the frames and the natives arguments point
+// into them.
+#define Stacks_Size                                                     \
+    (FRAMES_LIMIT * sizeof (CallFrame) +                                \
+     STACK_SIZE * (sizeof (Value) + sizeof (RavUpvalue *)))
+
+// The part of the stacks counted by the GC, a page of each of them.
+#define Stacks_Counted ((size_t)(3 * sysconf(_SC_PAGESIZE)))
+
+RavCoroutine *new_coroutine(Allocator *allocator, RavClosure *closure) {
+    void *mapping;
+
+    // The fresh pages are zeroed, so are the open upvalues, the spare
+    // stacks have theirs cleared.
+    if (allocator->spare_count > 0) {
+        mapping = allocator->spare_stacks[--allocator->spare_count];
+    } else {
+        mapping = mmap(NULL, Stacks_Size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Fatal: can't map the stacks of a coroutine\n");
+        abort();
+    }
+
+    CallFrame *frames = mapping;
+    RavUpvalue **open_upvalues = (RavUpvalue **)(frames + FRAMES_LIMIT);
+    Value *stack = (Value *)(open_upvalues + STACK_SIZE);
+    allocator->bytes_allocated += Stacks_Counted;
+
+    RavCoroutine *coroutine = Alloc_Object(allocator, RavCoroutine,
+                                           OBJ_COROUTINE);
+    coroutine->closure = closure;
+    coroutine->state = COROUTINE_SUSPENDED;
+    coroutine->started = false;
+    coroutine->caller = NULL;
+    coroutine->depth = 0;
+    coroutine->from_c = false;
+
+    Stacks *stacks = &coroutine->stacks;
+    stacks->stack = stack;
+    stacks->stack_top = stack;
+    stacks->stack_end = stack + STACK_SIZE;
+    stacks->frames = frames;
+    stacks->frame_count = 0;
+    stacks->frames_limit = FRAMES_LIMIT;
+    stacks->open_upvalues = open_upvalues;
+
+    return coroutine;
+}
+
+void free_coroutine_stacks(Allocator *allocator, RavCoroutine *coroutine) {
+    Stacks *stacks = &coroutine->stacks;
+    if (stacks->stack == NULL) return;
+
+    allocator->bytes_allocated -= Stacks_Counted;
+
+    // A coroutine freed while suspended may have left open upvalues, no
+    // slot above the top has any.
+    if (allocator->spare_count < SPARE_STACKS) {
+        for (Value *slot = stacks->stack; slot < stacks->stack_top; slot++) {
+            stacks->open_upvalues[slot - stacks->stack] = NULL;
+        }
+
+        allocator->spare_stacks[allocator->spare_count++] = stacks->frames;
+    } else {
+        munmap(stacks->frames, Stacks_Size);
+    }
+
+    stacks->stack = stacks->stack_top = stacks->stack_end = NULL;
+    stacks->frames = NULL;
+    stacks->frame_count = 0;
+    stacks->open_upvalues = NULL;
+}
+
+void free_spare_stacks(Allocator *allocator) {
+    for (int i = 0; i < allocator->spare_count; i++) {
+        munmap(allocator->spare_stacks[i], Stacks_Size);
+    }
+
+    allocator->spare_count = 0;
+}
+
+RavFuture *new_future(Allocator *allocator, RavTask *task) {
+    RavFuture *future = Alloc_Object(allocator, RavFuture, OBJ_FUTURE);
+    future->task = task;
+    future->index = -1;
+    return future;
+}
+
 static void print_pair(RavPair *pair) {
     print_value(pair->head);
 
@@ -183,25 +425,38 @@ static void print_array(RavArray *array) {
     putchar(']');
 }
 
+static const char *const typed_name[] = {
+    [TYPED_F64] = "f64",
+    [TYPED_I32] = "i32",
+    [TYPED_U8]  = "u8",
+};
+
+static void print_typed_array(RavTypedArray *array) {
+    printf("%s[", typed_name[array->type]);
+
+    for (size_t i = 0; i < array->count; i++) {
+        if (i > 0) printf(", ");
+        print_value(typed_array_get(array, i));
+    }
+
+    putchar(']');
+}
+
 static void print_map(RavMap *map) {
     putchar('{');
 
-    Entry *entries = map->table.entries;
-    int last_index = map->table.hash_mask;
+    DictEntry *entries = map->dict.entries;
+    bool first = true;
 
-    for (int i = 0; i < last_index; i++) {
-        if (entries[i].key == NULL) continue;
+    for (int i = 0; i < map->dict.entries_count; i++) {
+        if (Is_Void(entries[i].key)) continue;
 
-        print_object(Obj_Value(entries[i].key));
-        printf(": ");
-        print_value(entries[i].value);
-        printf(", ");
-    }
+        if (!first) printf(", ");
+        first = false;
 
-    if (last_index >= 0) {
-        print_object(Obj_Value(entries[last_index].key));
+        print_value(entries[i].key);
         printf(": ");
-        print_value(entries[last_index].value);
+        print_value(entries[i].value);
     }
 
     putchar('}');
@@ -232,6 +487,10 @@ void print_object(Value value) {
         print_array(As_Array(value));
         break;
 
+    case OBJ_TYPED_ARRAY:
+        print_typed_array(As_Typed_Array(value));
+        break;
+
     case OBJ_MAP:
         print_map(As_Map(value));
         break;
@@ -248,6 +507,18 @@ void print_object(Value value) {
         print_function(As_Closure(value)->function);
         break;
 
+    case OBJ_NATIVE:
+        printf("<native %s>", As_Native(value)->name->chars);
+        break;
+
+    case OBJ_COROUTINE:
+        printf("<coroutine>");
+        break;
+
+    case OBJ_FUTURE:
+        printf("<future>");
+        break;
+
     default:
         assert(!"invalid object type");
     }
@@ -5,6 +5,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "dict.h"
 #include "mem.h"
 #include "table.h"
 #include "value.h"
@@ -14,10 +15,15 @@ typedef enum {
     OBJ_STRING,
     OBJ_PAIR,
     OBJ_ARRAY,
+    OBJ_TYPED_ARRAY,
     OBJ_MAP,
     OBJ_FUNCTION,
     OBJ_UPVALUE,
     OBJ_CLOSURE,
+    OBJ_NATIVE,
+    OBJ_COROUTINE,
+    OBJ_FUTURE,
+    OBJ_TYPES_COUNT  // Number of the types above, not an object type
 } ObjectType;
 
 // The header (metadata) of all objects.
@@ -25,6 +31,7 @@ typedef enum {
 struct Object {
     ObjectType type;
     bool marked;
+    bool frozen;  // Immutable, shared by the vms (see isolate.h)
     struct Object *next;
 };
 
@@ -48,9 +55,30 @@ struct RavArray {
     size_t capacity;
 };
 
+// Element types of the unboxed numeric arrays.
+typedef enum {
+    TYPED_F64,
+    TYPED_I32,
+    TYPED_U8,
+} TypedType;
+
+// Contiguous unboxed numeric array, the GC doesn't need to scan
+// its elements.
+struct RavTypedArray {
+    Object header;
+    TypedType type;
+    size_t count;
+    union {
+        double *f64;
+        int32_t *i32;
+        uint8_t *u8;
+        void *bytes;
+    } as;
+};
+
 struct RavMap {
     Object header;
-    Table table;
+    Dict dict;
 };
 
 struct RavFunction {
@@ -58,43 +86,116 @@ struct RavFunction {
     RavString *name;
     int arity;
     int upvalue_count;
+    int capture_count;  // Captured variables copied by value
+    int slots_count;    // Maximum number of locals alive at once
     Chunk chunk;
+
+    // Source of the parameters and body of a function not compiled yet
+    // (see LAZY_COMPILE), from its line, or NULL once it's compiled.
+    RavString *source;
+    int line;
 };
 
 struct RavUpvalue {
     Object header;
     Value *location;
     Value captured;
-    struct RavUpvalue *next;
+
+    // The coroutine which stack holds the variable while it's open, or
+    // NULL for the main stack.
+    RavCoroutine *coroutine;
 };
 
 // The closure object doesn't own the function object memory,
 // since multiple closures may be reference the same function
 // object, besides the surrounding functions whose constant
 // table may reference it.
+//
+// The captured variables which never change after their initialization
+// are copied into the captures array (flat closure), only the others
+// are shared through upvalue objects.
 struct RavClosure {
     Object header;
     RavFunction *function;
     RavUpvalue **upvalues;
     int upvalue_count;
+    Value *captures;
+    int capture_count;
+};
+
+// Native (C) function signature. The arguments are a window into the
+// vm stack, a native returns its result, or Void_Value after reporting
+// a runtime error with 'runtime_error'.
+typedef Value (*NativeFn)(VM *vm, int count, Value *args);
+
+struct RavNative {
+    Object header;
+    RavString *name;
+    int arity;   // -1 indicates a variadic function
+    NativeFn function;
+};
+
+typedef enum {
+    COROUTINE_SUSPENDED,  // Not started yet, or yielded
+    COROUTINE_RUNNING,
+    COROUTINE_NORMAL,     // Resumed another coroutine
+    COROUTINE_DEAD,       // Returned, or failed
+} CoroutineState;
+
+// A coroutine runs a function on its own stacks, the vm switches
+// between the stacks without recursing in C. Its stacks are saved while
+// it's not running, and freed once it's dead.
+struct RavCoroutine {
+    Object header;
+    RavClosure *closure;
+    CoroutineState state;
+    bool started;
+    Stacks stacks;
+
+    // The coroutine which resumed it, or NULL for the main line, while
+    // it's running or normal.
+    RavCoroutine *caller;
+
+    // The callback depth of the vm when it was resumed (see VM), and
+    // whether it was resumed from C, its errors don't unwind its resumer
+    // then (see resume_coroutine).
+    int depth;
+    bool from_c;
+};
+
+// A future is the handle of a task spawned by a vm, for 'await'. Only
+// the vm which spawned the task holds its futures, they aren't copied.
+struct RavFuture {
+    Object header;
+    RavTask *task;  // NULL once awaited
+    int index;      // In the pending futures of the vm (see VM)
 };
 
 #define Obj_Type(value) (As_Obj(value)->type)
+#define Is_Frozen(value) (Is_Obj(value) && As_Obj(value)->frozen)
 
 #define Is_String(value)   is_object_type(value, OBJ_STRING)
 #define Is_Pair(value)     is_object_type(value, OBJ_PAIR)
 #define Is_Array(value)    is_object_type(value, OBJ_ARRAY)
+#define Is_Typed_Array(value) is_object_type(value, OBJ_TYPED_ARRAY)
 #define Is_Map(value)      is_object_type(value, OBJ_MAP)
 #define Is_Function(value) is_object_type(value, OBJ_FUNCTION)
 #define Is_Closure(value)  is_object_type(value, OBJ_CLOSURE)
+#define Is_Native(value)   is_object_type(value, OBJ_NATIVE)
+#define Is_Coroutine(value) is_object_type(value, OBJ_COROUTINE)
+#define Is_Future(value)   is_object_type(value, OBJ_FUTURE)
 
 #define As_String(value)   ((RavString *)As_Obj(value))
 #define As_Pair(value)     ((RavPair *)As_Obj(value))
 #define As_Array(value)    ((RavArray *)As_Obj(value))
+#define As_Typed_Array(value) ((RavTypedArray *)As_Obj(value))
 #define As_Map(value)      ((RavMap *)As_Obj(value))
 #define As_CString(value)  ((As_String(value))->chars)
 #define As_Function(value) ((RavFunction *)As_Obj(value))
 #define As_Closure(value)  ((RavClosure *)As_Obj(value))
+#define As_Native(value)   ((RavNative *)As_Obj(value))
+#define As_Coroutine(value) ((RavCoroutine *)As_Obj(value))
+#define As_Future(value)   ((RavFuture *)As_Obj(value))
 
 // Construct a RavString with a copy of the given string.
 RavString *new_string(Allocator *allocator, const char *chars,
@@ -110,6 +211,39 @@ RavPair *new_pair(Allocator *allocator, Value head, Value tail);
 // Construct a RavArray from the provided sized array.
 RavArray *new_array(Allocator *allocator, Value *array, size_t count);
 
+// Construct an empty RavArray, with a preallocated capacity, or return
+// NULL if the capacity can't be allocated.
+RavArray *new_array_capacity(Allocator *allocator, size_t capacity);
+
+// Append a value to the end of an array, growing its capacity
+// geometrically if it's full.
+void array_push(Allocator *allocator, RavArray *array, Value value);
+
+// Remove and return the last value of a non-empty array, shrinking
+// its capacity if it becomes mostly empty.
+Value array_pop(Allocator *allocator, RavArray *array);
+
+// Insert a value at a given index (<= count) of an array, shifting
+// the following values to the right.
+void array_insert(Allocator *allocator, RavArray *array, size_t index,
+                  Value value);
+
+// Construct a zero filled typed array of a given element type, or
+// return NULL if the elements can't be allocated.
+RavTypedArray *new_typed_array(Allocator *allocator, TypedType type,
+                               size_t count);
+
+// Return the size in bytes of a typed array element.
+size_t typed_element_size(TypedType type);
+
+// Return the element of a typed array at a given (valid) index.
+Value typed_array_get(RavTypedArray *array, size_t index);
+
+// Set the element of a typed array at a given (valid) index, the
+// number is truncated to the array element type, wrapping around, a NaN
+// or an infinity sets an integer element to 0.
+void typed_array_set(RavTypedArray *array, size_t index, double number);
+
 // Construct an empty RavMap.
 RavMap *new_map(Allocator *allocator);
 
@@ -122,6 +256,24 @@ RavUpvalue *new_upvalue(Allocator *allocator, Value *location);
 // Construct a closure object.
 RavClosure *new_closure(Allocator *allocator, RavFunction *function);
 
+// Construct a native function object.
+RavNative *new_native(Allocator *allocator, RavString *name, int arity,
+                      NativeFn function);
+
+// Construct a suspended coroutine, which runs a given closure on its
+// first resume.
+RavCoroutine *new_coroutine(Allocator *allocator, RavClosure *closure);
+
+// Free the stacks of a coroutine, once it's dead, they're kept for the
+// next coroutines up to SPARE_STACKS.
+void free_coroutine_stacks(Allocator *allocator, RavCoroutine *coroutine);
+
+// Unmap the stacks kept for the next coroutines.
+void free_spare_stacks(Allocator *allocator);
+
+// Construct the future of a pending task.
+RavFuture *new_future(Allocator *allocator, RavTask *task);
+
 // Pretty print a raven object.
 void print_object(Value value);
 
@@ -7,12 +7,15 @@ Opcode(OP_PUSH_TRUE)
 Opcode(OP_PUSH_FALSE)
 Opcode(OP_PUSH_NIL)
 Opcode(OP_PUSH_CONST)     // 1-byte constant index
+Opcode(OP_PUSH_CONST_16)  // 2-bytes constant index
 
 Opcode(OP_PUSH_X)
 Opcode(OP_SAVE_X)
 
 Opcode(OP_POP)
 Opcode(OP_POPN)           // 1-byte count
+Opcode(OP_PEEK)           // 1-byte distance from the top
+Opcode(OP_SLIDE)          // 1-byte count of values under the top
 
 // Arithmetics
 Opcode(OP_ADD)
@@ -49,16 +52,43 @@ Opcode(OP_SET_LOCAL)      // 1-byte stack slot index
 Opcode(OP_GET_LOCAL)      // 1-byte stack slot index
 Opcode(OP_SET_UPVALUE)    // 1-byte upvalue list index
 Opcode(OP_GET_UPVALUE)    // 1-byte upvalue list index
+Opcode(OP_GET_CAPTURE)    // 1-byte captures list index
+
+Opcode(OP_DEF_GLOBAL_16)  // 2-bytes global buffer index
+Opcode(OP_SET_GLOBAL_16)  // 2-bytes global buffer index
+Opcode(OP_GET_GLOBAL_16)  // 2-bytes global buffer index
+Opcode(OP_SET_LOCAL_16)   // 2-bytes stack slot index
+Opcode(OP_GET_LOCAL_16)   // 2-bytes stack slot index
+Opcode(OP_SET_UPVALUE_16) // 2-bytes upvalue list index
+Opcode(OP_GET_UPVALUE_16) // 2-bytes upvalue list index
+Opcode(OP_GET_CAPTURE_16) // 2-bytes captures list index
 
 // Branching
 Opcode(OP_CALL)           // 1-byte arguments count
+Opcode(OP_CALL_CONS)      // 1-byte arguments count
 Opcode(OP_JMP)            // 2-bytes offset
 Opcode(OP_JMP_BACK)       // 2-bytes offset
 Opcode(OP_JMP_FALSE)      // 2-bytes offset
 Opcode(OP_JMP_POP_FALSE)  // 2-bytes offset
 
+Opcode(OP_JMP_24)           // 3-bytes offset
+Opcode(OP_JMP_BACK_24)      // 3-bytes offset
+Opcode(OP_JMP_FALSE_24)     // 3-bytes offset
+Opcode(OP_JMP_POP_FALSE_24) // 3-bytes offset
+
+Opcode(OP_JMP_INLINED)    // 2-bytes offset, then 2-bytes global index
+                          // and 2-bytes inlined function index
+
+Opcode(OP_SWITCH)         // 1-byte jump table index
+Opcode(OP_SWITCH_16)      // 2-bytes jump table index
+
 // Closure
-Opcode(OP_CLOSURE)        // 1-byte function index
+Opcode(OP_CLOSURE)        // 1-byte function index, then a pair of
+                          // 1-byte (is_local, index) per upvalue,
+                          // then per capture
+Opcode(OP_CLOSURE_16)     // 2-bytes function index, then 1-byte
+                          // is_local and 2-bytes index per upvalue,
+                          // then per capture
 Opcode(OP_CLOSE_UPVALUE)
 
 Opcode(OP_ASSERT)
@@ -0,0 +1,596 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "peephole.h"
+
+// The pass works on a decoded copy of the chunk, where the jumps refer
+// to the index of their target instruction instead of a byte offset, so
+// instructions could be removed or resized freely and the offsets are
+// only computed back once when the chunk is encoded again.
+//
+// The decoded instructions use the compact opcodes with a full-width
+// operand, the encoding picks the wide variants where they are needed.
+// The closures are kept as they are, since the width of their captured
+// variables list depends on the opcode, and so are the guards of the
+// inlined calls, which have no wide variant. The jump table entries of
+// OP_SWITCH are decoded to target indexes as well, the table itself is
+// only updated when the chunk is encoded.
+
+typedef struct {
+    uint8_t opcode;
+    int operand;              // Immediate operand of non-jump opcodes
+    int target;               // Target instruction index of jumps
+    int line;
+    const uint8_t *upvalues;  // Captured variables list of OP_CLOSURE,
+                              // or the operands after the offset of
+                              // OP_JMP_INLINED
+    int upvalues_size;
+    int *cases;               // Target of each OP_SWITCH table entry
+    bool wide;                // Jump with a 3-bytes offset
+    bool removed;
+} Instruction;
+
+typedef struct {
+    Chunk *chunk;
+    Instruction *code;
+    bool *labels;             // Instructions targeted by a jump
+    int count;
+} Program;
+
+// Upper bound of rewriting passes, and of jumps followed in a chain,
+// so a cyclic jump chain can't keep the optimizer busy forever.
+#define PASSES_LIMIT 16
+#define THREADING_LIMIT 16
+
+static inline bool is_jump(uint8_t opcode) {
+    return opcode == OP_JMP || opcode == OP_JMP_BACK ||
+           opcode == OP_JMP_FALSE || opcode == OP_JMP_POP_FALSE ||
+           opcode == OP_JMP_INLINED;
+}
+
+static inline bool is_goto(uint8_t opcode) {
+    return opcode == OP_JMP || opcode == OP_JMP_BACK;
+}
+
+static inline Dict *switch_table(Chunk *chunk, Instruction *instruction) {
+    return &As_Map(chunk->constants[instruction->operand])->dict;
+}
+
+static inline bool is_terminator(uint8_t opcode) {
+    return is_goto(opcode) || opcode == OP_RETURN || opcode == OP_EXIT;
+}
+
+// Instructions which push a value without any side effect.
+static inline bool is_pure_push(uint8_t opcode) {
+    switch (opcode) {
+    case OP_PUSH_TRUE:
+    case OP_PUSH_FALSE:
+    case OP_PUSH_NIL:
+    case OP_PUSH_CONST:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Replace the target of each entry of an OP_SWITCH instruction by its
+// mapped value.
+static void remap_cases(Chunk *chunk, Instruction *instruction,
+                        int *indexes) {
+    Dict *table = switch_table(chunk, instruction);
+
+    for (int i = 0; i < table->entries_count; i++) {
+        int *target = &instruction->cases[i];
+        if (*target != -1) *target = indexes[*target];
+    }
+}
+
+static void decode(Program *program, Chunk *chunk) {
+    // Map each opcode offset to its instruction index, so the jumps
+    // could be resolved after the whole chunk is decoded.
+    int *indexes = malloc((chunk->count + 1) * sizeof (int));
+    Instruction *code = malloc(chunk->count * sizeof (Instruction));
+    int count = 0;
+
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t opcode = chunk->opcodes[offset];
+        int size = instruction_size(chunk, offset);
+        int fixed_size = 1 + operand_size(opcode);
+        Instruction *instruction = &code[count];
+
+        instruction->opcode = opcode;
+        instruction->operand = read_operand(chunk, offset);
+        instruction->target = -1;
+        instruction->line = decode_line(chunk, offset);
+        instruction->upvalues = NULL;
+        instruction->upvalues_size = 0;
+        instruction->cases = NULL;
+        instruction->wide = false;
+        instruction->removed = false;
+
+        if (opcode == OP_CLOSURE || opcode == OP_CLOSURE_16 ||
+            opcode == OP_JMP_INLINED) {
+            instruction->upvalues = &chunk->opcodes[offset + fixed_size];
+            instruction->upvalues_size = size - fixed_size;
+        } else {
+            instruction->opcode = narrow_opcode(opcode);
+        }
+
+        if (instruction->opcode == OP_JMP_BACK) {
+            instruction->target = offset + size - instruction->operand;
+        } else if (is_jump(instruction->opcode)) {
+            instruction->target = offset + size + instruction->operand;
+        } else if (instruction->opcode == OP_SWITCH) {
+            Dict *table = switch_table(chunk, instruction);
+            instruction->cases = malloc(table->entries_count * sizeof (int));
+
+            for (int i = 0; i < table->entries_count; i++) {
+                DictEntry *entry = &table->entries[i];
+                instruction->cases[i] = Is_Void(entry->key) ? -1 :
+                    offset + size + (int)As_Num(entry->value);
+            }
+        }
+
+        indexes[offset] = count++;
+        offset += size;
+    }
+    indexes[chunk->count] = count;
+
+    for (int i = 0; i < count; i++) {
+        if (is_jump(code[i].opcode)) {
+            code[i].target = indexes[code[i].target];
+        } else if (code[i].opcode == OP_SWITCH) {
+            remap_cases(chunk, &code[i], indexes);
+        }
+    }
+
+    free(indexes);
+
+    program->code = code;
+    program->chunk = chunk;
+    program->count = count;
+    program->labels = malloc((count + 1) * sizeof (bool));
+}
+
+static void free_program(Program *program) {
+    for (int i = 0; i < program->count; i++) {
+        free(program->code[i].cases);
+    }
+
+    free(program->code);
+    free(program->labels);
+}
+
+/** Rewriting **/
+
+#ifdef PEEPHOLE
+
+static void mark_labels(Program *program) {
+    memset(program->labels, 0, (program->count + 1) * sizeof (bool));
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        if (instruction->removed) continue;
+
+        if (is_jump(instruction->opcode)) {
+            program->labels[instruction->target] = true;
+        } else if (instruction->opcode == OP_SWITCH) {
+            Dict *table = switch_table(program->chunk, instruction);
+
+            for (int j = 0; j < table->entries_count; j++) {
+                int target = instruction->cases[j];
+                if (target != -1) program->labels[target] = true;
+            }
+        }
+    }
+}
+
+// Drop the removed instructions, a jump to a removed instruction lands
+// on the next kept one.
+static void compact(Program *program) {
+    // New index of the first kept instruction at or after each index.
+    int *indexes = malloc((program->count + 1) * sizeof (int));
+    int count = 0;
+
+    for (int i = 0; i < program->count; i++) {
+        if (!program->code[i].removed) indexes[i] = count++;
+    }
+
+    indexes[program->count] = count;
+    for (int i = program->count - 1; i >= 0; i--) {
+        if (program->code[i].removed) indexes[i] = indexes[i + 1];
+    }
+
+    count = 0;
+    for (int i = 0; i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        if (instruction->removed) {
+            free(instruction->cases);
+            continue;
+        }
+
+        if (is_jump(instruction->opcode)) {
+            instruction->target = indexes[instruction->target];
+        } else if (instruction->opcode == OP_SWITCH) {
+            remap_cases(program->chunk, instruction, indexes);
+        }
+        program->code[count++] = *instruction;
+    }
+
+    free(indexes);
+    program->count = count;
+}
+
+// Return the n-th kept instruction after a given index, or NULL if it
+// doesn't exist or it's a jump target, since instructions on both sides
+// of a label can't be merged.
+static Instruction *following(Program *program, int index, int n) {
+    for (int i = index + 1; i < program->count; i++) {
+        if (program->code[i].removed) continue;
+        if (program->labels[i]) return NULL;
+        if (--n == 0) return &program->code[i];
+    }
+
+    return NULL;
+}
+
+static int next_kept(Program *program, int index) {
+    int i = index + 1;
+    while (i < program->count && program->code[i].removed) i++;
+    return i;
+}
+
+// The value saved by OP_SAVE_X is dead if it's overwritten before any
+// instruction that may read it, the callee of OP_CALL may read it as
+// the value of its body, and the control flow is not followed.
+static bool is_dead_save(Program *program, int index) {
+    for (int i = index + 1; i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        if (instruction->removed) continue;
+        if (program->labels[i]) return false;
+
+        switch (instruction->opcode) {
+        case OP_SAVE_X:
+        case OP_ASSERT:
+            return true;
+
+        case OP_PUSH_X:
+        case OP_CALL:
+        case OP_CALL_CONS:
+        case OP_SWITCH:
+        case OP_RETURN:
+        case OP_EXIT:
+            return false;
+
+        default:
+            if (is_jump(instruction->opcode)) return false;
+        }
+    }
+
+    return false;
+}
+
+// Follow a chain of unconditional jumps starting at a given target.
+static int thread_jump(Program *program, int target) {
+    for (int hops = 0; hops < THREADING_LIMIT; hops++) {
+        if (target >= program->count) break;
+
+        Instruction *instruction = &program->code[target];
+        if (instruction->removed || !is_goto(instruction->opcode)) break;
+        target = program->code[target].target;
+    }
+
+    return target;
+}
+
+static void retarget(Program *program, Instruction *jump, int target) {
+    jump->target = target;
+    program->labels[target] = true;
+}
+
+static inline void remove_instruction(Instruction *instruction) {
+    instruction->removed = true;
+}
+
+static bool optimize_jump(Program *program, int index) {
+    Instruction *jump = &program->code[index];
+
+    // The guard and its slow path are kept as they are.
+    if (jump->opcode == OP_JMP_INLINED) return false;
+
+    // Jumps to the next instruction.
+    if (jump->target == next_kept(program, index)) {
+        if (jump->opcode == OP_JMP_POP_FALSE) {
+            jump->opcode = OP_POP;
+        } else {
+            remove_instruction(jump);
+        }
+        return true;
+    }
+
+    if (jump->target >= program->count) return false;
+    Instruction *landing = &program->code[jump->target];
+    if (landing->removed) return false;
+
+    // A jump to a return returns right away.
+    if (is_goto(jump->opcode) &&
+        (landing->opcode == OP_RETURN || landing->opcode == OP_EXIT)) {
+        jump->opcode = landing->opcode;
+        return true;
+    }
+
+    // Jumps to jumps, the conditional jumps are forward only.
+    int target = thread_jump(program, jump->target);
+
+    // A falsy value left by OP_JMP_FALSE takes the next one as well.
+    if (jump->opcode == OP_JMP_FALSE && target == jump->target &&
+        landing->opcode == OP_JMP_FALSE) {
+        target = landing->target;
+    }
+
+    if (target == jump->target || target == index) return false;
+    if (!is_goto(jump->opcode) && target < index) return false;
+
+    retarget(program, jump, target);
+    return true;
+}
+
+static bool optimize_instruction(Program *program, int index) {
+    Instruction *a = &program->code[index];
+    Instruction *b = following(program, index, 1);
+
+    if (is_jump(a->opcode) && optimize_jump(program, index)) return true;
+
+    // Unreachable code up to the next jump target.
+    if (is_terminator(a->opcode)) {
+        bool changed = false;
+        for (int i = index + 1;
+             i < program->count && !program->labels[i]; i++) {
+            if (!program->code[i].removed) {
+                remove_instruction(&program->code[i]);
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    switch (a->opcode) {
+    case OP_SAVE_X:
+        // OP_SAVE_X, OP_PUSH_X => nothing
+        if (b != NULL && b->opcode == OP_PUSH_X) {
+            remove_instruction(a);
+            remove_instruction(b);
+            return true;
+        }
+
+        // OP_SAVE_X => OP_POP, if the saved value is never read.
+        if (is_dead_save(program, index)) {
+            a->opcode = OP_POP;
+            return true;
+        }
+        break;
+
+    case OP_SET_LOCAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_GLOBAL: {
+        // OP_SET_* n, OP_POP, OP_GET_* n => OP_SET_* n
+        Instruction *c = following(program, index, 2);
+        uint8_t getter = a->opcode == OP_SET_LOCAL ? OP_GET_LOCAL :
+                         a->opcode == OP_SET_UPVALUE ? OP_GET_UPVALUE :
+                         OP_GET_GLOBAL;
+
+        if (b != NULL && c != NULL && b->opcode == OP_POP &&
+            c->opcode == getter && c->operand == a->operand) {
+            remove_instruction(b);
+            remove_instruction(c);
+            return true;
+        }
+        break;
+    }
+
+    case OP_POP:
+    case OP_POPN: {
+        int count = a->opcode == OP_POP ? 1 : a->operand;
+
+        // OP_POPN 0 => nothing, OP_POPN 1 => OP_POP
+        if (count == 0) {
+            remove_instruction(a);
+            return true;
+        }
+        if (a->opcode == OP_POPN && count == 1) {
+            a->opcode = OP_POP;
+            return true;
+        }
+
+        // Consecutive pops are merged into a single OP_POPN.
+        if (b != NULL && (b->opcode == OP_POP || b->opcode == OP_POPN)) {
+            int total = count + (b->opcode == OP_POP ? 1 : b->operand);
+            if (total > UINT8_MAX) break;
+
+            a->opcode = OP_POPN;
+            a->operand = total;
+            remove_instruction(b);
+            return true;
+        }
+        break;
+    }
+
+    default:
+        // A pushed value which is popped right away.
+        if (is_pure_push(a->opcode) && b != NULL && b->opcode == OP_POP) {
+            remove_instruction(a);
+            remove_instruction(b);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool optimize_pass(Program *program) {
+    bool changed = false;
+    mark_labels(program);
+
+    for (int i = 0; i < program->count; i++) {
+        if (program->code[i].removed) continue;
+        if (optimize_instruction(program, i)) changed = true;
+    }
+
+    compact(program);
+    return changed;
+}
+
+#endif // PEEPHOLE
+
+/** Encoding **/
+
+// Return the opcode an instruction is encoded with.
+static uint8_t encoded_opcode(Instruction *instruction) {
+    if (is_jump(instruction->opcode)) {
+        return instruction->wide ?
+            wide_opcode(instruction->opcode) : instruction->opcode;
+    }
+
+    if (instruction->operand > UINT8_MAX) {
+        return wide_opcode(instruction->opcode);
+    }
+
+    return instruction->opcode;
+}
+
+static inline int encoded_size(Instruction *instruction) {
+    return 1 + operand_size(encoded_opcode(instruction)) +
+           instruction->upvalues_size;
+}
+
+// Compute the offset of each instruction, and widen the jumps which
+// don't fit in a 2-bytes offset, until no jump needs to be widened.
+// The jump offsets are set, return false if one exceeds JUMP_LIMIT.
+static bool relax_jumps(Program *program, int *offsets) {
+    bool widened = true;
+
+    while (widened) {
+        widened = false;
+
+        int offset = 0;
+        for (int i = 0; i < program->count; i++) {
+            offsets[i] = offset;
+            offset += encoded_size(&program->code[i]);
+        }
+        offsets[program->count] = offset;
+
+        for (int i = 0; i < program->count; i++) {
+            Instruction *instruction = &program->code[i];
+            if (!is_jump(instruction->opcode)) continue;
+
+            int end = offsets[i] + encoded_size(instruction);
+            int distance = offsets[instruction->target] - end;
+
+            if (is_goto(instruction->opcode)) {
+                instruction->opcode = distance < 0 ? OP_JMP_BACK : OP_JMP;
+            }
+
+            instruction->operand = distance < 0 ? -distance : distance;
+            if (instruction->opcode == OP_JMP_INLINED) continue;
+
+            if (!instruction->wide && instruction->operand > UINT16_MAX) {
+                instruction->wide = true;
+                widened = true;
+            }
+        }
+    }
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        if (!is_jump(instruction->opcode)) continue;
+
+        int limit = instruction->opcode == OP_JMP_INLINED ?
+                    UINT16_MAX + 1 : JUMP_LIMIT;
+        if (instruction->operand >= limit) return false;
+    }
+
+    return true;
+}
+
+// Encode the program back into the chunk, return false without touching
+// the chunk if a jump offset doesn't fit.
+static bool encode(Program *program, Chunk *chunk) {
+    int *offsets = malloc((program->count + 1) * sizeof (int));
+    bool fits = relax_jumps(program, offsets);
+
+    // The jump tables entries are relative to the end of OP_SWITCH.
+    for (int i = 0; fits && i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        if (instruction->opcode != OP_SWITCH) continue;
+
+        Dict *table = switch_table(chunk, instruction);
+        int end = offsets[i] + encoded_size(instruction);
+
+        for (int j = 0; j < table->entries_count; j++) {
+            int target = instruction->cases[j];
+            if (target == -1) continue;
+
+            table->entries[j].value =
+                Num_Value((double)(offsets[target] - end));
+        }
+    }
+
+    free(offsets);
+    if (!fits) return false;
+
+    // The operands of OP_CLOSURE still point into the old opcodes.
+    uint8_t *opcodes = chunk->opcodes;
+    chunk->opcodes = NULL;
+    chunk->capacity = 0;
+    rewind_chunk(chunk, 0);
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        uint8_t opcode = encoded_opcode(instruction);
+        int operand = instruction->operand;
+        int line = instruction->line;
+
+        write_byte(chunk, opcode, line);
+
+        switch (operand_size(opcode)) {
+        case 3:
+            write_byte(chunk, (operand >> 16) & 0xff, line);
+            // Fallthrough
+        case 2:
+            write_byte(chunk, (operand >> 8) & 0xff, line);
+            // Fallthrough
+        case 1:
+            write_byte(chunk, operand & 0xff, line);
+            break;
+        }
+
+        for (int j = 0; j < instruction->upvalues_size; j++) {
+            write_byte(chunk, instruction->upvalues[j], line);
+        }
+    }
+
+    free(opcodes);
+    return true;
+}
+
+void optimize_chunk(Chunk *chunk) {
+    if (chunk->count == 0) return;
+
+    Program program;
+    decode(&program, chunk);
+
+#ifdef PEEPHOLE
+    for (int pass = 0; pass < PASSES_LIMIT; pass++) {
+        if (!optimize_pass(&program)) break;
+    }
+#endif
+
+    encode(&program, chunk);
+    free_program(&program);
+}
@@ -0,0 +1,16 @@
+#ifndef raven_peephole_h
+#define raven_peephole_h
+
+#include "chunk.h"
+
+// Rewrite a finished chunk in place, removing redundant instruction
+// sequences, threading jump chains and dropping unreachable code (if
+// PEEPHOLE is defined). The instructions are re-encoded using the
+// compact opcodes where their operands fit, and the jump offsets and
+// the lines table are recomputed accordingly.
+//
+// The chunk is left untouched if a rewritten jump would overflow the
+// jump offset limit.
+void optimize_chunk(Chunk *chunk);
+
+#endif
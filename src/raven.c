@@ -3,17 +3,30 @@
 #include <string.h>
 #include <errno.h>
 
+#include "cache.h"
 #include "common.h"
 #include "vm.h"
 
 static void usage() {
-    fputs("Usage: raven [path]\n", stdout);
+    fputs("Usage: raven [path]\n"
+          "       raven --compile path\n"
+          "       raven --image image [path]\n"
+          "       raven --write-image image path\n", stdout);
     exit(EXIT_FAILURE);
 }
 
-static void repl() {
+// Start the vm from the heap image at a given path, if there is one.
+static void load_image(VM *vm, const char *image) {
+    if (image != NULL && !read_image(vm, image)) {
+        fprintf(stderr, "Fatal: invalid image '%s'\n", image);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void repl(const char *image) {
     VM vm;
     init_vm(&vm);
+    load_image(&vm, image);
 
     char buf[256];
     for (;;) {
@@ -56,25 +69,95 @@ static char *scan_file(const char *path) {
     return buf;
 }
 
-static void execute_file(const char *path) {
+// Return the path of the bytecode cache file of a script, its '.rav'
+// extension becomes '.ravc', otherwise '.ravc' is appended.
+static char *cache_path(const char *path) {
+    size_t length = strlen(path);
+    char *cache = (char *)malloc(length + sizeof ".ravc");
+
+    if (length > 4 && strcmp(path + length - 4, ".rav") == 0) {
+        sprintf(cache, "%sc", path);
+    } else {
+        sprintf(cache, "%s.ravc", path);
+    }
+
+    return cache;
+}
+
+// Run a script, starting from a heap image if it's given. The bytecode
+// cache isn't used along with an image, since the cached code expects
+// the globals indexes it was compiled with.
+static void execute_file(const char *path, const char *image) {
     VM vm;
     init_vm(&vm);
+    load_image(&vm, image);
 
     char *source = scan_file(path);
-    InterpretResult result = interpret(&vm, source, path);
-    free(source);
+    InterpretResult result;
+
+    if (image != NULL) {
+        result = interpret(&vm, source, path);
+    } else {
+        char *cache = cache_path(path);
+        result = interpret_cached(&vm, source, path, cache);
+        free(cache);
+    }
 
+    free(source);
     free_vm(&vm);
 
     if (result == INTERPRET_RUNTIME_ERROR) exit(EXIT_FAILURE);
     if (result == INTERPRET_COMPILE_ERROR) exit(EXIT_FAILURE);
 }
 
+// Run a script, then save the resulting vm state into a heap image.
+static void write_image_file(const char *path, const char *image) {
+    VM vm;
+    init_vm(&vm);
+
+    char *source = scan_file(path);
+    InterpretResult result = interpret(&vm, source, path);
+    free(source);
+
+    bool done = result == INTERPRET_OK && write_image(&vm, image);
+    if (result == INTERPRET_OK && !done) {
+        fprintf(stderr, "Fatal: error writing '%s'\n", image);
+    }
+
+    free_vm(&vm);
+
+    if (!done) exit(EXIT_FAILURE);
+}
+
+// Compile a script into its bytecode cache file, without running it.
+static void compile_file(const char *path) {
+    VM vm;
+    init_vm(&vm);
+
+    char *source = scan_file(path);
+    char *cache = cache_path(path);
+    bool done = compile_cached(&vm, source, path, cache);
+    free(cache);
+    free(source);
+
+    free_vm(&vm);
+
+    if (!done) exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {
     if (argc == 1) {
-        repl();
+        repl(NULL);
     } else if (argc == 2) {
-        execute_file(argv[1]);
+        execute_file(argv[1], NULL);
+    } else if (argc == 3 && strcmp(argv[1], "--compile") == 0) {
+        compile_file(argv[2]);
+    } else if (argc == 3 && strcmp(argv[1], "--image") == 0) {
+        repl(argv[2]);
+    } else if (argc == 4 && strcmp(argv[1], "--image") == 0) {
+        execute_file(argv[3], argv[2]);
+    } else if (argc == 4 && strcmp(argv[1], "--write-image") == 0) {
+        write_image_file(argv[3], argv[2]);
     } else {
         usage();
     }
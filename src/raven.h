@@ -0,0 +1,104 @@
+#ifndef raven_h
+#define raven_h
+
+// Raven Embedding API
+//
+// A script is compiled once by 'prepare_script', then run any number of
+// times by 'run_script' on the vm it was prepared with (its code refers
+// to the globals of that vm by their index). The Raven functions it
+// defines can be called from C with 'call_function', the globals can
+// be read or written by name, and C functions can be defined as natives
+// callable from the scripts. Each vm is used by one thread at a time,
+// a script can run on every core by spawning isolates, or tasks.
+//
+// The values handed to C aren't reachable by the GC, they're valid
+// until the next call into the vm, unless they're pinned with
+// 'pin_value'. The prepared scripts are pinned until released.
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+typedef struct {
+    RavFunction *function;  // The compiled top-level code
+    char *path;             // Reported by the errors
+} RavScript;
+
+// Compile a given source code, and return the prepared script, or NULL
+// on compilation error (reported to stderr).
+RavScript *prepare_script(VM *vm, const char *source, const char *path);
+
+// Run a prepared script, the value of its last expression statement is
+// left in vm->x. It must not be called from a native.
+InterpretResult run_script(VM *vm, RavScript *script);
+
+// Dispose a prepared script, the vm no longer refers to its path.
+void release_script(VM *vm, RavScript *script);
+
+// Call a closure or a native with the given arguments, and set result to
+// its return value. A native can call back this way while the vm runs,
+// the frames and the x register of the running code are kept. On error,
+// it's already reported and the vm stack unwound, so the native must
+// return Void_Value right away.
+InterpretResult call_function(VM *vm, Value callee, int count,
+                              Value *args, Value *result);
+
+// Resume a suspended coroutine (see object.h), passing it the arguments
+// of its function on the first resume, or else at most one value, the
+// result of the 'yield' it's suspended at. Run it until it yields or
+// returns, and set result to the value it yields or returns. It can be
+// called from a native like 'call_function', but an error only unwinds
+// the coroutine, which is left dead, the code resuming it goes on.
+InterpretResult resume_coroutine(VM *vm, RavCoroutine *coroutine, int count,
+                                 Value *args, Value *result);
+
+// Set value to the value of the global of a given name, return false if
+// there is no such global, or it's not defined yet.
+bool get_global(VM *vm, const char *name, Value *value);
+
+// Define the global of a given name, or assign it if it already exists.
+// Return false if there are too many globals to add it.
+bool set_global(VM *vm, const char *name, Value value);
+
+// Define a native (C) function as the global of a given name, with a
+// given number of parameters (-1 for a variadic one). A native gets its
+// arguments on the vm stack, without a call frame, and returns its
+// result or Void_Value after reporting an error with 'runtime_error'.
+// Return false if the arity is invalid, or the global can't be added
+// (see set_global).
+bool define_native(VM *vm, const char *name, int arity,
+                   NativeFn function);
+
+// Start an isolate calling a closure or a native with the given
+// arguments, in a new thread (see isolate.h). Return NULL if the thread
+// can't be created.
+RavIsolate *spawn_isolate(VM *vm, Value callee, int count, Value *args);
+
+// Wait for an isolate to finish, set result (unless NULL) to a copy of
+// its return value in the heap of the vm, and dispose it. The errors of
+// the isolate are reported by its own vm.
+InterpretResult join_isolate(VM *vm, RavIsolate *isolate, Value *result);
+
+// Start the scheduler of a vm, with a given number of workers, or one per
+// core if it's 0 (see scheduler.h). Return false if it's already started,
+// or the threads can't be created.
+bool start_scheduler(VM *vm, int workers);
+
+// Spawn a task calling a closure with the given arguments, starting the
+// scheduler if needed, and return its future, or NULL if the scheduler
+// can't be started.
+RavTask *spawn_task(VM *vm, Value callee, int count, Value *args);
+
+// Wait for a task to be done, set result (unless NULL) to a copy of its
+// return value in the heap of the vm, and dispose it. The errors of the
+// task are reported by the vm of its worker. Called by a task, the worker
+// runs the other tasks meanwhile.
+InterpretResult await_task(VM *vm, RavTask *task, Value *result);
+
+// Keep a value reachable by the GC until it's unpinned, the pins are
+// counted, so a value pinned twice must be unpinned twice.
+void pin_value(VM *vm, Value value);
+void unpin_value(VM *vm, Value value);
+
+#endif
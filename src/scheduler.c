@@ -0,0 +1,622 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "isolate.h"
+#include "mem.h"
+#include "object.h"
+#include "raven.h"
+#include "scheduler.h"
+#include "value.h"
+#include "vm.h"
+
+struct RavTask {
+    // The call to run, an array of the callee and the arguments, until a
+    // worker starts it, and the generation of the globals it refers to.
+    Parcel *call;
+    int generation;
+
+    // Once started, the coroutine running it in the heap of its worker,
+    // the task it waits for, and the next task in the ready or the
+    // waiting list of the worker.
+    RavCoroutine *coroutine;
+    RavTask *awaited;
+    RavTask *next;
+
+    // The future, its result is set before its done flag, which is read
+    // and written atomically.
+    InterpretResult status;
+    Parcel *result;
+    bool done;
+};
+
+// A work-stealing deque, a ring buffer of the tasks not started yet.
+typedef struct {
+    pthread_mutex_t lock;
+    RavTask **tasks;
+    int top;  // Index of the oldest task
+    int count;
+    int capacity;
+} Deque;
+
+struct Worker {
+    Scheduler *scheduler;
+    VM vm;
+    pthread_t thread;
+    char *path;
+    Deque deque;
+
+    // The started tasks, ready to be resumed in order, or waiting for a
+    // future. Only the thread of the worker touches them.
+    RavTask *ready;
+    RavTask *ready_last;
+    RavTask *waiting;
+
+    RavTask *running;  // The task being run
+    RavTask *awaited;  // The future it's suspended for (see suspend_task)
+    int generation;    // Of the globals of the vm
+    uint32_t seed;     // Picks the victims of the steals
+};
+
+struct Scheduler {
+    Worker **workers;
+    int workers_count;
+    int next;  // The worker dealt the next task spawned by the vm
+
+    // The snapshots of the globals of the vm, the generation is the
+    // number of snapshots, and the vm had made a given number of global
+    // definitions at the last one.
+    Parcel **globals;
+    int generation;
+    int globals_capacity;
+    int definitions;
+
+    // The waits for a change (a task queued or done) sleep on the
+    // condition. The counters are atomic, the changes only take the lock
+    // to wake up the sleepers, if there are any.
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int sleepers;
+    int queued;   // Tasks in the deques
+    int pending;  // Tasks not done
+    bool stopping;
+};
+
+/** Deques **/
+
+static void init_deque(Deque *deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->tasks = NULL;
+    deque->top = 0;
+    deque->count = 0;
+    deque->capacity = 0;
+}
+
+static void free_deque(Deque *deque) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->tasks);
+    init_deque(deque);
+}
+
+// Push a task at the bottom, by the worker of the deque, or by the vm
+// dealing its tasks.
+static void push_bottom(Deque *deque, RavTask *task) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count == deque->capacity) {
+        int capacity = Grow_Capacity(deque->capacity);
+        RavTask **tasks = malloc(capacity * sizeof (RavTask *));
+
+        for (int i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+        }
+
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->top = 0;
+        deque->capacity = capacity;
+    }
+
+    int bottom = (deque->top + deque->count++) % deque->capacity;
+    deque->tasks[bottom] = task;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Pop the most recent task, by the worker of the deque.
+static RavTask *pop_bottom(Deque *deque) {
+    RavTask *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count > 0) {
+        int bottom = (deque->top + --deque->count) % deque->capacity;
+        task = deque->tasks[bottom];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// Steal the oldest task, by the other workers.
+static RavTask *steal_top(Deque *deque) {
+    RavTask *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count > 0) {
+        task = deque->tasks[deque->top];
+        deque->top = (deque->top + 1) % deque->capacity;
+        deque->count--;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/** Futures **/
+
+bool task_done(RavTask *task) {
+    return __atomic_load_n(&task->done, __ATOMIC_SEQ_CST);
+}
+
+static void free_task(RavTask *task) {
+    if (task->call != NULL) free_parcel(task->call);
+    if (task->result != NULL) free_parcel(task->result);
+    free(task);
+}
+
+// Wake up the sleepers after a change.
+static void notify(Scheduler *scheduler) {
+    if (__atomic_load_n(&scheduler->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&scheduler->lock);
+        pthread_cond_broadcast(&scheduler->changed);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+// Sleep until a change makes a given condition true, it's checked under
+// the lock, after the sleeper is counted, so a change in between isn't
+// missed.
+#define Sleep_Until(scheduler, condition)                               \
+    do {                                                                \
+        pthread_mutex_lock(&(scheduler)->lock);                         \
+        __atomic_add_fetch(&(scheduler)->sleepers, 1, __ATOMIC_SEQ_CST);\
+                                                                        \
+        while (!(condition)) {                                          \
+            pthread_cond_wait(&(scheduler)->changed, &(scheduler)->lock);\
+        }                                                               \
+                                                                        \
+        __atomic_sub_fetch(&(scheduler)->sleepers, 1, __ATOMIC_SEQ_CST);\
+        pthread_mutex_unlock(&(scheduler)->lock);                       \
+    } while (false)
+
+// Set the result of a task, which the awaiting vm may dispose right
+// away, it isn't touched after.
+static void complete_task(Worker *worker, RavTask *task,
+                          InterpretResult status, Parcel *result) {
+    Scheduler *scheduler = worker->scheduler;
+
+    if (task->coroutine != NULL) {
+        unpin_value(&worker->vm, Obj_Value(task->coroutine));
+        task->coroutine = NULL;
+    }
+
+    task->status = status;
+    task->result = result;
+    __atomic_store_n(&task->done, true, __ATOMIC_SEQ_CST);
+
+    __atomic_sub_fetch(&scheduler->pending, 1, __ATOMIC_SEQ_CST);
+    notify(scheduler);
+}
+
+// Return a copy of the result of a done task in the heap of a vm.
+static Value task_result(VM *vm, RavTask *task) {
+    return As_Array(copy_value(vm, task->result->value))->values[0];
+}
+
+/** Workers **/
+
+// Copy the last snapshot of the globals of the vm into the vm of the
+// worker, if it's older than a given generation.
+static void sync_globals(Worker *worker, int generation) {
+    if (generation <= worker->generation) return;
+
+    Scheduler *scheduler = worker->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    Parcel *globals = scheduler->globals[scheduler->generation - 1];
+    worker->generation = scheduler->generation;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    unpack_globals(&worker->vm, globals);
+}
+
+// Queue the task after a run, to be resumed later, or set its result.
+static void finish_run(Worker *worker, RavTask *task,
+                       InterpretResult status, Value result) {
+    if (status != INTERPRET_OK) {
+        complete_task(worker, task, status, NULL);
+    } else if (task->coroutine->state == COROUTINE_DEAD) {
+        complete_task(worker, task, status, pack_values(&result, 1));
+    } else if (worker->awaited != NULL) {
+        task->awaited = worker->awaited;
+        worker->awaited = NULL;
+        task->next = worker->waiting;
+        worker->waiting = task;
+    } else {
+        // It yielded, the value is dropped.
+        task->next = NULL;
+
+        if (worker->ready == NULL) {
+            worker->ready = task;
+        } else {
+            worker->ready_last->next = task;
+        }
+        worker->ready_last = task;
+    }
+}
+
+static void start_task(Worker *worker, RavTask *task) {
+    VM *vm = &worker->vm;
+    sync_globals(worker, task->generation);
+
+    Value call = copy_value(vm, task->call->value);
+    free_parcel(task->call);
+    task->call = NULL;
+
+    // The call is pinned until its values are on the coroutine stack.
+    pin_value(vm, call);
+    RavArray *array = As_Array(call);
+
+    task->coroutine = new_coroutine(&vm->allocator,
+                                    As_Closure(array->values[0]));
+    pin_value(vm, Obj_Value(task->coroutine));
+
+    RavTask *running = worker->running;
+    worker->running = task;
+
+    Value result;
+    InterpretResult status = resume_coroutine(vm, task->coroutine,
+                                              (int)array->count - 1,
+                                              array->values + 1, &result);
+    worker->running = running;
+    unpin_value(vm, call);
+
+    finish_run(worker, task, status, result);
+}
+
+// Resume a started task, with the result of the task it awaited if any.
+static void resume_task(Worker *worker, RavTask *task) {
+    VM *vm = &worker->vm;
+    RavTask *awaited = task->awaited;
+    task->awaited = NULL;
+
+    RavTask *running = worker->running;
+    worker->running = task;
+
+    Value result = Nil_Value;
+    InterpretResult status;
+
+    if (awaited == NULL) {
+        status = resume_coroutine(vm, task->coroutine, 0, NULL, &result);
+    } else if (awaited->status != INTERPRET_OK) {
+        free_task(awaited);
+        fail_coroutine(vm, task->coroutine, "'await': the task failed");
+        status = INTERPRET_RUNTIME_ERROR;
+    } else {
+        Value value = task_result(vm, awaited);
+        free_task(awaited);
+        status = resume_coroutine(vm, task->coroutine, 1, &value, &result);
+    }
+
+    worker->running = running;
+    finish_run(worker, task, status, result);
+}
+
+// Return the next started task to resume, the ones waiting for a done
+// future first, or NULL if there is none.
+static RavTask *next_resumable(Worker *worker) {
+    for (RavTask **link = &worker->waiting; *link != NULL;
+         link = &(*link)->next) {
+        RavTask *task = *link;
+
+        if (task_done(task->awaited)) {
+            *link = task->next;
+            return task;
+        }
+    }
+
+    RavTask *task = worker->ready;
+    if (task != NULL) worker->ready = task->next;
+
+    return task;
+}
+
+static RavTask *steal(Worker *worker) {
+    Scheduler *scheduler = worker->scheduler;
+    int count = scheduler->workers_count;
+
+    // Xorshift, the victims are picked at random, so the thieves don't
+    // all contend for the same deque.
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    int start = (int)(worker->seed % (uint32_t)count);
+
+    for (int i = 0; i < count; i++) {
+        Worker *victim = scheduler->workers[(start + i) % count];
+        if (victim == worker) continue;
+
+        RavTask *task = steal_top(&victim->deque);
+        if (task != NULL) return task;
+    }
+
+    return NULL;
+}
+
+// Run the next task of a worker until it returns or yields, the started
+// ones first, so their stacks are freed early. Return false if it has
+// none to run.
+static bool run_step(Worker *worker) {
+    RavTask *task = next_resumable(worker);
+    if (task != NULL) {
+        resume_task(worker, task);
+        return true;
+    }
+
+    task = pop_bottom(&worker->deque);
+    if (task == NULL) task = steal(worker);
+    if (task == NULL) return false;
+
+    __atomic_sub_fetch(&worker->scheduler->queued, 1, __ATOMIC_SEQ_CST);
+    start_task(worker, task);
+    return true;
+}
+
+// Return true if the worker has a task to run, checked by a sleeper.
+static bool has_work(Worker *worker) {
+    if (__atomic_load_n(&worker->scheduler->queued, __ATOMIC_SEQ_CST) > 0 ||
+        worker->ready != NULL) {
+        return true;
+    }
+
+    for (RavTask *task = worker->waiting; task != NULL; task = task->next) {
+        if (task_done(task->awaited)) return true;
+    }
+
+    return false;
+}
+
+static void *run_worker(void *data) {
+    Worker *worker = data;
+    Scheduler *scheduler = worker->scheduler;
+
+    for (;;) {
+        if (run_step(worker)) continue;
+
+        Sleep_Until(scheduler, scheduler->stopping || has_work(worker));
+        if (__atomic_load_n(&scheduler->stopping, __ATOMIC_SEQ_CST)) break;
+    }
+
+    return NULL;
+}
+
+bool suspend_task(VM *vm, RavTask *task) {
+    Worker *worker = vm->worker;
+    if (worker == NULL || worker->running == NULL) return false;
+
+    // Only the coroutine of the task can yield to its worker.
+    RavCoroutine *coroutine = worker->running->coroutine;
+    if (vm->coroutine != coroutine ||
+        vm->callback_depth != coroutine->depth) {
+        return false;
+    }
+
+    worker->awaited = task;
+
+    // The switch is performed once the native fails, like a yield.
+    vm->switching = true;
+    vm->switch_to = NULL;
+    vm->switch_value = Nil_Value;
+    return true;
+}
+
+/** Scheduler **/
+
+static void free_worker(Worker *worker) {
+    free_vm(&worker->vm);
+    free_deque(&worker->deque);
+    free(worker->path);
+    free(worker);
+}
+
+static Worker *new_worker(Scheduler *scheduler, VM *vm, int index) {
+    Worker *worker = malloc(sizeof (Worker));
+    worker->scheduler = scheduler;
+    init_vm(&worker->vm);
+    worker->path = strdup(vm->path);
+    worker->vm.path = worker->path;
+    worker->vm.scheduler = scheduler;
+    worker->vm.worker = worker;
+    init_deque(&worker->deque);
+
+    worker->ready = NULL;
+    worker->ready_last = NULL;
+    worker->waiting = NULL;
+    worker->running = NULL;
+    worker->awaited = NULL;
+    worker->generation = 0;
+    worker->seed = 2654435761u * (uint32_t)(index + 1);
+
+    return worker;
+}
+
+static void free_scheduler(Scheduler *scheduler) {
+    for (int i = 0; i < scheduler->workers_count; i++) {
+        free_worker(scheduler->workers[i]);
+    }
+    free(scheduler->workers);
+
+    for (int i = 0; i < scheduler->generation; i++) {
+        free_parcel(scheduler->globals[i]);
+    }
+    free(scheduler->globals);
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->changed);
+    free(scheduler);
+}
+
+// Stop the threads of the first workers of a given count.
+static void stop_workers(Scheduler *scheduler, int count) {
+    pthread_mutex_lock(&scheduler->lock);
+    __atomic_store_n(&scheduler->stopping, true, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (int i = 0; i < count; i++) {
+        pthread_join(scheduler->workers[i]->thread, NULL);
+    }
+}
+
+bool start_scheduler(VM *vm, int workers) {
+    // The vm of a worker uses the scheduler it's part of.
+    if (vm->scheduler != NULL) return false;
+
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (int)cores : 1;
+    }
+
+    Scheduler *scheduler = malloc(sizeof (Scheduler));
+    scheduler->next = 0;
+    scheduler->globals = NULL;
+    scheduler->generation = 0;
+    scheduler->globals_capacity = 0;
+    scheduler->definitions = 0;
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->changed, NULL);
+    scheduler->sleepers = 0;
+    scheduler->queued = 0;
+    scheduler->pending = 0;
+    scheduler->stopping = false;
+
+    // Every worker exists before the first thread starts stealing.
+    scheduler->workers = malloc(workers * sizeof (Worker *));
+    scheduler->workers_count = workers;
+
+    for (int i = 0; i < workers; i++) {
+        scheduler->workers[i] = new_worker(scheduler, vm, i);
+    }
+
+    for (int i = 0; i < workers; i++) {
+        Worker *worker = scheduler->workers[i];
+
+        if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+            stop_workers(scheduler, i);
+            free_scheduler(scheduler);
+            return false;
+        }
+    }
+
+    vm->scheduler = scheduler;
+    return true;
+}
+
+void stop_scheduler(VM *vm) {
+    Scheduler *scheduler = vm->scheduler;
+    if (scheduler == NULL || vm->worker != NULL) return;
+
+    Sleep_Until(scheduler, __atomic_load_n(&scheduler->pending,
+                                           __ATOMIC_SEQ_CST) == 0);
+
+    stop_workers(scheduler, scheduler->workers_count);
+    free_scheduler(scheduler);
+    vm->scheduler = NULL;
+}
+
+// Return the generation of the globals of the vm, after taking a new
+// snapshot if it defined globals since the last one.
+static int globals_generation(VM *vm) {
+    Scheduler *scheduler = vm->scheduler;
+
+    if (scheduler->generation > 0 &&
+        scheduler->definitions == vm->definitions) {
+        return scheduler->generation;
+    }
+
+    Parcel *globals = pack_globals(vm);
+    scheduler->definitions = vm->definitions;
+
+    pthread_mutex_lock(&scheduler->lock);
+    if (scheduler->generation == scheduler->globals_capacity) {
+        scheduler->globals_capacity =
+            Grow_Capacity(scheduler->globals_capacity);
+        scheduler->globals = realloc(scheduler->globals,
+                                     scheduler->globals_capacity *
+                                     sizeof (Parcel *));
+    }
+    scheduler->globals[scheduler->generation++] = globals;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return scheduler->generation;
+}
+
+RavTask *spawn_task(VM *vm, Value callee, int count, Value *args) {
+    if (vm->scheduler == NULL && !start_scheduler(vm, 0)) return NULL;
+
+    Scheduler *scheduler = vm->scheduler;
+    Worker *worker = vm->worker;
+
+    Value *values = malloc((count + 1) * sizeof (Value));
+    values[0] = callee;
+    memcpy(values + 1, args, count * sizeof (Value));
+
+    RavTask *task = malloc(sizeof (RavTask));
+    task->call = pack_values(values, count + 1);
+    task->coroutine = NULL;
+    task->awaited = NULL;
+    task->next = NULL;
+    task->status = INTERPRET_OK;
+    task->result = NULL;
+    task->done = false;
+    free(values);
+
+    // A task spawned by a task goes to its worker, which already has the
+    // globals it refers to.
+    if (worker != NULL) {
+        task->generation = worker->generation;
+    } else {
+        task->generation = globals_generation(vm);
+        worker = scheduler->workers[scheduler->next];
+        scheduler->next = (scheduler->next + 1) % scheduler->workers_count;
+    }
+
+    __atomic_add_fetch(&scheduler->pending, 1, __ATOMIC_SEQ_CST);
+    push_bottom(&worker->deque, task);
+    __atomic_add_fetch(&scheduler->queued, 1, __ATOMIC_SEQ_CST);
+    notify(scheduler);
+
+    return task;
+}
+
+InterpretResult await_task(VM *vm, RavTask *task, Value *result) {
+    Scheduler *scheduler = vm->scheduler;
+    Worker *worker = vm->worker;
+
+    // A worker runs the other tasks meanwhile.
+    while (!task_done(task)) {
+        if (worker != NULL && run_step(worker)) continue;
+
+        Sleep_Until(scheduler, task_done(task) ||
+                               (worker != NULL && has_work(worker)));
+    }
+
+    InterpretResult status = task->status;
+    if (status == INTERPRET_OK && result != NULL) {
+        *result = task_result(vm, task);
+    }
+
+    free_task(task);
+    return status;
+}
@@ -0,0 +1,54 @@
+#ifndef raven_scheduler_h
+#define raven_scheduler_h
+
+// Task Scheduler.
+//
+// A task is a function call run by one of the workers of the scheduler
+// of a vm, a pool of threads (one per core by default) each running its
+// own vm, so thousands of tasks are spread over the cores (M:N). The
+// scheduler is started by the first task spawned by the vm, it's stopped
+// once they're all done when the vm is freed.
+//
+// The vms of the workers start with a copy of the globals of the vm,
+// they get a new one whenever the vm has defined globals before spawning
+// a task, so the later assignments of the globals aren't seen by the
+// tasks, the changing values should be passed as arguments. The call of
+// a task and its result are carried between the vms by parcels (see
+// isolate.h).
+//
+// Each worker has a work-stealing deque of the tasks not started yet, it
+// takes its own tasks from the bottom, most recent first, and when it
+// has none left it steals the oldest tasks from the top of the deques of
+// the others. The tasks spawned by the vm are dealt to the workers in
+// turn, the ones spawned by a task go to the deque of its worker. The
+// deques are guarded by a lock each, only the stealing workers contend.
+//
+// Once started, a task is bound to its worker, as its objects are in the
+// heap of the worker vm. It runs on the stacks of a coroutine, until it
+// returns, or it yields. A task calling 'yield' gets queued to be resumed
+// after the other ready tasks of its worker, a task awaiting a future not
+// done yet is resumed with the result once it is. Where it can't yield
+// (in a nested coroutine, or in a native callback), 'await' blocks, and
+// the worker runs its other tasks meanwhile.
+//
+// The embedding API is in raven.h, the scripts use the 'task' and
+// 'await' natives.
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+// Return true if a given task is done, its result can be awaited without
+// blocking.
+bool task_done(RavTask *task);
+
+// Suspend the task running the native calling it, until a given task is
+// done, and return true, or return false if it can't be suspended there.
+// The call of the native returns the result of the awaited task, which is
+// disposed then, or the task fails along with the awaited one.
+bool suspend_task(VM *vm, RavTask *task);
+
+// Wait for all the tasks to be done, and stop the scheduler of the vm.
+void stop_scheduler(VM *vm);
+
+#endif
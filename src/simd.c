@@ -0,0 +1,250 @@
+#include "common.h"
+#include "simd.h"
+
+#ifdef SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+/** Double Kernels **/
+
+#ifdef SIMD_SSE2
+
+// Two independent accumulators (4 lanes) hide the latency of the
+// floating-point adder on the main loop.
+
+double f64_sum(const double *x, size_t count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(x + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(x + i + 2));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+
+    double sum = lanes[0] + lanes[1];
+    for (; i < count; i++) sum += x[i];
+
+    return sum;
+}
+
+double f64_dot(const double *x, const double *y, size_t count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128d p0 = _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+        __m128d p1 = _mm_mul_pd(_mm_loadu_pd(x + i + 2),
+                                _mm_loadu_pd(y + i + 2));
+        acc0 = _mm_add_pd(acc0, p0);
+        acc1 = _mm_add_pd(acc1, p1);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+
+    double dot = lanes[0] + lanes[1];
+    for (; i < count; i++) dot += x[i] * y[i];
+
+    return dot;
+}
+
+// minpd and maxpd return their second operand when either is NaN, the
+// NaN lanes of the elements are blended in so a NaN sticks.
+static inline __m128d nan_blend(__m128d acc, __m128d values) {
+    __m128d nans = _mm_cmpunord_pd(values, values);
+    return _mm_or_pd(_mm_and_pd(nans, values), _mm_andnot_pd(nans, acc));
+}
+
+double f64_min(const double *x, size_t count) {
+    assert(count > 0);
+
+    __m128d acc = _mm_set1_pd(x[0]);
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d values = _mm_loadu_pd(x + i);
+        acc = nan_blend(_mm_min_pd(values, acc), values);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+
+    double min = lanes[0];
+    if (lanes[1] < min || isnan(lanes[1])) min = lanes[1];
+    for (; i < count; i++) if (x[i] < min || isnan(x[i])) min = x[i];
+
+    return min;
+}
+
+double f64_max(const double *x, size_t count) {
+    assert(count > 0);
+
+    __m128d acc = _mm_set1_pd(x[0]);
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d values = _mm_loadu_pd(x + i);
+        acc = nan_blend(_mm_max_pd(values, acc), values);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+
+    double max = lanes[0];
+    if (lanes[1] > max || isnan(lanes[1])) max = lanes[1];
+    for (; i < count; i++) if (x[i] > max || isnan(x[i])) max = x[i];
+
+    return max;
+}
+
+void f64_add(double *out, const double *x, const double *y, size_t count) {
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d sum = _mm_add_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+        _mm_storeu_pd(out + i, sum);
+    }
+
+    for (; i < count; i++) out[i] = x[i] + y[i];
+}
+
+void f64_mul(double *out, const double *x, const double *y, size_t count) {
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        __m128d product = _mm_mul_pd(_mm_loadu_pd(x + i),
+                                     _mm_loadu_pd(y + i));
+        _mm_storeu_pd(out + i, product);
+    }
+
+    for (; i < count; i++) out[i] = x[i] * y[i];
+}
+
+void f64_scale(double *out, const double *x, double k, size_t count) {
+    __m128d factor = _mm_set1_pd(k);
+    size_t i = 0;
+
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(x + i), factor));
+    }
+
+    for (; i < count; i++) out[i] = x[i] * k;
+}
+
+#else
+
+double f64_sum(const double *x, size_t count) {
+    double sum = 0;
+    for (size_t i = 0; i < count; i++) sum += x[i];
+    return sum;
+}
+
+double f64_dot(const double *x, const double *y, size_t count) {
+    double dot = 0;
+    for (size_t i = 0; i < count; i++) dot += x[i] * y[i];
+    return dot;
+}
+
+// Once a NaN is taken, no element compares below or above it.
+
+double f64_min(const double *x, size_t count) {
+    assert(count > 0);
+
+    double min = x[0];
+    for (size_t i = 1; i < count; i++) {
+        if (x[i] < min || isnan(x[i])) min = x[i];
+    }
+    return min;
+}
+
+double f64_max(const double *x, size_t count) {
+    assert(count > 0);
+
+    double max = x[0];
+    for (size_t i = 1; i < count; i++) {
+        if (x[i] > max || isnan(x[i])) max = x[i];
+    }
+    return max;
+}
+
+void f64_add(double *out, const double *x, const double *y, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = x[i] + y[i];
+}
+
+void f64_mul(double *out, const double *x, const double *y, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = x[i] * y[i];
+}
+
+void f64_scale(double *out, const double *x, double k, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = x[i] * k;
+}
+
+#endif // SIMD_SSE2
+
+/** Integer Kernels **/
+
+// Integer sums are accumulated in 64-bit integers, which are exact for
+// up to CAPACITY_LIMIT elements, and loops of this shape are vectorized
+// by the C compiler. The products of the dot are accumulated in 'acc',
+// the i32 ones don't fit 64 bits once summed, so they're summed as
+// doubles. The scaled elements are converted like an element set.
+
+#define Integer_Kernels(prefix, type, acc)                               \
+    double prefix##_sum(const type *x, size_t count) {                   \
+        int64_t sum = 0;                                                 \
+        for (size_t i = 0; i < count; i++) sum += x[i];                  \
+        return (double)sum;                                              \
+    }                                                                    \
+                                                                         \
+    double prefix##_dot(const type *x, const type *y, size_t count) {    \
+        acc dot = 0;                                                     \
+        for (size_t i = 0; i < count; i++) {                             \
+            dot += (acc)x[i] * y[i];                                     \
+        }                                                                \
+        return (double)dot;                                              \
+    }                                                                    \
+                                                                         \
+    double prefix##_min(const type *x, size_t count) {                   \
+        assert(count > 0);                                               \
+        type min = x[0];                                                 \
+        for (size_t i = 1; i < count; i++) min = x[i] < min ? x[i] : min;\
+        return (double)min;                                              \
+    }                                                                    \
+                                                                         \
+    double prefix##_max(const type *x, size_t count) {                   \
+        assert(count > 0);                                               \
+        type max = x[0];                                                 \
+        for (size_t i = 1; i < count; i++) max = x[i] > max ? x[i] : max;\
+        return (double)max;                                              \
+    }                                                                    \
+                                                                         \
+    void prefix##_add(type *out, const type *x, const type *y,           \
+                      size_t count) {                                    \
+        for (size_t i = 0; i < count; i++) {                             \
+            out[i] = (type)((uint32_t)x[i] + (uint32_t)y[i]);            \
+        }                                                                \
+    }                                                                    \
+                                                                         \
+    void prefix##_mul(type *out, const type *x, const type *y,           \
+                      size_t count) {                                    \
+        for (size_t i = 0; i < count; i++) {                             \
+            out[i] = (type)((uint32_t)x[i] * (uint32_t)y[i]);            \
+        }                                                                \
+    }                                                                    \
+                                                                         \
+    void prefix##_scale(type *out, const type *x, double k,              \
+                        size_t count) {                                  \
+        for (size_t i = 0; i < count; i++) {                             \
+            out[i] = (type)typed_integer(x[i] * k);                      \
+        }                                                                \
+    }
+
+Integer_Kernels(i32, int32_t, double)
+Integer_Kernels(u8, uint8_t, int64_t)
+
+#undef Integer_Kernels
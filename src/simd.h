@@ -0,0 +1,55 @@
+#ifndef raven_simd_h
+#define raven_simd_h
+
+// Bulk numeric kernels over contiguous unboxed arrays.
+//
+// The double-precision kernels are vectorized with SSE2 if the target
+// supports it, the integer kernels are plain loops left for the C
+// compiler to vectorize. The elementwise kernels allow 'out' to alias
+// any of the inputs. The min and max of doubles are NaN if any element
+// is NaN, either way.
+
+#include <math.h>
+
+#include "common.h"
+
+// Truncate a number to an integer element, wrapped modulo 2^32 so the
+// cast is defined for any number, the non-finite ones are stored as 0.
+static inline int64_t typed_integer(double number) {
+    if (number > -2147483648.0 && number < 2147483648.0) {
+        return (int64_t)number;
+    }
+
+    if (!isfinite(number)) return 0;
+    return (int64_t)fmod(trunc(number), 4294967296.0);
+}
+
+double f64_sum(const double *x, size_t count);
+double f64_dot(const double *x, const double *y, size_t count);
+double f64_min(const double *x, size_t count);
+double f64_max(const double *x, size_t count);
+void f64_add(double *out, const double *x, const double *y, size_t count);
+void f64_mul(double *out, const double *x, const double *y, size_t count);
+void f64_scale(double *out, const double *x, double k, size_t count);
+
+double i32_sum(const int32_t *x, size_t count);
+double i32_dot(const int32_t *x, const int32_t *y, size_t count);
+double i32_min(const int32_t *x, size_t count);
+double i32_max(const int32_t *x, size_t count);
+void i32_add(int32_t *out, const int32_t *x, const int32_t *y,
+             size_t count);
+void i32_mul(int32_t *out, const int32_t *x, const int32_t *y,
+             size_t count);
+void i32_scale(int32_t *out, const int32_t *x, double k, size_t count);
+
+double u8_sum(const uint8_t *x, size_t count);
+double u8_dot(const uint8_t *x, const uint8_t *y, size_t count);
+double u8_min(const uint8_t *x, size_t count);
+double u8_max(const uint8_t *x, size_t count);
+void u8_add(uint8_t *out, const uint8_t *x, const uint8_t *y,
+            size_t count);
+void u8_mul(uint8_t *out, const uint8_t *x, const uint8_t *y,
+            size_t count);
+void u8_scale(uint8_t *out, const uint8_t *x, double k, size_t count);
+
+#endif
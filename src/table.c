@@ -6,100 +6,203 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#define TABLE_MAX_LOAD 0.875
+
+// Control bytes, empty and deleted have the high bit set, while a
+// full entry stores the low 7 bits of its key hash.
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+
+// A key is stored at its home entry if it's free, else at the next free
+// entry of its group, or of the probed groups. Most hits are on the home
+// entry, which is checked before scanning its group.
+#define Hash_Fragment(hash) ((uint8_t)((hash) & 0x7f))
+#define Hash_Home(hash, mask) (((hash) >> 7) & (mask))
+#define Hash_Start(hash, mask)                              \
+    (Hash_Home(hash, mask) & ~(TABLE_GROUP_SIZE - 1))
 
 void init_table(Table *table) {
     table->entries = NULL;
+    table->control = NULL;
     table->count = 0;
     table->hash_mask = -1;
 }
 
 void free_table(Table *table) {
     free(table->entries);
+    free(table->control);
     init_table(table);
 }
 
-static Entry *find_entry(Entry *entries, RavString *key, int hash_mask) {
-    uint32_t index = key->hash & hash_mask;
-    Entry *tombstone = NULL;
+/** Group Matching **/
+
+// Return a bit mask of the group control bytes equal to byte.
+static inline uint32_t match_byte(const uint8_t *group, uint8_t byte) {
+#ifdef SIMD_SSE2
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    __m128i bytes = _mm_set1_epi8((char)byte);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, bytes));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Return a bit mask of the group empty or deleted entries.
+static inline uint32_t match_free(const uint8_t *group) {
+#ifdef SIMD_SSE2
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(control);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
 
-    for (;;) {
-        Entry *entry = &entries[index];
+#define Next_Bit(mask) __builtin_ctz(mask)
 
-        if (entry->key == NULL) {
-            if (Is_Nil(entry->value)) {
-                return tombstone ? tombstone : entry;
-            }
+// The groups are probed quadratically (triangular numbers), which
+// visits every group since the groups count is a power of 2.
+#define Next_Group(offset, probe, mask)                             \
+    (((offset) + TABLE_GROUP_SIZE * ++(probe)) & (mask))
 
-            if (tombstone == NULL) tombstone = entry;
-        } else if (entry->key == key) {
-            return entry;
+// Return the index of the entry of key, or -1 if it's not found.
+static int find_entry(Table *table, RavString *key) {
+    uint8_t fragment = Hash_Fragment(key->hash);
+    uint32_t home = Hash_Home(key->hash, table->hash_mask);
+    if (table->control[home] == fragment && table->entries[home].key == key) {
+        return home;
+    }
+
+    uint32_t offset = Hash_Start(key->hash, table->hash_mask);
+    int probe = 0;
+
+    for (;;) {
+        const uint8_t *group = &table->control[offset];
+
+        for (uint32_t mask = match_byte(group, fragment); mask != 0;
+             mask &= mask - 1) {
+            uint32_t index = offset + Next_Bit(mask);
+            if (table->entries[index].key == key) return index;
         }
 
-        index = (index + 1) & hash_mask;
+        if (match_byte(group, CTRL_EMPTY)) return -1;
+        offset = Next_Group(offset, probe, table->hash_mask);
+    }
+}
+
+// Return the index of the first empty or deleted entry for a hash,
+// from its home entry.
+static int find_free(uint8_t *control, uint32_t hash, int hash_mask) {
+    uint32_t offset = Hash_Start(hash, hash_mask);
+    int probe = 0;
+
+    uint32_t mask = match_free(&control[offset]);
+    uint32_t after = mask & (~0u << (Hash_Home(hash, hash_mask) - offset));
+    if (after) return offset + Next_Bit(after);
+
+    for (;;) {
+        if (mask) return offset + Next_Bit(mask);
+
+        offset = Next_Group(offset, probe, hash_mask);
+        mask = match_free(&control[offset]);
     }
 }
 
 static void adjust_capacity(Table *table, int hash_mask) {
-    Entry *entries = malloc((hash_mask + 1) * sizeof (Entry));
+    int capacity = hash_mask + 1;
+    Entry *entries = malloc(capacity * sizeof (Entry));
+    uint8_t *control = malloc(capacity);
 
-    for (int i = 0; i <= hash_mask; i++) {
+    for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = Nil_Value;
     }
+    memset(control, CTRL_EMPTY, capacity);
 
     table->count = 0;
     for (int i = 0; i <= table->hash_mask; i++) {
         Entry *entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry *copy = find_entry(entries, entry->key, hash_mask);
-        copy->key = entry->key;
-        copy->value = entry->value;
+        int index = find_free(control, entry->key->hash, hash_mask);
+        control[index] = Hash_Fragment(entry->key->hash);
+        entries[index] = *entry;
         table->count++;
     }
 
     free(table->entries);
+    free(table->control);
     table->entries = entries;
+    table->control = control;
     table->hash_mask = hash_mask;
 }
 
 bool table_get(Table *table, RavString *key, Value *value) {
     if (table->count == 0) return false;
 
-    Entry *entry = find_entry(table->entries, key, table->hash_mask);
-    if (entry->key == NULL) return false;
+    int index = find_entry(table, key);
+    if (index == -1) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
 bool table_set(Table *table, RavString *key, Value value) {
-    int capacity = table->hash_mask + 1;
+    if (table->count > 0) {
+        int index = find_entry(table, key);
 
-    if (table->count >= capacity * TABLE_MAX_LOAD) {
-        int new_capacity = Grow_Capacity(capacity);
-        adjust_capacity(table, new_capacity - 1);
+        if (index != -1) {
+            table->entries[index].value = value;
+            return false;
+        }
     }
 
-    Entry *entry = find_entry(table->entries, key, table->hash_mask);
+    int capacity = table->hash_mask + 1;
+    if (table->count + 1 > capacity * TABLE_MAX_LOAD) {
+        int live = 0;
+        for (int i = 0; i < capacity; i++) {
+            if (table->entries[i].key != NULL) live++;
+        }
+
+        // Mostly tombstones? Rehash in place instead of growing.
+        if (capacity == 0 || live + 1 > capacity * TABLE_MAX_LOAD / 2) {
+            capacity = capacity < TABLE_GROUP_SIZE ?
+                TABLE_GROUP_SIZE : capacity * 2;
+        }
+
+        adjust_capacity(table, capacity - 1);
+    }
 
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && Is_Nil(entry->value)) table->count++;
+    int index = find_free(table->control, key->hash, table->hash_mask);
+    if (table->control[index] == CTRL_EMPTY) table->count++;
 
-    entry->key = key;
-    entry->value = value;
-    return is_new_key;
+    table->control[index] = Hash_Fragment(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    return true;
 }
 
 bool table_remove(Table *table, RavString *key) {
     if (table->count == 0) return false;
 
-    Entry *entry = find_entry(table->entries, key, table->hash_mask);
-    if (entry->key == NULL) return false;
+    int index = find_entry(table, key);
+    if (index == -1) return false;
 
-    entry->key = NULL;
-    entry->value = Bool_Value(false); // Any non-nil value
+    // Leave a tombstone, to not break the probing of other keys.
+    table->control[index] = CTRL_DELETED;
+    table->entries[index].key = NULL;
+    table->entries[index].value = Nil_Value;
 
     return true;
 }
@@ -118,14 +221,27 @@ RavString *table_interned(Table *table, const char *chars,
                           uint32_t hash, int length) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & table->hash_mask;
+    uint8_t fragment = Hash_Fragment(hash);
+    uint32_t home = Hash_Home(hash, table->hash_mask);
+    if (table->control[home] == fragment) {
+        RavString *key = table->entries[home].key;
+
+        if (key->hash == hash && key->length == length &&
+            memcmp(key->chars, chars, length) == 0) {
+            return key;
+        }
+    }
+
+    uint32_t offset = Hash_Start(hash, table->hash_mask);
+    int probe = 0;
+
     for (;;) {
-        Entry *entry = &table->entries[index];
+        const uint8_t *group = &table->control[offset];
+
+        for (uint32_t mask = match_byte(group, fragment); mask != 0;
+             mask &= mask - 1) {
+            RavString *key = table->entries[offset + Next_Bit(mask)].key;
 
-        if (entry->key == NULL) {
-            if (Is_Nil(entry->value)) return NULL;
-        } else {
-            RavString *key = entry->key;
             if (key->length == length &&
                 key->hash == hash &&
                 memcmp(key->chars, chars, length) == 0) {
@@ -133,7 +249,8 @@ RavString *table_interned(Table *table, const char *chars,
             }
         }
 
-        index = (index + 1) & table->hash_mask;
+        if (match_byte(group, CTRL_EMPTY)) return NULL;
+        offset = Next_Group(offset, probe, table->hash_mask);
     }
 }
 
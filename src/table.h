@@ -1,19 +1,28 @@
 #ifndef raven_table_h
 #define raven_table_h
 
-// Simple linear probing hash table
+// Open addressing hash table with group probing (Swiss table).
+//
+// Each entry has a control byte, which is either empty, deleted
+// (tombstone), or the low 7 bits of the key hash. A lookup compares
+// the control bytes of a whole group of entries at once, and only
+// compares the keys of the entries whose hash fragment matches.
 
 #include "common.h"
 #include "value.h"
 
+// Number of entries probed at once, the capacity is a multiple of it.
+#define TABLE_GROUP_SIZE 16
+
 typedef struct {
-    RavString *key;
+    RavString *key;  // NULL for empty and deleted entries
     Value value;
 } Entry;
 
 typedef struct {
     Entry *entries;
-    int count;
+    uint8_t *control;
+    int count;      // Number of entries, including the tombstones
     int hash_mask;
 } Table;
 
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "common.h"
 #include "mem.h"
@@ -46,9 +47,23 @@ void print_value(Value value) {
 #endif
 }
 
+// A frozen string isn't interned, it's equal to any string of the same
+// characters.
+static bool equal_strings(RavString *x, RavString *y) {
+    return (x->header.frozen || y->header.frozen) &&
+           x->hash == y->hash && x->length == y->length &&
+           memcmp(x->chars, y->chars, x->length) == 0;
+}
+
 bool equal_values(Value x, Value y) {
 #ifdef NAN_TAGGING
-    return x == y;
+    if (x == y) return true;
+
+    // +0 and -0 have different bits.
+    if (Is_Num(x) && Is_Num(y)) return As_Num(x) == As_Num(y);
+
+    return Is_String(x) && Is_String(y) &&
+           equal_strings(As_String(x), As_String(y));
 #else
     if (x.type != y.type) return false;
 
@@ -57,10 +72,42 @@ bool equal_values(Value x, Value y) {
     case VALUE_BOOL: return As_Bool(x) == As_Bool(y);
     case VALUE_NIL:
     case VALUE_VOID: return true;
-    case VALUE_OBJ:  return As_Obj(x) == As_Obj(y);
+    case VALUE_OBJ:
+        if (As_Obj(x) == As_Obj(y)) return true;
+        return Is_String(x) && Is_String(y) &&
+               equal_strings(As_String(x), As_String(y));
     }
 
     assert(!"invalid value type");
     return false; // For warnings
 #endif
 }
+
+// Finalizer of the MurmurHash3 64-bit hash, to spread the low bits of
+// the doubles representing small integers, which are all zeros.
+static inline uint32_t mix_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+uint32_t hash_value(Value value) {
+    if (Is_Num(value)) {
+        // +0 and -0 are equal numbers.
+        double number = As_Num(value) == 0 ? 0 : As_Num(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof (uint64_t));
+        return mix_bits(bits);
+    }
+
+    if (Is_Bool(value)) return As_Bool(value) ? 3 : 2;
+    if (Is_Nil(value)) return 1;
+
+    if (Is_String(value)) return As_String(value)->hash;
+
+    assert(Is_Obj(value));
+    return mix_bits((uint64_t)(uintptr_t)As_Obj(value));
+}
@@ -11,10 +11,14 @@ typedef struct Object Object;
 typedef struct RavString RavString;
 typedef struct RavPair RavPair;
 typedef struct RavArray RavArray;
+typedef struct RavTypedArray RavTypedArray;
 typedef struct RavMap RavMap;
 typedef struct RavFunction RavFunction;
 typedef struct RavUpvalue RavUpvalue;
 typedef struct RavClosure RavClosure;
+typedef struct RavNative RavNative;
+typedef struct RavCoroutine RavCoroutine;
+typedef struct RavFuture RavFuture;
 
 #ifdef NAN_TAGGING
 
@@ -116,8 +120,18 @@ typedef struct {
 
 #endif // NAN_TAGGING
 
+static inline bool is_falsy(Value value) {
+    return Is_Nil(value) || (Is_Bool(value) && !As_Bool(value));
+}
+
 void print_value(Value value);
 
+// Return true if two values are equal, the numbers +0 and -0 are equal,
+// and the strings are compared by content.
 bool equal_values(Value x, Value y);
 
+// Hash a value consistently with 'equal_values', strings use their
+// cached hash, and other objects are hashed by identity.
+uint32_t hash_value(Value value);
+
 #endif
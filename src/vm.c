@@ -1,12 +1,19 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
+#include "builtin.h"
+#include "cache.h"
 #include "compiler.h"
+#include "isolate.h"
 #include "chunk.h"
 #include "value.h"
 #include "object.h"
+#include "raven.h"
+#include "scheduler.h"
 #include "vm.h"
 
 #ifdef DEBUG_TRACE_EXECUTION
@@ -14,33 +21,126 @@
 #endif
 
 static inline void reset_stack(VM *vm) {
+    // Drop the upvalues left open by an interrupted execution.
+    for (Value *slot = vm->stack; slot < vm->stack_top; slot++) {
+        vm->open_upvalues[slot - vm->stack] = NULL;
+    }
+
     vm->x = Nil_Value;
     vm->stack_top = vm->stack;
     vm->frame_count = 0;
 }
 
 void init_vm(VM *vm) {
+    vm->main_stack = malloc(STACK_SIZE * sizeof (Value));
+    vm->main_frames = malloc(FRAMES_LIMIT * sizeof (CallFrame));
+    vm->main_upvalues = calloc(STACK_SIZE, sizeof (RavUpvalue *));
+
+    if (vm->main_stack == NULL || vm->main_frames == NULL ||
+        vm->main_upvalues == NULL) {
+        fprintf(stderr, "Fatal: can't allocate the stacks of a vm\n");
+        abort();
+    }
+
+    vm->stack = vm->main_stack;
+    vm->stack_top = vm->stack;
+    vm->stack_end = vm->stack + STACK_SIZE;
+    vm->frames = vm->main_frames;
     vm->frame_count = 0;
-    vm->open_upvalues = NULL;
+    vm->frames_limit = FRAMES_LIMIT;
+    vm->open_upvalues = vm->main_upvalues;
+
+    vm->coroutine = NULL;
+    vm->switching = false;
+    vm->switch_to = NULL;
+    vm->switch_value = Nil_Value;
+    vm->callback_depth = 0;
 
     init_allocator(&vm->allocator);
     init_table(&vm->globals);
+    vm->global_buffer = NULL;
+    vm->global_capacity = 0;
+    vm->definitions = 0;
+    init_dict(&vm->inlined_globals);
+    init_dict(&vm->pinned);
+    vm->isolates = NULL;
+    vm->isolates_count = 0;
+    vm->isolates_capacity = 0;
+    vm->regions.entries = NULL;
+    vm->regions.count = 0;
+    vm->regions.capacity = 0;
+    vm->allocator.regions = &vm->regions;
+    vm->scheduler = NULL;
+    vm->worker = NULL;
+    vm->futures = NULL;
+    vm->futures_count = 0;
+    vm->futures_capacity = 0;
+    vm->path = "raven";
     reset_stack(vm);
+
+    define_builtins(vm);
 }
 
 void free_vm(VM *vm) {
+    // Wait for the isolates never joined, their results are discarded.
+    for (int i = 0; i < vm->isolates_count; i++) {
+        if (vm->isolates[i] != NULL) join_isolate(vm, vm->isolates[i], NULL);
+    }
+    free(vm->isolates);
+    vm->isolates = NULL;
+    vm->isolates_count = 0;
+    vm->isolates_capacity = 0;
+
+    // Likewise for the tasks never awaited, then the workers are stopped.
+    for (int i = 0; i < vm->futures_count; i++) {
+        await_task(vm, vm->futures[i]->task, NULL);
+    }
+    free(vm->futures);
+    vm->futures = NULL;
+    vm->futures_count = 0;
+    vm->futures_capacity = 0;
+    stop_scheduler(vm);
+
+    release_regions(&vm->regions, true);
+
     free_table(&vm->globals);
+    free(vm->global_buffer);
+    vm->global_buffer = NULL;
+    vm->global_capacity = 0;
+    free_dict(&vm->inlined_globals);
+    free_dict(&vm->pinned);
     free_allocator(&vm->allocator);
 
-    init_vm(vm);
+    reset_stack(vm);
+    free(vm->main_stack);
+    free(vm->main_frames);
+    free(vm->main_upvalues);
+    vm->main_stack = NULL;
+    vm->main_frames = NULL;
+    vm->main_upvalues = NULL;
+    vm->stack = vm->stack_top = vm->stack_end = NULL;
+    vm->frames = NULL;
+    vm->open_upvalues = NULL;
 }
 
-static void dump_stack_trace(VM *vm, FILE *out) {
-    fprintf(out, "stack traceback:\n");
+int add_global(VM *vm, RavString *name) {
+    int index = vm->globals.count;
+
+    if (index == vm->global_capacity) {
+        vm->global_capacity = Grow_Capacity(vm->global_capacity);
+        vm->global_buffer = realloc(vm->global_buffer,
+                                    vm->global_capacity * sizeof (Value));
+    }
+
+    vm->global_buffer[index] = Void_Value;
+    table_set(&vm->globals, name, Num_Value((double)index));
+    return index;
+}
 
+static void dump_frames(VM *vm, CallFrame *frames, int count, FILE *out) {
     // TODO: an option to control the stack trace dumping order.
-    for (int i = vm->frame_count - 1; i >= 0; i--) {
-        CallFrame *frame = &vm->frames[i];
+    for (int i = count - 1; i >= 0; i--) {
+        CallFrame *frame = &frames[i];
         RavFunction *function = frame->closure->function;
 
         size_t offset = frame->ip - function->chunk.opcodes - 1;
@@ -56,17 +156,43 @@ static void dump_stack_trace(VM *vm, FILE *out) {
     }
 }
 
-static void runtime_error(VM *vm, const char *format, ...) {
+static void dump_stack_trace(VM *vm, FILE *out) {
+    fprintf(out, "stack traceback:\n");
+    dump_frames(vm, vm->frames, vm->frame_count, out);
+
+    // The frames of the resumers of the running coroutine, up to the C
+    // code resuming it.
+    for (RavCoroutine *coroutine = vm->coroutine;
+         coroutine != NULL && !coroutine->from_c;
+         coroutine = coroutine->caller) {
+        Stacks *stacks = coroutine->caller == NULL
+                       ? &vm->main
+                       : &coroutine->caller->stacks;
+
+        fprintf(out, "\t(resumed)\n");
+        dump_frames(vm, stacks->frames, stacks->frame_count, out);
+    }
+}
+
+static void close_upvalues(VM *vm, Value *slot);
+static void leave_coroutine(VM *vm, CoroutineState state);
+
+void runtime_error(VM *vm, const char *format, ...) {
     va_list arguments;
     va_start(arguments, format);
 
-    CallFrame *frame = &vm->frames[vm->frame_count - 1];
-    RavFunction *function = frame->closure->function;
+    // A call from the embedder fails before running any frame.
+    if (vm->frame_count == 0) {
+        fprintf(stderr, "[%s] ", vm->path);
+    } else {
+        CallFrame *frame = &vm->frames[vm->frame_count - 1];
+        RavFunction *function = frame->closure->function;
 
-    // -1 because ip is sitting on the next instruction to be executed.
-    size_t offset = frame->ip - function->chunk.opcodes - 1;
-    int line = decode_line(&function->chunk, offset);
-    fprintf(stderr, "[%s | line: %d] ", vm->path, line);
+        // -1 because ip is sitting on the next instruction to be executed.
+        size_t offset = frame->ip - function->chunk.opcodes - 1;
+        int line = decode_line(&function->chunk, offset);
+        fprintf(stderr, "[%s | line: %d] ", vm->path, line);
+    }
 
     vfprintf(stderr, format, arguments);
     putc('\n', stderr);
@@ -74,6 +200,19 @@ static void runtime_error(VM *vm, const char *format, ...) {
     dump_stack_trace(vm, stderr);
 
     va_end(arguments);
+
+    // The running coroutine and its resumers fail along, up to the one
+    // resumed from C, its resumer goes on.
+    vm->switching = false;
+
+    while (vm->coroutine != NULL) {
+        bool from_c = vm->coroutine->from_c;
+
+        close_upvalues(vm, vm->stack);
+        leave_coroutine(vm, COROUTINE_DEAD);
+        if (from_c) return;
+    }
+
     reset_stack(vm);
 }
 
@@ -89,12 +228,16 @@ static inline void push(register VM *vm, Value value) {
     *vm->stack_top++ = value;
 }
 
-static inline bool is_falsy(Value value) {
-    return Is_Nil(value) || (Is_Bool(value) && !As_Bool(value));
-}
-
 static inline bool push_frame(VM *vm, RavClosure *closure, int count) {
-    if (vm->frame_count == FRAMES_LIMIT) {
+    if (vm->frame_count == vm->frames_limit) {
+        runtime_error(vm, "call stack overflows");
+        return false;
+    }
+
+    // Functions with more than 256 locals could exhaust the stack
+    // before the frames limit is reached.
+    Value *slots = vm->stack_top - count - 1;
+    if (slots + closure->function->slots_count > vm->stack_end) {
         runtime_error(vm, "call stack overflows");
         return false;
     }
@@ -102,11 +245,31 @@ static inline bool push_frame(VM *vm, RavClosure *closure, int count) {
     CallFrame *frame = &vm->frames[vm->frame_count++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.opcodes;
-    frame->slots = vm->stack_top - count - 1;
+    frame->slots = slots;
+    frame->has_captures = false;
+    frame->root = NULL;
+    frame->hole = NULL;
 
     return true;
 }
 
+// Compile the body of a lazily compiled function on its first call.
+static bool compile_body(VM *vm, RavFunction *function) {
+    // The function is reachable from the stack, but the objects of its
+    // chunk aren't until it's compiled.
+    bool gc_off = vm->allocator.gc_off;
+    vm->allocator.gc_off = true;
+    bool done = compile_function(vm, function, vm->path);
+    vm->allocator.gc_off = gc_off;
+
+    if (!done) {
+        runtime_error(vm, "function '%s' has a syntax error",
+                      function->name->chars);
+    }
+
+    return done;
+}
+
 static bool call_closure(VM *vm, RavClosure *closure, int count) {
     RavFunction *function = closure->function;
 
@@ -116,61 +279,188 @@ static bool call_closure(VM *vm, RavClosure *closure, int count) {
         return false;
     }
 
+    if (function->source != NULL && !compile_body(vm, function)) {
+        return false;
+    }
+
     return push_frame(vm, closure, count);
 }
 
+// Natives run directly on the caller stack window, without a frame.
+static bool call_native(VM *vm, RavNative *native, int count) {
+    if (native->arity != -1 && native->arity != count) {
+        runtime_error(vm, "expect %d arguments, but got %d",
+                      native->arity, count);
+        return false;
+    }
+
+    Value result = native->function(vm, count, vm->stack_top - count);
+    if (Is_Void(result)) return false;
+
+    vm->stack_top -= count + 1;
+    push(vm, result);
+    return true;
+}
+
 static inline bool call_value(VM *vm, Value value, int count) {
     if (Is_Closure(value)) {
         return call_closure(vm, As_Closure(value), count);
     }
 
+    if (Is_Native(value)) {
+        return call_native(vm, As_Native(value), count);
+    }
+
     runtime_error(vm, "call to a non-callable");
     return false;
 }
 
 static RavUpvalue *capture_upvalue(VM *vm, Value *location) {
-    RavUpvalue *previous = NULL;
-    RavUpvalue *current = vm->open_upvalues;
+    RavUpvalue **entry = &vm->open_upvalues[location - vm->stack];
+
+    if (*entry == NULL) {
+        *entry = new_upvalue(&vm->allocator, location);
+        (*entry)->coroutine = vm->coroutine;
+    }
+
+    return *entry;
+}
+
+static inline void close_upvalue(VM *vm, Value *slot) {
+    RavUpvalue **entry = &vm->open_upvalues[slot - vm->stack];
+    RavUpvalue *upvalue = *entry;
+
+    if (upvalue != NULL) {
+        upvalue->captured = *upvalue->location;
+        upvalue->location = &upvalue->captured;
+        upvalue->coroutine = NULL;
+        *entry = NULL;
+    }
+}
+
+// Close the open upvalues of all the slots starting from the given one.
+static void close_upvalues(VM *vm, Value *slot) {
+    for (; slot < vm->stack_top; slot++) {
+        close_upvalue(vm, slot);
+    }
+}
+
+/** Coroutines **/
+
+static inline void save_stacks(VM *vm, Stacks *stacks) {
+    stacks->stack = vm->stack;
+    stacks->stack_top = vm->stack_top;
+    stacks->stack_end = vm->stack_end;
+    stacks->frames = vm->frames;
+    stacks->frame_count = vm->frame_count;
+    stacks->frames_limit = vm->frames_limit;
+    stacks->open_upvalues = vm->open_upvalues;
+}
+
+static inline void load_stacks(VM *vm, Stacks *stacks) {
+    vm->stack = stacks->stack;
+    vm->stack_top = stacks->stack_top;
+    vm->stack_end = stacks->stack_end;
+    vm->frames = stacks->frames;
+    vm->frame_count = stacks->frame_count;
+    vm->frames_limit = stacks->frames_limit;
+    vm->open_upvalues = stacks->open_upvalues;
+}
 
-    while (current != NULL && current->location > location) {
-        previous = current;
-        current = current->next;
+// Switch from the running line of execution to a suspended coroutine,
+// passing it the arguments of its function on the first resume, or else
+// the result of the 'yield' it's suspended at (nil if there is none).
+static bool enter_coroutine(VM *vm, RavCoroutine *coroutine, int count,
+                            Value *args, bool from_c) {
+    RavCoroutine *caller = vm->coroutine;
+
+    if (caller == NULL) {
+        save_stacks(vm, &vm->main);
+    } else {
+        save_stacks(vm, &caller->stacks);
+        caller->state = COROUTINE_NORMAL;
+    }
+
+    coroutine->caller = caller;
+    coroutine->state = COROUTINE_RUNNING;
+    coroutine->depth = vm->callback_depth;
+    coroutine->from_c = from_c;
+    vm->coroutine = coroutine;
+    load_stacks(vm, &coroutine->stacks);
+
+    if (coroutine->started) {
+        push(vm, count == 0 ? Nil_Value : args[0]);
+        return true;
     }
 
-    if (current && current->location == location) return current;
+    RavClosure *closure = coroutine->closure;
+    coroutine->started = true;
+
+    push(vm, Obj_Value(closure));
+    for (int i = 0; i < count; i++) {
+        push(vm, args[i]);
+    }
+
+    return call_closure(vm, closure, count);
+}
+
+// Switch from the running coroutine back to its resumer, leaving it
+// suspended, or dead with its stacks freed.
+static void leave_coroutine(VM *vm, CoroutineState state) {
+    RavCoroutine *coroutine = vm->coroutine;
+    RavCoroutine *caller = coroutine->caller;
 
-    RavUpvalue *upvalue = new_upvalue(&vm->allocator, location);
-    upvalue->next = current;
+    coroutine->state = state;
+    coroutine->caller = NULL;
 
-    if (previous == NULL) {
-        vm->open_upvalues = upvalue;
+    if (state == COROUTINE_DEAD) {
+        free_coroutine_stacks(&vm->allocator, coroutine);
     } else {
-        previous->next = upvalue;
+        save_stacks(vm, &coroutine->stacks);
     }
 
-    return upvalue;
+    if (caller == NULL) {
+        load_stacks(vm, &vm->main);
+    } else {
+        load_stacks(vm, &caller->stacks);
+        caller->state = COROUTINE_RUNNING;
+    }
+
+    vm->coroutine = caller;
 }
 
-static void close_upvalues(VM *vm, Value *slot) {
-    while (vm->open_upvalues != NULL &&
-           vm->open_upvalues->location >= slot) {
-        RavUpvalue *upvalue = vm->open_upvalues;
-        upvalue->captured = *upvalue->location;
-        upvalue->location = &upvalue->captured;
-        vm->open_upvalues = upvalue->next;
+// Perform the switch requested by the native 'resume' or 'yield', which
+// call starts at the callee slot, it's dropped from the stack.
+static bool switch_coroutine(VM *vm, Value *callee) {
+    Value value = vm->switch_value;
+    RavCoroutine *coroutine = vm->switch_to;
+
+    vm->switching = false;
+    vm->switch_to = NULL;
+    vm->switch_value = Nil_Value;
+    vm->stack_top = callee;
+
+    if (coroutine != NULL) {
+        int count = coroutine->started ? 1
+                                       : coroutine->closure->function->arity;
+        return enter_coroutine(vm, coroutine, count, &value, false);
     }
+
+    leave_coroutine(vm, COROUTINE_SUSPENDED);
+    push(vm, value);
+    return true;
 }
 
 // Returns the name of a registered global at a given index.
 // It's a linear function, but that is not a problem, since it
 // only gets called at runtime errors.
-static inline const char *global_name_at(VM *vm, uint8_t index) {
+static inline const char *global_name_at(VM *vm, int index) {
     Table *globals = &vm->globals;
 
     for (int i = 0; i <= globals->hash_mask; i++) {
         if (globals->entries[i].key == NULL) continue;
 
-        if ((uint8_t)As_Num(globals->entries[i].value) == index) {
+        if ((int)As_Num(globals->entries[i].value) == index) {
             return globals->entries[i].key->chars;
         }
     }
@@ -180,7 +470,10 @@ static inline const char *global_name_at(VM *vm, uint8_t index) {
 }
 
 // VM Dispatch Loop
-static InterpretResult run_vm(register VM *vm) {
+// Run until the control returns to the C caller, that's when the stacks
+// of the caller are back to its frames, at a given count.
+static InterpretResult run_vm(register VM *vm, CallFrame *base_frames,
+                              int base_count) {
     CallFrame frame = vm->frames[vm->frame_count - 1];
     uint8_t instruction;
 
@@ -207,7 +500,8 @@ static InterpretResult run_vm(register VM *vm) {
 
 #ifdef THREADED_CODE
 
-    static void *dispatch_table[] = {
+    // Read-only, shared by the vms running in other threads.
+    static void *const dispatch_table[] = {
 #define Opcode(opcode) &&label_##opcode,
 # include "opcode.h"
 #undef Opcode
@@ -235,6 +529,9 @@ static InterpretResult run_vm(register VM *vm) {
 #define Read_Byte() (*frame.ip++)
 #define Read_Short()                                                    \
     (frame.ip += 2, (uint16_t)(frame.ip[-2] << 8 | frame.ip[-1]))
+#define Read_Long()                                                     \
+    (frame.ip += 3,                                                     \
+     (uint32_t)(frame.ip[-3] << 16 | frame.ip[-2] << 8 | frame.ip[-1]))
 #define Read_Constant()                                                 \
     (frame.closure->function->chunk.constants[Read_Byte()])
 #define Read_String() (As_String(Read_Constant()))
@@ -252,6 +549,15 @@ static InterpretResult run_vm(register VM *vm) {
         runtime_error(vm, fmt, ##__VA_ARGS__);  \
     } while (false)
 
+    // The natives 'resume' and 'yield' fail a call to request a switch
+    // of stacks, which is performed here, with no recursion in C.
+#define Switch_Coroutine(argument_count)                                \
+    (vm->switching &&                                                   \
+     switch_coroutine(vm, vm->stack_top - (argument_count) - 1))
+
+#define At_Base()                                                       \
+    (vm->frame_count == base_count && vm->frames == base_frames)
+
     // Arithmetics Binary
 #define Binary_OP(value_type, op)                            \
     do {                                                     \
@@ -272,6 +578,12 @@ static InterpretResult run_vm(register VM *vm) {
     Case(OP_PUSH_NIL):   Push(Nil_Value);         Dispatch();
     Case(OP_PUSH_CONST): Push(Read_Constant());   Dispatch();
 
+    Case(OP_PUSH_CONST_16): {
+        uint16_t index = Read_Short();
+        Push(frame.closure->function->chunk.constants[index]);
+        Dispatch();
+    }
+
     Case(OP_PUSH_X): {
         Push(vm->x);
         vm->x = Nil_Value;
@@ -290,6 +602,20 @@ static InterpretResult run_vm(register VM *vm) {
         Dispatch();
     }
 
+    Case(OP_PEEK): {
+        uint8_t distance = Read_Byte();
+        Push(Peek(distance));
+        Dispatch();
+    }
+
+    // Drop the values under the top one, the top is moved in their place.
+    Case(OP_SLIDE): {
+        uint8_t count = Read_Byte();
+        vm->stack_top[-count - 1] = vm->stack_top[-1];
+        vm->stack_top -= count;
+        Dispatch();
+    }
+
     Case(OP_ADD): Binary_OP(Num_Value, +); Dispatch();
     Case(OP_SUB): Binary_OP(Num_Value, -); Dispatch();
     Case(OP_MUL): Binary_OP(Num_Value, *); Dispatch();
@@ -339,10 +665,12 @@ static InterpretResult run_vm(register VM *vm) {
     Case(OP_NOT): Push(Bool_Value(is_falsy(Pop()))); Dispatch();
 
     Case(OP_CONS): {
-        Value tail = Pop();
-        Value head = Pop();
+        // Keep the operands on the stack while allocating the pair,
+        // in case the allocation triggers the GC.
+        RavPair *pair = new_pair(&vm->allocator, Peek(1), Peek(0));
+        vm->stack_top -= 2;
 
-        Push(Obj_Value(new_pair(&vm->allocator, head, tail)));
+        Push(Obj_Value(pair));
         Dispatch();
     }
 
@@ -371,6 +699,36 @@ static InterpretResult run_vm(register VM *vm) {
         Value offset = Pop();
         Value collection = Pop();
 
+        if (Is_Frozen(collection)) {
+            Runtime_Error("cannot modify a frozen value");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+
+        if (Is_Map(collection)) {
+            dict_set(&As_Map(collection)->dict, offset, value);
+            Push(value);
+            Dispatch();
+        }
+
+        if (Is_Typed_Array(collection)) {
+            RavTypedArray *array = As_Typed_Array(collection);
+            if (!Is_Num(offset) || !Is_Num(value)) {
+                Runtime_Error("index a typed array with non-numeric type");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            size_t index = (size_t)As_Num(offset);
+            if (index >= array->count) {
+                Runtime_Error("index out of bound %d > %d",
+                              index, array->count);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            typed_array_set(array, index, As_Num(value));
+            Push(typed_array_get(array, index));
+            Dispatch();
+        }
+
         if (!Is_Array(collection)) {
             Runtime_Error("index a non-collection type");
             return INTERPRET_RUNTIME_ERROR;
@@ -397,6 +755,35 @@ static InterpretResult run_vm(register VM *vm) {
         Value offset = Pop();
         Value collection = Pop();
 
+        // Missing keys evaluate to nil.
+        if (Is_Map(collection)) {
+            Value value;
+            if (!dict_get(&As_Map(collection)->dict, offset, &value)) {
+                value = Nil_Value;
+            }
+
+            Push(value);
+            Dispatch();
+        }
+
+        if (Is_Typed_Array(collection)) {
+            RavTypedArray *array = As_Typed_Array(collection);
+            if (!Is_Num(offset)) {
+                Runtime_Error("index an array with non-numeric type");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            size_t index = (size_t)As_Num(offset);
+            if (index >= array->count) {
+                Runtime_Error("index out of bound %d > %d",
+                              index, array->count);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            Push(typed_array_get(array, index));
+            Dispatch();
+        }
+
         if (!Is_Array(collection)) {
             Runtime_Error("index a non-collection type");
             return INTERPRET_RUNTIME_ERROR;
@@ -428,7 +815,7 @@ static InterpretResult run_vm(register VM *vm) {
             Value key = offset[i];
             Value value = offset[i+1];
 
-            table_set(&map->table, As_String(key), value);
+            dict_set(&map->dict, key, value);
         }
 
         vm->stack_top -= count;
@@ -446,7 +833,7 @@ static InterpretResult run_vm(register VM *vm) {
             Value key = offset[i];
             Value value = offset[i+1];
 
-            table_set(&map->table, As_String(key), value);
+            dict_set(&map->dict, key, value);
         }
 
         vm->stack_top -= count;
@@ -455,35 +842,47 @@ static InterpretResult run_vm(register VM *vm) {
         Dispatch();
     }
 
+    // The variable instructions are shared by the 1-byte and the wide
+    // 2-bytes index variants.
+#define Set_Global(index)                                       \
+    do {                                                        \
+        if (Is_Void(vm->global_buffer[index])) {                \
+            Runtime_Error("unbound variable '%s'",              \
+                          global_name_at(vm, index));           \
+            return INTERPRET_RUNTIME_ERROR;                     \
+        }                                                       \
+                                                                \
+        vm->global_buffer[index] = Peek(0);                     \
+    } while (false)
+
+#define Get_Global(index)                                       \
+    do {                                                        \
+        Value value = vm->global_buffer[index];                 \
+                                                                \
+        if (Is_Void(value)) {                                   \
+            Runtime_Error("unbound variable '%s'",              \
+                          global_name_at(vm, index));           \
+            return INTERPRET_RUNTIME_ERROR;                     \
+        }                                                       \
+                                                                \
+        Push(value);                                            \
+    } while (false)
+
     Case(OP_DEF_GLOBAL): {
         vm->global_buffer[Read_Byte()] = Pop();
+        vm->definitions++;
         Dispatch();
     }
 
     Case(OP_SET_GLOBAL): {
         uint8_t index = Read_Byte();
-
-        if (Is_Void(vm->global_buffer[index])) {
-            Runtime_Error("unbound variable '%s'",
-                            global_name_at(vm, index));
-            return INTERPRET_RUNTIME_ERROR;
-        }
-
-        vm->global_buffer[index] = Peek(0);
+        Set_Global(index);
         Dispatch();
     }
 
     Case(OP_GET_GLOBAL): {
         uint8_t index = Read_Byte();
-        Value value = vm->global_buffer[index];
-
-        if (Is_Void(value)) {
-            Runtime_Error("unbound variable '%s'",
-                            global_name_at(vm, index));
-            return INTERPRET_RUNTIME_ERROR;
-        }
-
-        Push(value);
+        Get_Global(index);
         Dispatch();
     }
 
@@ -507,13 +906,69 @@ static InterpretResult run_vm(register VM *vm) {
         Dispatch();
     }
 
+    Case(OP_GET_CAPTURE): {
+        Push(frame.closure->captures[Read_Byte()]);
+        Dispatch();
+    }
+
+    Case(OP_DEF_GLOBAL_16): {
+        vm->global_buffer[Read_Short()] = Pop();
+        vm->definitions++;
+        Dispatch();
+    }
+
+    Case(OP_SET_GLOBAL_16): {
+        uint16_t index = Read_Short();
+        Set_Global(index);
+        Dispatch();
+    }
+
+    Case(OP_GET_GLOBAL_16): {
+        uint16_t index = Read_Short();
+        Get_Global(index);
+        Dispatch();
+    }
+
+    Case(OP_SET_LOCAL_16): {
+        frame.slots[Read_Short()] = Peek(0);
+        Dispatch();
+    }
+
+    Case(OP_GET_LOCAL_16): {
+        Push(frame.slots[Read_Short()]);
+        Dispatch();
+    }
+
+    Case(OP_SET_UPVALUE_16): {
+        *frame.closure->upvalues[Read_Short()]->location = Peek(0);
+        Dispatch();
+    }
+
+    Case(OP_GET_UPVALUE_16): {
+        Push(*frame.closure->upvalues[Read_Short()]->location);
+        Dispatch();
+    }
+
+    Case(OP_GET_CAPTURE_16): {
+        Push(frame.closure->captures[Read_Short()]);
+        Dispatch();
+    }
+
+#undef Get_Global
+#undef Set_Global
+
     Case(OP_CALL): {
         int argument_count = Read_Byte();
         Value value = Peek(argument_count);
 
         Save_Frame();
         if (!call_value(vm, value, argument_count)) {
-            return INTERPRET_RUNTIME_ERROR;
+            if (!Switch_Coroutine(argument_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            // A coroutine resumed from C yielded.
+            if (At_Base()) return INTERPRET_OK;
         }
 
         // Push the callee new call frame.
@@ -522,6 +977,51 @@ static InterpretResult run_vm(register VM *vm) {
         Dispatch();
     }
 
+    Case(OP_CALL_CONS): {
+        int argument_count = Read_Byte();
+        Value value = Peek(argument_count);
+        RavFunction *function = frame.closure->function;
+
+        // A self recursive call, which result is consed then returned.
+        // Instead of a new frame, the pair is linked to the list of the
+        // frame, and the frame is restarted with the call arguments.
+        if (Is_Closure(value) && As_Closure(value) == frame.closure &&
+            argument_count == function->arity) {
+            Value *head = vm->stack_top - argument_count - 2;
+            RavPair *pair = new_pair(&vm->allocator, *head, Nil_Value);
+
+            if (frame.hole == NULL) {
+                frame.root = pair;
+            } else {
+                frame.hole->tail = Obj_Value(pair);
+            }
+            frame.hole = pair;
+
+            if (frame.has_captures) close_upvalues(vm, frame.slots);
+            frame.has_captures = false;
+
+            memmove(frame.slots + 1, vm->stack_top - argument_count,
+                    argument_count * sizeof (Value));
+            vm->stack_top = frame.slots + argument_count + 1;
+            frame.ip = function->chunk.opcodes;
+
+            Save_Frame();
+            Dispatch();
+        }
+
+        Save_Frame();
+        if (!call_value(vm, value, argument_count)) {
+            if (!Switch_Coroutine(argument_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            if (At_Base()) return INTERPRET_OK;
+        }
+
+        frame = vm->frames[vm->frame_count - 1];
+        Dispatch();
+    }
+
     Case(OP_JMP): {
         uint16_t offset = Read_Short();
         frame.ip += offset;
@@ -546,25 +1046,99 @@ static InterpretResult run_vm(register VM *vm) {
         Dispatch();
     }
 
-    Case(OP_CLOSURE): {
-        RavFunction *function = As_Function(Read_Constant());
-        RavClosure *closure = new_closure(&vm->allocator, function);
-        Push(Obj_Value(closure));
+    Case(OP_JMP_24): {
+        uint32_t offset = Read_Long();
+        frame.ip += offset;
+        Dispatch();
+    }
+
+    Case(OP_JMP_BACK_24): {
+        uint32_t offset = Read_Long();
+        frame.ip -= offset;
+        Dispatch();
+    }
 
-        for (int i = 0; i < closure->upvalue_count; i++) {
-            uint8_t is_local = Read_Byte();
-            uint8_t index = Read_Byte();
+    Case(OP_JMP_FALSE_24): {
+        uint32_t offset = Read_Long();
+        if (is_falsy(Peek(0))) frame.ip += offset;
+        Dispatch();
+    }
 
-            closure->upvalues[i] = is_local ?
-                capture_upvalue(vm, frame.slots + index) :
-                frame.closure->upvalues[index];
-        }
+    Case(OP_JMP_POP_FALSE_24): {
+        uint32_t offset = Read_Long();
+        if (is_falsy(Pop())) frame.ip += offset;
+        Dispatch();
+    }
+
+    // The inlined body of a call follows its slow path, it's taken as
+    // long as the global still holds the inlined function.
+    Case(OP_JMP_INLINED): {
+        uint16_t offset = Read_Short();
+        Value callee = vm->global_buffer[Read_Short()];
+        Value function =
+            frame.closure->function->chunk.constants[Read_Short()];
 
+        if (Is_Closure(callee) &&
+            As_Closure(callee)->function == As_Function(function)) {
+            frame.ip += offset;
+        }
         Dispatch();
     }
 
+    // The jump table maps each case constant to the offset of its code,
+    // the next instruction is taken if the popped value isn't a case.
+#define Switch(Read_Index)                                              \
+    do {                                                                \
+        Chunk *chunk = &frame.closure->function->chunk;                 \
+        RavMap *table = As_Map(chunk->constants[Read_Index()]);         \
+        Value offset;                                                   \
+                                                                        \
+        if (dict_get(&table->dict, Pop(), &offset)) {                   \
+            frame.ip += (int)As_Num(offset);                            \
+        }                                                               \
+    } while (false)
+
+    Case(OP_SWITCH):    Switch(Read_Byte);  Dispatch();
+    Case(OP_SWITCH_16): Switch(Read_Short); Dispatch();
+
+#undef Switch
+
+#define Make_Closure(Read_Index)                                        \
+    do {                                                                \
+        Chunk *chunk = &frame.closure->function->chunk;                 \
+        RavFunction *function = As_Function(chunk->constants[Read_Index()]); \
+        RavClosure *closure = new_closure(&vm->allocator, function);    \
+        Push(Obj_Value(closure));                                       \
+                                                                        \
+        for (int i = 0; i < closure->upvalue_count; i++) {              \
+            uint8_t is_local = Read_Byte();                             \
+            int index = Read_Index();                                   \
+                                                                        \
+            if (is_local) {                                             \
+                closure->upvalues[i] =                                  \
+                    capture_upvalue(vm, frame.slots + index);           \
+                frame.has_captures = true;                              \
+            } else {                                                    \
+                closure->upvalues[i] = frame.closure->upvalues[index];  \
+            }                                                           \
+        }                                                               \
+                                                                        \
+        for (int i = 0; i < closure->capture_count; i++) {              \
+            uint8_t is_local = Read_Byte();                             \
+            int index = Read_Index();                                   \
+                                                                        \
+            closure->captures[i] = is_local ?                           \
+                frame.slots[index] : frame.closure->captures[index];    \
+        }                                                               \
+    } while (false)
+
+    Case(OP_CLOSURE):    Make_Closure(Read_Byte);  Dispatch();
+    Case(OP_CLOSURE_16): Make_Closure(Read_Short); Dispatch();
+
+#undef Make_Closure
+
     Case(OP_CLOSE_UPVALUE): {
-        close_upvalues(vm, vm->stack_top - 1);
+        close_upvalue(vm, vm->stack_top - 1);
         Pop();
         Dispatch();
     }
@@ -583,22 +1157,41 @@ static InterpretResult run_vm(register VM *vm) {
 
     Case(OP_RETURN): {
         Value result = Pop();
-        close_upvalues(vm, frame.slots);
+
+        // Frames which never captured their slots have nothing to close.
+        if (frame.has_captures) close_upvalues(vm, frame.slots);
+
+        // The result completes the list built by OP_CALL_CONS.
+        if (frame.hole != NULL) {
+            frame.hole->tail = result;
+            result = Obj_Value(frame.root);
+        }
 
         // Rewind the stack.
         vm->frame_count--;
         vm->stack_top = frame.slots;
         Push(result);
 
+        if (At_Base()) return INTERPRET_OK;
+
+        // The function of a coroutine returned, its result is the one
+        // of the 'resume' call.
+        if (vm->frame_count == 0) {
+            leave_coroutine(vm, COROUTINE_DEAD);
+            push(vm, result);
+
+            if (At_Base()) return INTERPRET_OK;
+        }
+
         frame = vm->frames[vm->frame_count - 1];
         Dispatch();
     }
 
     Case(OP_EXIT): {
-        print_value(vm->x);
-        putchar('\n');
-        Pop(); // Top-level Wrapping Function
+        // The value of the last expression statement is kept in x.
+        Value x = vm->x;
         reset_stack(vm);
+        vm->x = x;
         return INTERPRET_OK;
     }
     }
@@ -608,6 +1201,8 @@ static InterpretResult run_vm(register VM *vm) {
 
 #undef Binary_OP
 #undef Runtime_Error
+#undef Switch_Coroutine
+#undef At_Base
 #undef Save_Frame
 #undef Peek
 #undef Pop
@@ -615,6 +1210,7 @@ static InterpretResult run_vm(register VM *vm) {
 #undef Read_Short
 #undef Read_String
 #undef Read_Constant
+#undef Read_Long
 #undef Read_Byte
 #undef Dispatch
 #undef Case
@@ -622,13 +1218,10 @@ static InterpretResult run_vm(register VM *vm) {
 #undef Log_Execution
 }
 
-InterpretResult interpret(VM *vm, const char *source, const char *path) {
-    // Disable the GC while compiling.
-    vm->allocator.gc_off = true;
-
-    RavFunction *function = compile(vm, source, path);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
+// Run the top-level function of a compiled script, the GC must be
+// disabled since the compilation.
+static InterpretResult execute(VM *vm, RavFunction *function,
+                               const char *path) {
     // The compiler already reserve this slot for the function.
     // Push the function, so the GC doesn't free its memory
     // when allocating the closure object.
@@ -640,6 +1233,245 @@ InterpretResult interpret(VM *vm, const char *source, const char *path) {
     push_frame(vm, closure, 0);
 
     vm->path = path;
+    vm->x = Nil_Value;
+    vm->allocator.gc_off = false;
+    return run_vm(vm, vm->frames, vm->frame_count - 1);
+}
+
+// Print the value of the last expression statement of a script.
+static InterpretResult print_result(VM *vm, InterpretResult result) {
+    if (result == INTERPRET_OK) {
+        print_value(vm->x);
+        putchar('\n');
+    }
+
+    return result;
+}
+
+InterpretResult interpret(VM *vm, const char *source, const char *path) {
+    // Disable the GC while compiling.
+    vm->allocator.gc_off = true;
+
+    RavFunction *function = compile(vm, source, path);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+    return print_result(vm, execute(vm, function, path));
+}
+
+InterpretResult interpret_cached(VM *vm, const char *source,
+                                 const char *path, const char *cache_path) {
+    // Disable the GC while compiling or loading.
+    vm->allocator.gc_off = true;
+
+    RavFunction *function = read_cache(vm, cache_path, source);
+
+    if (function == NULL) {
+        function = compile(vm, source, path);
+        if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+        // Failing to write the cache (e.g. a read-only directory) only
+        // costs the next runs a compilation.
+        write_cache(vm, function, cache_path, source);
+    }
+
+    return print_result(vm, execute(vm, function, path));
+}
+
+bool compile_cached(VM *vm, const char *source, const char *path,
+                    const char *cache_path) {
+    vm->allocator.gc_off = true;
+
+    RavFunction *function = compile(vm, source, path);
+    if (function == NULL) return false;
+
+    if (!write_cache(vm, function, cache_path, source)) {
+        fprintf(stderr, "Fatal: error writing '%s'\n", cache_path);
+        return false;
+    }
+
+    return true;
+}
+
+/** Embedding API **/
+
+RavScript *prepare_script(VM *vm, const char *source, const char *path) {
+    vm->allocator.gc_off = true;
+    RavFunction *function = compile(vm, source, path);
     vm->allocator.gc_off = false;
-    return run_vm(vm);
+
+    if (function == NULL) return NULL;
+
+    RavScript *script = malloc(sizeof (RavScript));
+    script->function = function;
+    script->path = strdup(path);
+
+    pin_value(vm, Obj_Value(function));
+    return script;
+}
+
+InterpretResult run_script(VM *vm, RavScript *script) {
+    // Like right after the compilation, until the closure is pushed.
+    vm->allocator.gc_off = true;
+    return execute(vm, script->function, script->path);
+}
+
+void release_script(VM *vm, RavScript *script) {
+    unpin_value(vm, Obj_Value(script->function));
+
+    // The errors reported from then on, by the functions of the script
+    // still called, no longer name its file.
+    if (vm->path == script->path) vm->path = "raven";
+    free(script->path);
+    free(script);
+}
+
+InterpretResult call_function(VM *vm, Value callee, int count,
+                              Value *args, Value *result) {
+    if (vm->stack_top + count + 1 > vm->stack_end) {
+        runtime_error(vm, "call stack overflows");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    // The callee and the arguments are on the stack during the call, so
+    // they're reachable by the GC.
+    push(vm, callee);
+    for (int i = 0; i < count; i++) {
+        push(vm, args[i]);
+    }
+
+    // A native may call back in the middle of an expression statement,
+    // the x register of its caller is kept.
+    Value x = vm->x;
+
+    // The callee can't yield across the call, even a native.
+    int frame_count = vm->frame_count;
+    InterpretResult status = INTERPRET_OK;
+    vm->callback_depth++;
+
+    if (!call_value(vm, callee, count)) {
+        // Only the dispatch loop can switch the stacks.
+        if (vm->switching) {
+            runtime_error(vm, "cannot resume or yield from a native call");
+        }
+
+        status = INTERPRET_RUNTIME_ERROR;
+    } else if (vm->frame_count > frame_count) {
+        // A closure got a new frame, run until it returns to this frame
+        // count, a native already returned.
+        status = run_vm(vm, vm->frames, frame_count);
+    }
+
+    vm->callback_depth--;
+    if (status != INTERPRET_OK) return status;
+
+    vm->x = x;
+    *result = pop(vm);
+    return INTERPRET_OK;
+}
+
+InterpretResult resume_coroutine(VM *vm, RavCoroutine *coroutine, int count,
+                                 Value *args, Value *result) {
+    if (coroutine->state != COROUTINE_SUSPENDED) {
+        runtime_error(vm, "the coroutine is %s",
+                      coroutine->state == COROUTINE_DEAD ? "dead"
+                                                         : "running");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    if (coroutine->started && count > 1) {
+        runtime_error(vm, "expect at most 1 argument, but got %d", count);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    // Room for the value it yields or returns.
+    if (vm->stack_top + 1 > vm->stack_end) {
+        runtime_error(vm, "call stack overflows");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    // The run returns once the control is back to these frames.
+    CallFrame *frames = vm->frames;
+    int frame_count = vm->frame_count;
+    Value x = vm->x;
+
+    // The coroutine can only yield at this depth.
+    vm->callback_depth++;
+    InterpretResult status = INTERPRET_RUNTIME_ERROR;
+
+    if (enter_coroutine(vm, coroutine, count, args, true)) {
+        status = run_vm(vm, frames, frame_count);
+    }
+
+    vm->callback_depth--;
+    if (status != INTERPRET_OK) return status;
+
+    vm->x = x;
+    *result = pop(vm);
+    return INTERPRET_OK;
+}
+
+void fail_coroutine(VM *vm, RavCoroutine *coroutine, const char *message) {
+    // It's entered with nil as the result of its yield, so the stack trace
+    // starts from its frames.
+    enter_coroutine(vm, coroutine, 0, NULL, true);
+    runtime_error(vm, "%s", message);
+}
+
+// Return the index of the global of a given name, or -1 if there is
+// no such global.
+static int global_index(VM *vm, const char *name, RavString **string) {
+    bool gc_off = vm->allocator.gc_off;
+    vm->allocator.gc_off = true;
+    *string = new_string(&vm->allocator, name, (int)strlen(name));
+    vm->allocator.gc_off = gc_off;
+
+    Value index;
+    if (!table_get(&vm->globals, *string, &index)) return -1;
+
+    return (int)As_Num(index);
+}
+
+bool get_global(VM *vm, const char *name, Value *value) {
+    RavString *string;
+    int index = global_index(vm, name, &string);
+    if (index == -1 || Is_Void(vm->global_buffer[index])) return false;
+
+    *value = vm->global_buffer[index];
+    return true;
+}
+
+bool set_global(VM *vm, const char *name, Value value) {
+    RavString *string;
+    int index = global_index(vm, name, &string);
+
+    if (index == -1) {
+        if (vm->globals.count >= GLOBALS_LIMIT) return false;
+        index = add_global(vm, string);
+    }
+
+    // The inlined calls of the global take the new value (see
+    // OP_JMP_INLINED), the later compiled ones look it up.
+    dict_remove(&vm->inlined_globals, Num_Value((double)index));
+    vm->global_buffer[index] = value;
+    vm->definitions++;
+    return true;
+}
+
+void pin_value(VM *vm, Value value) {
+    if (!Is_Obj(value)) return;
+
+    Value count = Num_Value(0);
+    dict_get(&vm->pinned, value, &count);
+    dict_set(&vm->pinned, value, Num_Value(As_Num(count) + 1));
+}
+
+void unpin_value(VM *vm, Value value) {
+    Value count;
+    if (!Is_Obj(value) || !dict_get(&vm->pinned, value, &count)) return;
+
+    if (As_Num(count) > 1) {
+        dict_set(&vm->pinned, value, Num_Value(As_Num(count) - 1));
+    } else {
+        dict_remove(&vm->pinned, value);
+    }
 }
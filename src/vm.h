@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "dict.h"
 #include "mem.h"
 #include "table.h"
 #include "value.h"
@@ -11,31 +12,114 @@ typedef struct {
     RavClosure *closure;
     uint8_t *ip;
     Value *slots;
+    bool has_captures; // Did it create upvalues over its own slots?
+
+    // The list built by the self recursive calls of OP_CALL_CONS, its
+    // last pair tail is the hole filled by the frame return value.
+    RavPair *root;
+    RavPair *hole;
 } CallFrame;
 
+// The stacks of a line of execution, the main one or a coroutine's.
+typedef struct {
+    Value *stack;
+    Value *stack_top;
+    Value *stack_end;
+
+    CallFrame *frames;
+    int frame_count;
+    int frames_limit;
+
+    // Open upvalues indexed by the stack slot they refer to, so the
+    // capturing and the closing of a slot don't have to search for it.
+    RavUpvalue **open_upvalues;
+} Stacks;
+
+typedef struct RavIsolate RavIsolate;
+typedef struct RavTask RavTask;
+typedef struct Scheduler Scheduler;
+typedef struct Worker Worker;
+
 // Virtual Machine Image
 typedef struct {
     Allocator allocator;
     const char *path; // Name of the file being executed.
 
     Value x;  // Register to store last evaluated expression.
-    Value stack[STACK_SIZE];
-    Value *stack_top;
 
-    CallFrame frames[FRAMES_LIMIT];
+    // The stacks in use, the main ones or those of the running
+    // coroutine (see Stacks).
+    Value *stack;
+    Value *stack_top;
+    Value *stack_end;
+    CallFrame *frames;
     int frame_count;
+    int frames_limit;
+    RavUpvalue **open_upvalues;
+
+    // The running coroutine, or NULL if it's the main line of execution,
+    // which stacks are saved in 'main' while a coroutine runs.
+    RavCoroutine *coroutine;
+    Stacks main;
+
+    // A switch of coroutine requested by the natives 'resume' (to the
+    // given coroutine) and 'yield' (to NULL, the resumer of the running
+    // one). It's performed by the dispatch loop once the native returns,
+    // passing the value.
+    bool switching;
+    RavCoroutine *switch_to;
+    Value switch_value;
+
+    // Number of nested calls back from the natives into the dispatch
+    // loop, a coroutine can't yield across them.
+    int callback_depth;
 
     // Map each used global name to its index at the global variables
     // buffer. It's populated at compile time, as the parser resolve
     // the identifiers.
     Table globals;
 
-    // Used to obtain globals variables at runtime.
-    Value global_buffer[GLOBALS_LIMIT];
+    // Used to obtain globals variables at runtime, it grows as the
+    // globals get registered.
+    Value *global_buffer;
+    int global_capacity;
+    int definitions;  // Count, the scheduler tells its snapshots are stale
+
+    // The inlinable global functions by their index, their calls get
+    // inlined by the compiler, guarded by OP_JMP_INLINED. A global is
+    // dropped once it's bound again.
+    Dict inlined_globals;
+
+    // Values held by the embedder (see raven.h), by their pin count.
+    Dict pinned;
+
+    // The isolates spawned by the scripts, indexed by their handle, or
+    // NULL once joined (see isolate.h).
+    RavIsolate **isolates;
+    int isolates_count;
+    int isolates_capacity;
+
+    // The scheduler running the tasks spawned by the scripts, shared with
+    // the vms of its workers, and the worker running this vm if it's one
+    // of them (see scheduler.h).
+    Scheduler *scheduler;
+    Worker *worker;
+
+    // The futures of the tasks spawned by the scripts of this vm, which
+    // aren't awaited yet, they're roots of the GC.
+    RavFuture **futures;
+    int futures_count;
+    int futures_capacity;
 
-    // Intrusive linked list of all available open opvalues.
-    // TODO: experiment with using a hash table instead.
-    RavUpvalue *open_upvalues;
+    // The regions of frozen values referenced by this vm, it holds a
+    // reference to each of them until a GC round doesn't reach them.
+    Regions regions;
+
+    // The storage of the main stacks, allocated apart so the vm is small
+    // enough to be a local of the embedder.
+    Value *main_stack;
+    CallFrame *main_frames;
+    RavUpvalue **main_upvalues;
 } VM;
 
 typedef enum {
@@ -50,8 +134,32 @@ void init_vm(VM *vm);
 // Free the resources owned by the vm.
 void free_vm(VM *vm);
 
+// Register a new global name, and return its index at the globals
+// buffer, the global is unbound until it gets defined.
+int add_global(VM *vm, RavString *name);
+
+// Report a runtime error with a stack trace, and reset the vm stack.
+// The running coroutines are unwound as well, and left dead.
+void runtime_error(VM *vm, const char *format, ...);
+
+// Report a runtime error in a suspended coroutine, as if it was raised at
+// the point it's suspended at, the coroutine is left dead, and the code
+// calling this goes on, like on an error while resumed by C.
+void fail_coroutine(VM *vm, RavCoroutine *coroutine, const char *message);
+
 // Execute the given source code, and return
 // the interpretation result.
 InterpretResult interpret(VM *vm, const char *source, const char *path);
 
+// Execute the given source code like interpret, but load its compiled
+// code from the cache file at 'cache_path' if it's up to date, else
+// compile the source and write the cache file.
+InterpretResult interpret_cached(VM *vm, const char *source,
+                                 const char *path, const char *cache_path);
+
+// Compile the given source code into the cache file at 'cache_path',
+// without executing it. Return false on a compile or write error.
+bool compile_cached(VM *vm, const char *source, const char *path,
+                    const char *cache_path);
+
 #endif